@@ -0,0 +1,22 @@
+# Writes OUTPUT, a C++ source holding every kernels/*.cl file as a string constant
+# (see include/embeddedKernels.h). Run by the build whenever a kernel changes:
+#   cmake -DKERNEL_DIR=<dir> -DOUTPUT=<file> -P embedKernels.cmake
+
+file(GLOB kernels RELATIVE ${KERNEL_DIR} "${KERNEL_DIR}/*.cl")
+list(SORT kernels)
+
+set(content "// Generated from kernels/*.cl by cmake/embedKernels.cmake, do not edit\n\n#include \"embeddedKernels.h\"\n\nconst embeddedKernel embeddedKernels[] = {\n")
+foreach(kernel ${kernels})
+    file(READ ${KERNEL_DIR}/${kernel} source)
+    # Raw string literal, so the source needs no escaping
+    string(APPEND content "    {\"${kernel}\", R\"clsource(${source})clsource\"},\n")
+endforeach()
+string(APPEND content "    {NULL, NULL}\n};\n")
+
+# Only rewritten when a kernel changed, so the library is not recompiled for nothing
+if(EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} previous)
+endif()
+if(NOT "${content}" STREQUAL "${previous}")
+    file(WRITE ${OUTPUT} "${content}")
+endif()
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "clSession.h"
+#include <functional>
+#include <vector>
+
+// Handle to one enqueued command. Copies share its event (retained and released).
+// A default constructed future counts as already completed; the future of a command
+// that could not be enqueued holds no event, only the error.
+class deviceFuture {
+    public:
+
+    deviceFuture() {}
+    // Takes ownership of 'event'; without an event the future reports 'error'
+    explicit deviceFuture(cl_event event, cl_int error = CL_SUCCESS) : ev(event), err(error) {}
+    deviceFuture(const deviceFuture& other);
+    deviceFuture& operator=(const deviceFuture& other);
+    ~deviceFuture();
+
+    cl_event event() const { return ev; }
+    // Enqueue error, CL_SUCCESS if the command was enqueued
+    cl_int error() const { return err; }
+    // Completed, successfully or not, without blocking
+    bool ready() const;
+    // Blocks until the command completes: CL_SUCCESS, the enqueue error, or the negative
+    // execution status of a command that failed on the device
+    cl_int wait() const;
+    // Calls 'callback' with the status wait() would return once the command completes
+    // (clSetEventCallback). It runs on a thread of the OpenCL runtime, so it should be
+    // short and must not block on OpenCL calls; immediately if there is no event.
+    cl_int then(std::function<void(cl_int)> callback) const;
+
+    private:
+
+    cl_event ev = NULL;
+    cl_int err = CL_SUCCESS;
+};
+
+// Asynchronous command stream on a session. Every call enqueues without blocking and
+// returns a deviceFuture, and a command starts only after the futures in its 'after'
+// list. The queue is added to the session out-of-order where the device supports it,
+// so commands not ordered by a dependency (the next batch's upload and the current
+// kernel) may overlap; on other devices the same code runs in submission order.
+// Host memory given to write() / read() and the buffers involved must stay valid
+// until the command's future completes.
+class asyncQueue {
+    public:
+
+    typedef std::vector<deviceFuture> futures;
+
+    // Takes a queue from the session, see error()
+    asyncQueue(clSession& session);
+    // Waits for every command and gives the queue back to the session
+    ~asyncQueue();
+
+    asyncQueue(const asyncQueue&) = delete;
+    asyncQueue& operator=(const asyncQueue&) = delete;
+
+    // Error creating the queue; if set, every command fails with it
+    cl_int error() const { return err; }
+    bool outOfOrder() const;
+    // Session queue index the commands go to
+    unsigned index() const { return q; }
+
+    deviceFuture write(cl_mem buffer, const void* host, size_t bytes, const futures& after = futures());
+    deviceFuture read(cl_mem buffer, void* host, size_t bytes, const futures& after = futures());
+    deviceFuture vectorAdd(cl_mem A, cl_mem B, cl_mem C, size_t n, const futures& after = futures());
+    deviceFuture elementwise(clSession::elementwiseOp op, cl_mem out, cl_mem X, cl_mem Y, cl_mem Z, float a, size_t n,
+                             const futures& after = futures());
+    deviceFuture matrixMult(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N,
+                            clSession::gemmKernel variant = clSession::GEMM_TILED, const futures& after = futures());
+    // Completes once everything in 'after' has, or every command enqueued so far if empty
+    deviceFuture join(const futures& after = futures());
+
+    // Submits the enqueued commands to the device without waiting for them
+    cl_int flush();
+    cl_int finish();
+
+    private:
+
+    clSession& session;
+    unsigned q;
+    cl_int err = CL_SUCCESS;
+
+    // Events of 'after'; fails with the queue's error or the first enqueue error among them
+    cl_int waitList(const futures& after, std::vector<cl_event>& events) const;
+    // Future for a command enqueued with result 'ret' and event 'ev', recorded by the profiler
+    deviceFuture track(cl_int ret, cl_event ev, clProfiler::stage st, const char* label, double bytes);
+};
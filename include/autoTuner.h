@@ -0,0 +1,61 @@
+#pragma once
+
+#include "clSession.h"
+#include <iostream>
+#include <string>
+#include <map>
+#include <functional>
+
+// Searches the launch configuration of the session's tunable kernels and keeps the
+// winners in a small text database, keyed by device (name and driver version), kernel
+// and problem size bucket. Later runs find them there without searching again.
+//
+// matrixMultTiled: tile (TS) and outputs per work-item (WPT), i.e. local size {TS, TS / WPT}
+// elementwise (timed on ew_add): vector width (VW) and work-group size
+//
+// Candidates exceeding CL_DEVICE_MAX_WORK_GROUP_SIZE, the kernel's CL_KERNEL_WORK_GROUP_SIZE,
+// the work-item limits or the local memory are skipped; work-group sizes that are not a
+// multiple of CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE are only tried if nothing else fits.
+//
+// The database is CL_TUNE_DB, or cltune.db in the working directory.
+class autoTuner {
+    public:
+
+    autoTuner(clSession& session, const std::string& path = "");
+
+    // Configuration for the size bucket of the problem. On a database miss it is
+    // searched and stored, unless searching is disabled, then the defaults are returned.
+    clSession::kernelConfig gemm(int M, int K, int N);
+    clSession::kernelConfig elementwise(size_t n);
+
+    void setSearch(bool enable) { search = enable; }
+
+    unsigned hits() const { return nHits; }
+    unsigned searches() const { return nSearches; }
+    void report(std::ostream& os = std::cout) const;
+
+    private:
+
+    struct record {
+        clSession::kernelConfig config;
+        double us; // kernel time of the winner when it was measured
+    };
+
+    clSession& session;
+    std::string path;
+    std::string deviceKey;
+    std::map<std::string, record> db; // "device \t kernel \t bucket" -> winner
+    bool search = true;
+    unsigned nHits = 0;
+    unsigned nSearches = 0;
+    double searchMs = 0;
+
+    bool lookup(const std::string& key, clSession::kernelConfig& config);
+    void load();
+    void save() const;
+
+    // Median kernel time in us of 'launch', < 0 if it failed
+    double time(const std::function<cl_int()>& launch);
+    record searchGemm(int M, int K, int N);
+    record searchElementwise(size_t n);
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "CL/cl.h"
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include <map>
+#include <utility>
+
+// Size-class pool of device buffers.
+// Requests up to maxSubBuffer bytes are rounded up to a power of two and carved out of
+// larger slabs with clCreateSubBuffer. Larger ones get classes a quarter of a power of
+// two apart (at most 25% over the request), never above CL_DEVICE_MAX_MEM_ALLOC_SIZE.
+// Released buffers go back to a free list for their class and are handed out again
+// instead of calling clCreateBuffer.
+class bufferPool {
+    public:
+
+    struct stats {
+        size_t requests = 0;
+        size_t hits = 0;       // served from a free list
+        size_t misses = 0;     // needed a new buffer or sub-buffer
+        size_t bytesInUse = 0; // size-class bytes currently handed out
+        size_t highWater = 0;  // peak of bytesInUse
+        size_t requestedInUse = 0;    // bytes asked for by the buffers handed out
+        size_t requestedHighWater = 0;// peak of requestedInUse, the real demand
+        size_t bytesCached = 0;// size-class bytes sitting in free lists
+        size_t slabBytes = 0;  // bytes reserved in slabs
+        size_t slabs = 0;
+
+        double hitRate() const { return requests ? (double)hits / requests : 0.0; }
+    };
+
+    bufferPool(cl_context clContext, cl_device_id device,
+               size_t slabSize = 16 << 20, size_t maxSubBuffer = 1 << 20);
+    ~bufferPool();
+
+    bufferPool(const bufferPool&) = delete;
+    bufferPool& operator=(const bufferPool&) = delete;
+
+    // Returns a buffer of at least 'size' bytes, or NULL with the error in 'ret'
+    cl_mem acquire(size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE, cl_int* ret = NULL);
+    // Largest request acquire() can serve in one buffer, the device's max allocation
+    size_t largestRequest() const { return maxAlloc ? maxAlloc : SIZE_MAX; }
+    // Returns a buffer obtained from acquire() to the pool
+    void release(cl_mem buffer);
+    // True for buffers currently handed out by this pool
+    bool owns(cl_mem buffer) const { return inUse.count(buffer) != 0; }
+    // Frees every cached (not in use) stand-alone buffer
+    void trim();
+
+    const stats& statistics() const { return st; }
+    void report(std::ostream& os = std::cout) const;
+
+    private:
+
+    struct slab {
+        cl_mem buffer;
+        size_t used;
+    };
+
+    typedef std::pair<size_t, cl_mem_flags> classKey;
+
+    struct held {
+        classKey key;
+        size_t requested;
+    };
+
+    cl_context clContext;
+    size_t slabSize;
+    size_t maxSubBuffer;
+    size_t align; // CL_DEVICE_MEM_BASE_ADDR_ALIGN in bytes, also the smallest class
+    size_t maxAlloc; // CL_DEVICE_MAX_MEM_ALLOC_SIZE, 0 if unknown
+
+    stats st;
+    std::map<classKey, std::vector<cl_mem>> freeLists;
+    std::map<cl_mem, held> inUse;
+    std::vector<slab> slabs;
+    std::vector<cl_mem> subBuffers;
+
+    size_t sizeClass(size_t size) const;
+    cl_mem carve(size_t bytes, cl_mem_flags flags, cl_int* ret);
+};
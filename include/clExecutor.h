@@ -0,0 +1,100 @@
+#pragma once
+
+#include "clSession.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs operations for any number of host threads on one device.
+// A clSession is not thread-safe: its kernels are shared cl_kernel objects whose
+// arguments are set per launch (clSetKernelArg), and its maps, pool and staging are
+// unguarded. The executor keeps a pool of workers instead, each with a session of
+// its own on the device - its own command queue, kernel instances and buffer pool -
+// only ever touched by that worker's thread, like deviceScheduler does per device.
+// Clients push tasks to one submission queue and get a std::future for the result;
+// whichever worker is free takes the next task, so clients never hold a lock while
+// a command runs. Programs are built once per worker, later ones load the binary
+// from the program cache.
+class clExecutor {
+    public:
+
+    // Latency of a client's tasks in microseconds, from submission to completion
+    struct latencyStats {
+        size_t count = 0;
+        double p50 = 0, p95 = 0, p99 = 0, max = 0;
+        double waitP50 = 0; // median time spent in the submission queue
+    };
+
+    // 'workers' sessions on 'device', 0 picks one per hardware thread up to 4
+    explicit clExecutor(cl_device_id device, unsigned workers = 0);
+    // On the first device of 'type' whose name contains 'name', like clSession
+    clExecutor(cl_device_type type = CL_DEVICE_TYPE_ALL, const std::string& name = "", unsigned workers = 0);
+    // Runs the tasks still queued, then stops the workers
+    ~clExecutor();
+
+    clExecutor(const clExecutor&) = delete;
+    clExecutor& operator=(const clExecutor&) = delete;
+
+    // Reads CL_DEVICE_TYPE and CL_DEVICE_NAME like clSession::fromEnv, and CL_EXECUTOR_WORKERS
+    static clExecutor* fromEnv();
+
+    // CL_DEVICE_NOT_FOUND when no device matched, else the error of a session that failed
+    cl_int error() const { return err; }
+    unsigned workers() const { return sessions.size(); }
+    const std::string& deviceName() const;
+
+    // Everything below may be called from any thread. 'client' names the caller in the
+    // latency statistics. Host memory must stay valid until the future is ready.
+
+    // Runs 'task' on a worker's session; its buffers live in that session's context,
+    // so a task must not keep cl_mem objects across calls. An exception thrown by
+    // 'task' is rethrown by the future's get().
+    std::future<cl_int> submit(unsigned client, std::function<cl_int(clSession&)> task);
+    std::future<cl_int> vectorAdd(unsigned client, const float* A, const float* B, float* C, size_t n);
+    std::future<cl_int> elementwise(unsigned client, clSession::elementwiseOp op, float* out,
+                                    const float* X, const float* Y, const float* Z, float a, size_t n);
+    std::future<cl_int> matrixMult(unsigned client, const float* A, const float* B, float* C, int M, int K, int N,
+                                   clSession::gemmKernel variant = clSession::GEMM_TILED);
+
+    // Per client figures since construction or the last resetStatistics()
+    std::map<unsigned, latencyStats> latencies() const;
+    void resetStatistics();
+    void report(std::ostream& os = std::cout) const;
+
+    private:
+
+    struct task {
+        unsigned client;
+        std::function<cl_int(clSession&)> run;
+        std::promise<cl_int> result;
+        std::chrono::high_resolution_clock::time_point submitted;
+    };
+
+    struct samples {
+        std::vector<double> total, wait;
+    };
+
+    cl_int err = CL_SUCCESS;
+    std::vector<clSession*> sessions;
+    std::vector<std::thread> threads;
+
+    // Submission queue, taken from the front by whichever worker is free
+    std::mutex mutex;
+    std::condition_variable available;
+    std::deque<task> pending;
+    bool stopping = false;
+
+    mutable std::mutex statsMutex;
+    std::map<unsigned, samples> stats;
+
+    void start(cl_device_id device, unsigned workers);
+    void work(size_t worker);
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "CL/cl.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Collects profiling events from queues created with CL_QUEUE_PROFILING_ENABLE.
+// Each recorded command is tagged with its stage and the bytes moved or flops
+// executed, so the report can give GB/s for transfers and GFLOP/s for kernels.
+class clProfiler {
+    public:
+
+    enum stage { HOST_TO_DEVICE, KERNEL, DEVICE_TO_HOST, NUM_STAGES };
+
+    struct entry {
+        stage st;
+        std::string label;
+        double bytes;
+        double flops;
+        // Device timestamps in ns
+        cl_ulong queued, submit, start, end;
+    };
+
+    ~clProfiler();
+
+    // Takes ownership of 'event'. Timestamps are read on resolve().
+    void record(cl_event event, stage st, const std::string& label, double bytes = 0, double flops = 0);
+    // Waits for every pending event and reads its QUEUED/SUBMIT/START/END times
+    void resolve();
+    void clear();
+
+    const std::vector<entry>& entries() { resolve(); return done; }
+
+    // Per-command and per-stage breakdown
+    void report(std::ostream& os = std::cout);
+    // Chrome trace event format (load in chrome://tracing or Perfetto)
+    bool writeChromeTrace(const std::string& path);
+
+    static const char* stageName(stage st);
+    // 'text' as the contents of a JSON string: quotes, backslashes and control characters escaped
+    static std::string jsonEscape(const std::string& text);
+
+    private:
+
+    struct pending {
+        cl_event event;
+        entry e;
+    };
+
+    std::vector<pending> events;
+    std::vector<entry> done;
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include "CL/cl.h"
+#include "bufferPool.h"
+#include "clProfiler.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <functional>
+
+class autoTuner;
+
+// Long-lived OpenCL session.
+// Owns the context, command queue(s), built programs and kernel handles for one
+// device and releases them on destruction, so repeated operations only pay for
+// their own transfers and launches.
+class clSession {
+    public:
+
+    // Selects the first device of 'type' whose name contains 'name' (case insensitive,
+    // empty matches any). error() reports CL_DEVICE_NOT_FOUND if nothing matches.
+    clSession(cl_device_type type = CL_DEVICE_TYPE_ALL, const std::string& name = "", unsigned nQueues = 1);
+    // Session on a given device, e.g. one of devices()
+    explicit clSession(cl_device_id device, unsigned nQueues = 1);
+    ~clSession();
+
+    clSession(const clSession&) = delete;
+    clSession& operator=(const clSession&) = delete;
+
+    // Reads CL_DEVICE_TYPE (cpu, gpu, accelerator, all) and CL_DEVICE_NAME from the environment
+    static clSession* fromEnv(unsigned nQueues = 1);
+    static cl_device_type parseDeviceType(const char* type);
+    // Every device of 'type' whose name contains 'name', over all platforms
+    static std::vector<cl_device_id> devices(cl_device_type type = CL_DEVICE_TYPE_ALL, const std::string& name = "");
+
+    cl_int error() const { return err; }
+    cl_context context() const { return clContext; }
+    cl_device_id device() const { return clDevice; }
+    cl_command_queue queue(unsigned i = 0) const { return queues[i]; }
+    unsigned numQueues() const { return queues.size(); }
+    // Adds a queue created with 'properties' (and profiling) and returns its index, reusing
+    // one given back by releaseQueue when the properties match. Properties the device does
+    // not support are left out. If the queue cannot be created, *ret gets the error and 0
+    // is returned.
+    unsigned addQueue(cl_command_queue_properties properties, cl_int* ret = NULL);
+    // Gives a queue from addQueue back once its commands are done. The index stays valid,
+    // the next addQueue with the same properties gets it again.
+    void releaseQueue(unsigned i);
+    cl_command_queue_properties queueProperties(unsigned i) const;
+    const std::string& deviceName() const { return name; }
+    // Device buffers for the session's operations are recycled through this pool
+    bufferPool& buffers() { return *pool; }
+
+    // Queues are created with CL_QUEUE_PROFILING_ENABLE. When a profiler is attached
+    // every write, kernel and read of the session's operations is recorded in it.
+    void setProfiler(clProfiler* profiler) { prof = profiler; }
+    clProfiler* profiler() const { return prof; }
+
+    // Kernel sources are compiled into the library (embeddedKernels.h). With a directory
+    // set here, or in CL_KERNEL_DIR, they are read from <dir>/<file> instead, e.g. to try
+    // kernel changes without rebuilding. Empty goes back to the embedded sources.
+    void setKernelDir(const std::string& dir) { kernelDir = dir; }
+
+    // Built program for kernels/<file> with 'options'. Built once, then reused.
+    cl_program program(const std::string& file, const std::string& options = "");
+    // Kernel handle owned by the session. Created once, then reused.
+    cl_kernel kernel(const std::string& file, const std::string& kernelName, const std::string& options = "");
+    // Contents of kernels/<file>, empty if there is no such kernel file
+    std::string kernelSource(const std::string& file) const;
+    // Kernel of a generated program, cached under 'key' and 'options'. 'source' is
+    // only called to produce the program text the first time the key is seen. The
+    // least recently used generated programs are released beyond MAX_GENERATED_KERNELS,
+    // so the kernel is only valid until the next call.
+    cl_kernel generatedKernel(const std::string& key, const std::function<std::string()>& source,
+                              const std::string& kernelName, const std::string& options = "");
+
+    // Zero-copy mode: host pointers passed to the operations below are wrapped with
+    // CL_MEM_USE_HOST_PTR and results are read back by mapping instead of copying.
+    // Use page aligned host memory (see alignedHostAlloc) so the driver can skip copies.
+    void setZeroCopy(bool enable) { zeroCopy = enable; }
+    bool zeroCopyEnabled() const { return zeroCopy; }
+
+    // Kernel variants of matrixMult. GEMM_TILED_ACC computes C += A * B.
+    enum gemmKernel { GEMM_NAIVE, GEMM_TILED, GEMM_TILED_ACC };
+
+    // Launch parameters of the tunable kernels
+    struct kernelConfig {
+        int tile = 16;    // tiled GEMM: TS x TS tile per work-group (-DTS)
+        int wpt = 4;      // tiled GEMM: outputs per work-item (-DWPT), local size {tile, tile / wpt}
+        int width = 4;    // elementwise: floats per vector load/store (-DVW)
+        size_t local = 0; // elementwise: work-group size, 0 lets the driver choose
+    };
+
+    // With a tuner attached, the operations below look up (or search) the configuration
+    // for their problem size instead of using the kernelConfig defaults
+    void setTuner(autoTuner* t) { tune = t; }
+    autoTuner* tuner() const { return tune; }
+    kernelConfig gemmConfig(int M, int K, int N);
+    kernelConfig elementwiseConfig(size_t n);
+
+    // Shape specialization of the tiled GEMM: once an M x K x N product has run 'uses'
+    // times, it gets a variant built with the shape as -D constants (SHAPE_M/K/N in
+    // matrix_mult_kernel.cl), which lets the compiler unroll the K loop and drop the edge
+    // checks. Variants are cached like any program, on disk included, for at most
+    // 32 shapes. 0 turns it off. Default: CL_SPECIALIZE, else 3.
+    void setSpecializeAfter(unsigned uses) { specializeUses = uses; }
+    // Builds the variant for a shape known to be hot now, whatever its use count.
+    // CL_BUILD_PROGRAM_FAILURE if it does not build (the generic kernel is used then).
+    cl_int specialize(int M, int K, int N, gemmKernel variant = GEMM_TILED);
+    // Whether M x K x N runs on a specialized variant
+    bool specialized(int M, int K, int N) const;
+
+    // Elementwise operations, see kernels/elementwise_kernel.cl:
+    // out = X + Y, X - Y, X * Y, a * X + Y, a * X or X * Y + Z (fused multiply-add)
+    enum elementwiseOp { EW_ADD, EW_SUB, EW_MUL, EW_AXPY, EW_SCALE, EW_FMA };
+    // Number of buffer operands (X, Y, Z) an operation reads
+    static int elementwiseInputs(elementwiseOp op);
+
+    // C = A + B for n elements (host pointers)
+    cl_int vectorAdd(const float* A, const float* B, float* C, size_t n);
+    // out = op(X, Y, Z, a) for n elements (host pointers, unused operands may be NULL)
+    cl_int elementwise(elementwiseOp op, float* out, const float* X, const float* Y, const float* Z, float a, size_t n);
+    // C (M x N) = A (M x K) * B (K x N), row major host pointers. CL_INVALID_VALUE for a
+    // negative size, CL_INVALID_BUFFER_SIZE if a matrix has more than INT_MAX elements.
+    cl_int matrixMult(const float* A, const float* B, float* C, int M, int K, int N, gemmKernel variant = GEMM_TILED);
+
+    // Batched GEMM, one launch for the whole batch: C_b (M x N) = A_b (M x K) * B_b (K x N)
+    // for b < batch, the matrices of each operand stored back to back
+    cl_int matrixMultBatched(const float* A, const float* B, float* C, int M, int K, int N, int batch);
+    // Pointer-array form with a shape per product: C[b] = A[b] * B[b], A[b] is M[b] x K[b].
+    // The matrices are packed into one upload per operand and unpacked after the launch.
+    // Negative sizes are CL_INVALID_VALUE; packed operands past INT_MAX floats, which the
+    // kernel's int offsets cannot address, CL_INVALID_BUFFER_SIZE.
+    cl_int matrixMultBatched(const float* const* A, const float* const* B, float* const* C,
+                             const int* M, const int* K, const int* N, int batch);
+
+    // fp16 storage: the operands move and sit on the device as IEEE halves, converted
+    // from and to float on the host (Eigen::half, round to nearest even), while the
+    // kernels compute in float. Half the bytes of the float versions are moved.
+    cl_int elementwiseHalf(elementwiseOp op, float* out, const float* X, const float* Y, const float* Z, float a, size_t n);
+    cl_int matrixMultHalf(const float* A, const float* B, float* C, int M, int K, int N, gemmKernel variant = GEMM_TILED);
+
+    // C = A + B streamed in chunks of 'chunk' elements (0 picks a default) round-robin over
+    // all session queues, so the upload of one chunk, the kernel of the previous one and
+    // the readback of the one before that overlap. n may exceed CL_DEVICE_MAX_MEM_ALLOC_SIZE.
+    cl_int vectorAddStreamed(const float* A, const float* B, float* C, size_t n, size_t chunk = 0);
+
+    // Device buffer versions: only enqueue the kernel on queue(queue), no transfers and no wait.
+    // The kernel waits for the events in 'after'; 'done', if given, receives its event
+    // (NULL when the enqueue fails), which the caller releases.
+    cl_int vectorAdd(cl_mem A, cl_mem B, cl_mem C, size_t n, unsigned queue = 0);
+    cl_int matrixMult(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, gemmKernel variant = GEMM_TILED, unsigned queue = 0,
+                      const std::vector<cl_event>& after = std::vector<cl_event>(), cl_event* done = NULL);
+    // At most INT_MAX elements, the kernels count in int (CL_INVALID_VALUE above)
+    cl_int elementwise(elementwiseOp op, cl_mem out, cl_mem X, cl_mem Y, cl_mem Z, float a, size_t n, unsigned queue = 0,
+                       const std::vector<cl_event>& after = std::vector<cl_event>(), cl_event* done = NULL);
+    // Buffers of halves, read and written with vload_half / vstore_half
+    cl_int elementwiseHalf(elementwiseOp op, cl_mem out, cl_mem X, cl_mem Y, cl_mem Z, float a, size_t n, unsigned queue = 0);
+    cl_int matrixMultHalf(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, gemmKernel variant = GEMM_TILED, unsigned queue = 0);
+    // Strided batch: product b reads A + b * strideA and B + b * strideB and writes
+    // C + b * strideC (in floats, 0 means packed back to back). Negative sizes are
+    // CL_INVALID_VALUE, matrices past INT_MAX floats CL_INVALID_BUFFER_SIZE.
+    cl_int matrixMultBatched(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, int batch,
+                             int strideA = 0, int strideB = 0, int strideC = 0, unsigned queue = 0);
+    // One product of a variable-shape batch, offsets in floats into the A, B and C buffers
+    struct gemmBatchEntry {
+        int offsetA, offsetB, offsetC;
+        int M, K, N;
+    };
+    cl_int matrixMultBatched(cl_mem A, cl_mem B, cl_mem C, const std::vector<gemmBatchEntry>& batch, unsigned queue = 0);
+    // Tiled GEMM on sub-matrices (e.g. quadrants): each operand starts 'off' floats into its
+    // buffer and its rows are 'ld' floats apart. accumulate adds the product to C.
+    cl_int matrixMultStrided(cl_mem A, int offA, int lda, cl_mem B, int offB, int ldb, cl_mem C, int offC, int ldc,
+                             int M, int K, int N, bool accumulate = false, unsigned queue = 0);
+    // Reductions of n floats to one value, see kernels/reduce_kernel.cl:
+    // sum X, sum X * Y, sqrt(sum X * X), max X, max |X| and max |X - Y| (a NaN
+    // difference counts as infinite). Y is only read by REDUCE_DOT and REDUCE_MAX_ABS_DIFF.
+    enum reduceOp { REDUCE_SUM, REDUCE_DOT, REDUCE_NORM2, REDUCE_MAX, REDUCE_MAX_ABS, REDUCE_MAX_ABS_DIFF };
+    // Waits for the result, only the scalar is read back. At most INT_MAX elements.
+    cl_int reduce(reduceOp op, cl_mem X, cl_mem Y, size_t n, float* result, unsigned queue = 0);
+    // max |X - reference| / max |reference| (max |X - reference| if the reference is all zeros),
+    // for checking a result against a reference computed on the device
+    cl_int relativeError(cl_mem X, cl_mem reference, size_t n, float* result, unsigned queue = 0);
+    // Sparse A (M rows) times dense B (N columns, row major) into C (M x N), see
+    // kernels/sparse_kernel.cl; N = 1 is SpMV with vectors B and C. sparseMatrix holds
+    // the formats. CSR: rowPtr (M + 1 ints), colIdx and values (nnz entries).
+    cl_int csrMultiply(cl_mem rowPtr, cl_mem colIdx, cl_mem values, int M, size_t nnz, cl_mem B, cl_mem C, int N = 1,
+                       unsigned queue = 0);
+    // ELL: 'width' entries per row stored column major, padding with value 0
+    cl_int ellMultiply(cl_mem colIdx, cl_mem values, int M, int width, cl_mem B, cl_mem C, int N = 1, unsigned queue = 0);
+    // Same with an explicit configuration. matrixMult then always runs the generic tiled
+    // kernel and does not count towards shape specialization, so tuner searches time
+    // every candidate on the same kernel.
+    cl_int elementwise(elementwiseOp op, cl_mem out, cl_mem X, cl_mem Y, cl_mem Z, float a, size_t n,
+                       const kernelConfig& config, unsigned queue = 0);
+    cl_int matrixMult(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, gemmKernel variant, const kernelConfig& config, unsigned queue = 0);
+
+    // Enqueues a kernel written like elementwise_kernel.cl (built with -DVW=config.width,
+    // arguments already set, n as its last argument) with the grid-stride launch geometry.
+    // 'bytes' and 'flops' are what the profiler records for it.
+    cl_int launchElementwise(cl_kernel clKernel, size_t n, const kernelConfig& config, unsigned queue,
+                             const std::string& label, double bytes, double flops,
+                             const std::vector<cl_event>& after = std::vector<cl_event>(), cl_event* done = NULL);
+
+    private:
+
+    cl_int err = CL_SUCCESS;
+    cl_context clContext = NULL;
+    cl_device_id clDevice = NULL;
+    std::vector<cl_command_queue> queues;
+    std::vector<unsigned> freeQueues; // released by releaseQueue, reused by addQueue
+    bufferPool* pool = NULL;
+    clProfiler* prof = NULL;
+    autoTuner* tune = NULL;
+    bool zeroCopy = false;
+    std::string name;
+    std::string kernelDir; // empty: the embedded sources
+    cl_uint computeUnits = 1;
+    size_t maxGroupSize = 1;
+    std::string subGroupOptions; // build options enabling sub-groups, empty if the device has none
+
+    std::map<std::string, cl_program> programs;
+    std::map<std::string, cl_kernel> kernels;
+    std::list<std::string> generatedOrder; // generatedKernel keys, most recently used first
+
+    unsigned specializeUses = 3;
+    std::map<std::string, unsigned> shapeUses;       // "MxKxN" -> tiled GEMM calls
+    std::map<std::string, bool> specializedShapes;   // false once the variant failed to build
+
+    void init(cl_device_id device, unsigned nQueues);
+    // Kernels built for float or (-DHALF_STORAGE) half buffers
+    cl_int elementwiseStorage(elementwiseOp op, cl_mem out, cl_mem X, cl_mem Y, cl_mem Z, float a, size_t n,
+                              const kernelConfig& config, unsigned queue, bool half,
+                              const std::vector<cl_event>& after, cl_event* done);
+    cl_int matrixMultStorage(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, gemmKernel variant,
+                             const kernelConfig& config, unsigned queue, bool half,
+                             const std::vector<cl_event>& after, cl_event* done, bool specializable = true);
+    // Tile shape of the batched GEMM for M x N products
+    static kernelConfig batchedConfig(int M, int N);
+    // Tiled GEMM kernel for a call of shape M x K x N, the specialized variant when the
+    // shape has (or has now earned) one, the generic kernel otherwise
+    cl_kernel gemmKernelFor(const char* kernelName, const std::string& options, int M, int K, int N, bool force = false);
+    static std::string gemmOptions(const kernelConfig& config, bool half);
+
+    // Event slot for an enqueue when profiling, NULL otherwise
+    cl_event* evt(cl_event& e) const { return prof ? &e : NULL; }
+    // Same when the caller also asked for the event in 'done'
+    cl_event* evt(cl_event& e, cl_event* done) const { return prof || done ? &e : NULL; }
+    // Hands the event of a command to the profiler and / or the caller's 'done'
+    void track(cl_int ret, cl_event ev, cl_event* done, clProfiler::stage st, const std::string& label, double bytes, double flops);
+
+    // Host <-> device staging for the host pointer operations, honouring zero-copy mode
+    cl_mem upload(const void* host, size_t bytes, const char* label, cl_int* ret);
+    cl_mem resultBuffer(void* host, size_t bytes, cl_int* ret);
+    cl_int download(cl_mem buffer, void* host, size_t bytes, const char* label);
+    void recycle(cl_mem buffer);
+};
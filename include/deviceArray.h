@@ -0,0 +1,117 @@
+#pragma once
+
+#include "clSession.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+class deviceArray;
+
+// Lazy elementwise expression over deviceArrays and float scalars.
+// Operators only build the tree; assigning it to a deviceArray generates one OpenCL C
+// kernel for the whole expression (kernels/expression_kernel.cl), so
+//     D = A + B * s - C;
+// is a single launch that reads A, B and C once and writes D once, with no temporaries.
+// The kernel is built for the expression's signature, its shape with the operands
+// numbered in order of appearance, and reused for every expression of that shape:
+// only the buffers and scalar values change between launches.
+//
+// An expression refers to the buffers of its arrays, which must outlive it.
+class deviceExpr {
+    public:
+
+    deviceExpr(const deviceArray& array);
+    deviceExpr(float value);
+
+    friend deviceExpr operator-(const deviceExpr& a);
+    friend deviceExpr operator+(const deviceExpr& a, const deviceExpr& b);
+    friend deviceExpr operator-(const deviceExpr& a, const deviceExpr& b);
+    friend deviceExpr operator*(const deviceExpr& a, const deviceExpr& b);
+    friend deviceExpr operator/(const deviceExpr& a, const deviceExpr& b);
+    // OpenCL built-ins applied per element
+    friend deviceExpr sqrt(const deviceExpr& a);
+    friend deviceExpr exp(const deviceExpr& a);
+    friend deviceExpr abs(const deviceExpr& a);
+    friend deviceExpr min(const deviceExpr& a, const deviceExpr& b);
+    friend deviceExpr max(const deviceExpr& a, const deviceExpr& b);
+    friend deviceExpr fma(const deviceExpr& a, const deviceExpr& b, const deviceExpr& c);
+
+    private:
+
+    friend class deviceArray;
+
+    struct node {
+        enum kind { ARRAY, SCALAR, OPERATOR, CALL };
+        kind k;
+        const char* op = "";          // operator or built-in name
+        const deviceArray* array = NULL;
+        float value = 0;
+        std::vector<std::shared_ptr<const node>> args;
+    };
+
+    // Operands and generated text of an expression, built by compile()
+    struct program {
+        std::vector<const deviceArray*> arrays; // x0, x1, .. distinct arrays in order of appearance
+        std::vector<float> scalars;             // s0, s1, ..
+        std::string text;                       // EXPR(L, S) body
+        std::string signature;                  // cache key: operand counts and text
+        double flops = 0;                       // per element
+    };
+
+    std::shared_ptr<const node> root;
+
+    deviceExpr(node::kind k, const char* op, std::vector<std::shared_ptr<const node>> args);
+
+    void compile(program& p) const;
+    static void emit(const node& n, program& p);
+};
+
+deviceExpr operator-(const deviceExpr& a);
+deviceExpr operator+(const deviceExpr& a, const deviceExpr& b);
+deviceExpr operator-(const deviceExpr& a, const deviceExpr& b);
+deviceExpr operator*(const deviceExpr& a, const deviceExpr& b);
+deviceExpr operator/(const deviceExpr& a, const deviceExpr& b);
+deviceExpr sqrt(const deviceExpr& a);
+deviceExpr exp(const deviceExpr& a);
+deviceExpr abs(const deviceExpr& a);
+deviceExpr min(const deviceExpr& a, const deviceExpr& b);
+deviceExpr max(const deviceExpr& a, const deviceExpr& b);
+deviceExpr fma(const deviceExpr& a, const deviceExpr& b, const deviceExpr& c);
+
+// n floats in a device buffer of a session, the operand and target type of deviceExpr.
+// Operations report errors through error(), the cl_int of the last write, read or
+// assignment.
+class deviceArray {
+    public:
+
+    deviceArray(clSession& session, size_t n);
+    // Uploads n floats from 'host'
+    deviceArray(clSession& session, const float* host, size_t n);
+    // Waits for every queue of the session, then returns the buffer to the pool
+    ~deviceArray();
+
+    deviceArray(const deviceArray&) = delete;
+
+    cl_int error() const { return err; }
+    size_t size() const { return n; }
+    cl_mem buffer() const { return mem; }
+    clSession& session() const { return s; }
+
+    // Blocking transfers of all n elements
+    cl_int write(const float* host);
+    cl_int read(float* host);
+
+    // Evaluates 'e' in one fused kernel on queue(queue) without waiting for it.
+    // Every array in 'e' must belong to the same session and have size() elements,
+    // at most INT_MAX (CL_INVALID_VALUE above).
+    cl_int assign(const deviceExpr& e, unsigned queue = 0);
+    deviceArray& operator=(const deviceExpr& e) { assign(e); return *this; }
+    deviceArray& operator=(const deviceArray& other) { assign(deviceExpr(other)); return *this; }
+
+    private:
+
+    clSession& s;
+    size_t n;
+    cl_mem mem = NULL;
+    cl_int err = CL_SUCCESS;
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "clSession.h"
+#include "deviceArray.h"
+#include <Eigen/Dense>
+#include <vector>
+
+// Row major float matrix (or vector, cols = 1) with a host copy and a device copy.
+// Each side is marked current or stale. Data moves only when a stale side is
+// accessed, so results of one device operation feed the next without passing
+// through the host, and host reads after a device operation download once.
+//
+//   host()            host data for reading, downloaded first if the device is newer
+//   hostWrite()       host data for writing, the device copy becomes stale
+//   hostOverwrite()   host data to be overwritten as a whole, the device copy becomes
+//                     stale without any transfer
+//   device()          device data for reading, uploaded first if the host is newer
+//   deviceWrite()     device data to be overwritten as a whole, the host copy becomes
+//                     stale without any transfer
+//
+// The host side is an Eigen::Map, either over storage of its own (allocated on first
+// host access) or over memory given to the constructor, e.g. an Eigen matrix's data(),
+// so no copies are made between Eigen and the device beyond the needed transfers.
+// error() is the result of the last transfer or operation.
+class deviceMatrix {
+    public:
+
+    typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> hostMatrix;
+
+    // Uninitialized contents, no transfer happens until one side is written
+    deviceMatrix(clSession& session, int rows, int cols);
+    // Wraps 'host' (rows x cols, row major), which must outlive the matrix. The host side
+    // starts current; the device copy is made on first device use.
+    deviceMatrix(clSession& session, float* host, int rows, int cols);
+
+    deviceMatrix(const deviceMatrix&) = delete;
+    deviceMatrix& operator=(const deviceMatrix&) = delete;
+
+    int rows() const { return nRows; }
+    int cols() const { return nCols; }
+    size_t size() const { return (size_t)nRows * nCols; }
+    cl_int error() const { return err; }
+
+    bool hostCurrent() const { return hostValid; }
+    bool deviceCurrent() const { return deviceValid; }
+    // Transfers made so far
+    size_t uploads() const { return nUploads; }
+    size_t downloads() const { return nDownloads; }
+
+    Eigen::Map<const hostMatrix> host() const;
+    Eigen::Map<hostMatrix> hostWrite();
+    Eigen::Map<hostMatrix> hostOverwrite();
+    const deviceArray& device() const;
+    deviceArray& deviceWrite();
+
+    // Bring a side up to date without using it
+    cl_int syncHost() const;
+    cl_int syncDevice() const;
+
+    // this = A * B on the device (this: rows x cols, A: rows x K, B: K x cols).
+    // GEMM_TILED_ACC computes this += A * B and reads this first.
+    cl_int product(const deviceMatrix& A, const deviceMatrix& B, clSession::gemmKernel variant = clSession::GEMM_TILED);
+    // Elementwise expression over device() of matrices of the same size, evaluated on the device
+    deviceMatrix& operator=(const deviceExpr& e);
+
+    private:
+
+    clSession& session;
+    int nRows, nCols;
+    mutable deviceArray dev;
+    mutable std::vector<float> owned;
+    mutable float* hostPtr = NULL;
+    mutable bool hostValid = true, deviceValid = true;
+    mutable size_t nUploads = 0, nDownloads = 0;
+    mutable cl_int err = CL_SUCCESS;
+
+    float* hostStorage() const;
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "clSession.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+
+// Splits vector_add ranges and matrixMult output rows over several devices.
+// Each device gets its own clSession and worker thread. The work is cut into chunks
+// and every device starts with a contiguous run of chunks sized by its share, the
+// throughput measured in a short calibration run. A device that runs out of chunks
+// steals from the back of whichever device has the most time left, so a slow or
+// busy device does not hold up the others.
+class deviceScheduler {
+    public:
+
+    enum op { VECTOR_ADD, MATRIX_MULT, NUM_OPS };
+
+    struct deviceStats {
+        size_t chunks = 0;  // chunks processed
+        size_t stolen = 0;  // of which taken from another device
+        size_t units = 0;   // elements (vector_add) or rows (matrixMult)
+        double seconds = 0; // time spent working
+    };
+
+    // One session per device of 'type' whose name contains 'name'
+    deviceScheduler(cl_device_type type = CL_DEVICE_TYPE_ALL, const std::string& name = "");
+    ~deviceScheduler();
+
+    deviceScheduler(const deviceScheduler&) = delete;
+    deviceScheduler& operator=(const deviceScheduler&) = delete;
+
+    // Reads CL_DEVICE_TYPE and CL_DEVICE_NAME like clSession::fromEnv
+    static deviceScheduler* fromEnv();
+
+    // CL_DEVICE_NOT_FOUND when no device matched
+    cl_int error() const { return sessions.empty() ? CL_DEVICE_NOT_FOUND : CL_SUCCESS; }
+    size_t size() const { return sessions.size(); }
+    clSession& session(size_t i) { return *sessions[i]; }
+
+    // Times vector_add on vecElements and a matSize^3 matrixMult on every device and
+    // sets the shares from the measured rates. Called on first use if not done before.
+    // Devices that fail here are dropped; the error is only returned if none is left.
+    cl_int calibrate(size_t vecElements = 1 << 20, int matSize = 256);
+    const std::vector<double>& shares(op o) const { return share[o]; }
+
+    // Host pointer operations over all devices. 'chunk' is in elements / rows, 0 picks
+    // one giving every device several chunks to leave room for stealing.
+    cl_int vectorAdd(const float* A, const float* B, float* C, size_t n, size_t chunk = 0);
+    cl_int matrixMult(const float* A, const float* B, float* C, int M, int K, int N, size_t chunk = 0);
+
+    // Per device figures of the last operation
+    const std::vector<deviceStats>& statistics() const { return st; }
+    void report(std::ostream& os = std::cout) const;
+
+    private:
+
+    std::vector<clSession*> sessions;
+    std::vector<double> share[NUM_OPS];
+    bool calibrated = false;
+
+    // Chunk queue: device i owns chunks [next[i], end[i]), taken from the front by
+    // itself and from the back by thieves
+    std::mutex mutex;
+    std::vector<size_t> next, end;
+    std::vector<deviceStats> st;
+    op last = VECTOR_ADD;
+    cl_int status = CL_SUCCESS; // first error of the running operation, stops all workers
+
+    void partition(op o, size_t nChunks);
+    bool take(size_t device, size_t& chunk);
+    void fail(cl_int ret);
+    cl_int run(op o, size_t nChunks, cl_int (deviceScheduler::*worker)(size_t, const void*), const void* args);
+
+    cl_int vectorAddWorker(size_t device, const void* args);
+    cl_int matrixMultWorker(size_t device, const void* args);
+};
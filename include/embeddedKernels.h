@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+
+// Sources of kernels/*.cl compiled into the library as string constants. The file is
+// generated at build time by cmake/embedKernels.cmake, so the binaries need no kernels
+// directory next to them and read no files to build their programs.
+struct embeddedKernel {
+    const char* file;   // name in kernels/, e.g. "matrix_mult_kernel.cl"
+    const char* source;
+};
+
+// Terminated by an entry with file == NULL
+extern const embeddedKernel embeddedKernels[];
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "clSession.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Native host implementation of the session's host pointer operations, for machines
+// without an OpenCL device and for sizes where the host is faster (hybridDispatcher).
+// The loops are written with AVX2 + FMA and AVX-512 intrinsics next to a scalar
+// version; the widest the CPU supports is picked at run time, so one binary runs on
+// every x86-64 machine (other architectures use the scalar loops). A pool of worker
+// threads splits elementwise ranges and GEMM output tiles over all cores, with the
+// calling thread taking part. Operations from several threads are serialized.
+class hostBackend {
+    public:
+
+    enum isa { SCALAR, AVX2, AVX512 };
+
+    // 'threads' counts the caller, 0 uses every hardware thread
+    explicit hostBackend(unsigned threads = 0);
+    ~hostBackend();
+
+    hostBackend(const hostBackend&) = delete;
+    hostBackend& operator=(const hostBackend&) = delete;
+
+    // Widest instruction set the CPU supports, capped by CL_HOST_ISA (scalar, avx2, avx512)
+    static isa detect();
+    static const char* isaName(isa i);
+
+    isa instructions() const { return level; }
+    // Lower (or restore) the instruction set, never above detect()
+    void setInstructions(isa i);
+    unsigned threads() const { return workers.size() + 1; }
+    // "avx2 x 8 threads"
+    std::string description() const;
+
+    // Same arguments and results as the clSession versions
+    cl_int vectorAdd(const float* A, const float* B, float* C, size_t n);
+    cl_int elementwise(clSession::elementwiseOp op, float* out, const float* X, const float* Y, const float* Z, float a, size_t n);
+    // GEMM_NAIVE and GEMM_TILED both compute C = A * B, GEMM_TILED_ACC C += A * B
+    cl_int matrixMult(const float* A, const float* B, float* C, int M, int K, int N,
+                      clSession::gemmKernel variant = clSession::GEMM_TILED);
+
+    private:
+
+    isa level = SCALAR;
+    std::vector<std::thread> workers;
+
+    // One job at a time: task(i) for i < jobTasks, handed out through 'next'
+    std::mutex runMutex;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(size_t)>* job = NULL;
+    size_t jobTasks = 0;
+    size_t next = 0;
+    size_t generation = 0;
+    unsigned busy = 0;
+    bool stopping = false;
+
+    // Runs task(0) .. task(tasks - 1) over the pool and the calling thread
+    void parallel(size_t tasks, const std::function<void(size_t)>& task);
+    void work();
+    // Next task of the job of 'jobGeneration', false once it has none left or is over
+    bool take(size_t jobGeneration, const std::function<void(size_t)>*& task, size_t& index);
+};
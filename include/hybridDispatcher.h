@@ -0,0 +1,105 @@
+#pragma once
+
+#include "clSession.h"
+#include "deviceMatrix.h"
+#include "hostBackend.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <initializer_list>
+
+// Runs each GEMM or elementwise operation on deviceMatrix operands on the host (the
+// multithreaded SIMD hostBackend) or with the session's OpenCL kernels, whichever the
+// cost model expects to finish first. The model is a fixed cost plus a cost per unit of work for each path:
+//
+//   host GEMM, device GEMM           per flop, fixed part is call / launch overhead
+//   host elementwise, device elem.   per byte touched
+//   upload, download                 per byte moved
+//
+// An operand that is stale on the chosen side adds its transfer, so data already on
+// the device tends to stay there and small problems on host data stay on the host.
+// The costs are fitted from two problem sizes by calibrate(), or loaded from a model
+// file written by an earlier calibration of the same device and driver. If calibration
+// fails, the dispatcher says so once and sends operations above fixed sizes to the device.
+// Every call is counted per operation and backend; the most recent decisions are kept
+// with both estimates for report() and decisions().
+class hybridDispatcher {
+    public:
+
+    enum backend { HOST, DEVICE, AUTO };
+
+    struct decision {
+        std::string op;
+        std::string shape;
+        backend chosen;
+        double hostUs;       // estimates, including the transfers each path needs
+        double deviceUs;
+        size_t moveBytes;    // bytes the chosen path had to transfer first
+    };
+
+    hybridDispatcher(clSession& session);
+
+    // Times both paths at a small and a large size and fits the cost model.
+    // Sizes are the large ones, the small ones are a quarter (GEMM) and 1/256 of them.
+    cl_int calibrate(int gemmSize = 256, size_t vecElements = 1 << 20);
+    // False if the file is missing, malformed or from another device or driver
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+    // Loads 'path' (CL_DISPATCH_MODEL when empty, calibration only if neither is set),
+    // otherwise calibrates and saves the model there
+    cl_int prepare(const std::string& path = "");
+    bool calibrated() const { return ready; }
+
+    // AUTO (default) follows the model, HOST or DEVICE overrides it
+    void setForced(backend b) { forced = b; }
+
+    // C = A * B
+    cl_int gemm(deviceMatrix& C, const deviceMatrix& A, const deviceMatrix& B);
+    // out = op(X, Y, Z, a) like clSession::elementwise; unused operands may be NULL
+    cl_int elementwise(clSession::elementwiseOp op, deviceMatrix& out, const deviceMatrix* X,
+                       const deviceMatrix* Y, const deviceMatrix* Z, float a);
+
+    // The last MAX_LOGGED decisions, oldest first
+    const std::deque<decision>& decisions() const { return log; }
+    void clearDecisions() { log.clear(); counts.clear(); }
+    void report(std::ostream& os = std::cout) const;
+
+    private:
+
+    enum cost { HOST_GEMM, DEVICE_GEMM, HOST_ELEMENTWISE, DEVICE_ELEMENTWISE, UPLOAD, DOWNLOAD, NUM_COSTS };
+
+    struct linearCost {
+        double seconds = 0; // fixed
+        double perUnit = 0; // seconds per flop or byte
+        double estimate(double units) const { return seconds + units * perUnit; }
+    };
+
+    clSession& session;
+    hostBackend cpu;
+    std::string deviceKey;
+    linearCost model[NUM_COSTS];
+    bool ready = false;
+    bool fallback = false; // calibration failed, size thresholds instead of the model
+    backend forced = AUTO;
+    std::deque<decision> log;
+    struct backendCount {
+        size_t host = 0, device = 0;
+    };
+    std::map<std::string, backendCount> counts; // every decision since clearDecisions(), by op
+
+    static const char* costName(cost c);
+    static linearCost fit(double units1, double seconds1, double units2, double seconds2);
+    cl_int measure(int gemmSize, size_t vecElements);
+
+    // Bytes to move so that every operand is current on side 'b'
+    static size_t staleBytes(backend b, std::initializer_list<const deviceMatrix*> operands);
+    backend choose(const std::string& op, const std::string& shape, cost hostCost, cost deviceCost, double units,
+                   std::initializer_list<const deviceMatrix*> operands);
+
+    cl_int hostElementwise(clSession::elementwiseOp op, deviceMatrix& out, const deviceMatrix* X,
+                           const deviceMatrix* Y, const deviceMatrix* Z, float a);
+    cl_int deviceElementwise(clSession::elementwiseOp op, deviceMatrix& out, const deviceMatrix* X,
+                             const deviceMatrix* Y, const deviceMatrix* Z, float a);
+};
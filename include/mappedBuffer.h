@@ -0,0 +1,65 @@
+#pragma once
+
+#include "CL/cl.h"
+#include <cstdlib>
+
+// Host allocations for zero-copy use: page aligned, size rounded up to a whole
+// cache line as CL_MEM_USE_HOST_PTR requires on most drivers to avoid a copy.
+inline void* alignedHostAlloc(size_t bytes){
+    void* ptr = NULL;
+    if(posix_memalign(&ptr, 4096, (bytes + 63) / 64 * 64) != 0)
+        return NULL;
+    return ptr;
+}
+
+inline void alignedHostFree(void* ptr){
+    free(ptr);
+}
+
+// Device buffer in host visible memory (CL_MEM_ALLOC_HOST_PTR).
+// map() returns a host pointer to fill inputs or read results in place and unmap()
+// hands the buffer back to the device; there are no explicit copies.
+class mappedBuffer {
+    public:
+
+    mappedBuffer(cl_context clContext, cl_command_queue queue, size_t bytes, cl_mem_flags flags = CL_MEM_READ_WRITE)
+        : queue(queue), bytes(bytes) {
+        buffer = clCreateBuffer(clContext, flags | CL_MEM_ALLOC_HOST_PTR, bytes, NULL, &ret);
+    }
+
+    ~mappedBuffer(){
+        unmap();
+        if(buffer)
+            clReleaseMemObject(buffer);
+    }
+
+    mappedBuffer(const mappedBuffer&) = delete;
+    mappedBuffer& operator=(const mappedBuffer&) = delete;
+
+    // Blocking map. Use CL_MAP_WRITE_INVALIDATE_REGION for inputs that are fully overwritten.
+    void* map(cl_map_flags flags = CL_MAP_READ | CL_MAP_WRITE){
+        if(!ptr && ret == CL_SUCCESS)
+            ptr = clEnqueueMapBuffer(queue, buffer, CL_TRUE, flags, 0, bytes, 0, NULL, NULL, &ret);
+        return ptr;
+    }
+
+    void unmap(){
+        if(ptr){
+            clEnqueueUnmapMemObject(queue, buffer, ptr, 0, NULL, NULL);
+            clFinish(queue);
+            ptr = NULL;
+        }
+    }
+
+    cl_mem mem() const { return buffer; }
+    size_t size() const { return bytes; }
+    cl_int error() const { return ret; }
+
+    private:
+
+    cl_command_queue queue;
+    size_t bytes;
+    cl_mem buffer = NULL;
+    void* ptr = NULL;
+    cl_int ret = CL_SUCCESS;
+};
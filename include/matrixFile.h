@@ -0,0 +1,95 @@
+#pragma once
+
+#include "CL/cl.h"
+#include <cstdint>
+#include <string>
+
+// Binary matrix file, memory mapped instead of read.
+// Layout: a header page, then the elements in host byte order (little endian on
+// every platform we run on), rows x cols of 'dtype' stored row or column major.
+// The data starts at 'offset', a multiple of 4096, so the mapped elements are page
+// aligned and can back a CL_MEM_USE_HOST_PTR buffer directly.
+struct matrixFileHeader {
+    char magic[8];     // "CLMATRIX"
+    uint32_t version;  // 1
+    uint32_t dtype;    // matrixFile::dtype
+    uint32_t layout;   // matrixFile::layout
+    uint32_t reserved;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t offset;   // byte offset of the first element
+};
+
+// A mapped matrix file. Opening maps the data without reading it: pages come in from
+// the page cache as they are touched, so a multi-GB operand costs no copy in host RAM
+// beyond the cache, and host pointer operations (vectorAddStreamed, outOfCoreGemm)
+// stream straight from the mapping tile by tile. Files opened for reading are mapped
+// copy-on-write: the data may be modified in memory but the file never changes.
+// Created files are mapped shared, so results written to data() go to the file.
+// error() is CL_INVALID_VALUE if the file cannot be opened, mapped or parsed.
+class matrixFile {
+    public:
+
+    enum dtype { FLOAT32 = 0, FLOAT16 = 1, INT32 = 2 };
+    enum layout { ROW_MAJOR = 0, COL_MAJOR = 1 };
+
+    // Maps an existing file
+    explicit matrixFile(const std::string& path);
+    // Creates (or truncates) 'path' for a rows x cols matrix; the elements start as zeros
+    matrixFile(const std::string& path, size_t rows, size_t cols, dtype type = FLOAT32, layout order = ROW_MAJOR);
+    // Unmaps, after writing back the pages of a created file
+    ~matrixFile();
+
+    matrixFile(const matrixFile&) = delete;
+    matrixFile& operator=(const matrixFile&) = delete;
+
+    // Writes rows x cols row major floats to a new file
+    static cl_int write(const std::string& path, const float* data, size_t rows, size_t cols);
+
+    cl_int error() const { return err; }
+    const std::string& path() const { return name; }
+    size_t rows() const { return nRows; }
+    size_t cols() const { return nCols; }
+    dtype type() const { return (dtype)hdr.dtype; }
+    layout order() const { return (layout)hdr.layout; }
+    static size_t elementSize(dtype type);
+    // Bytes of element data
+    size_t bytes() const { return nRows * nCols * elementSize(type()); }
+
+    void* data() const { return elements; }
+    // The elements as floats, NULL unless the file holds FLOAT32
+    float* floats() const { return type() == FLOAT32 ? (float*)elements : NULL; }
+
+    // Writes modified pages of a created file back now (msync)
+    cl_int sync();
+    // Tells the kernel the data will be read front to back, so it reads ahead
+    void adviseSequential();
+
+    // Device buffer over the mapped data in place (CL_MEM_USE_HOST_PTR). On devices
+    // sharing host memory nothing is copied; others copy on first use. The buffer must
+    // be released before the file is destroyed.
+    cl_mem wrap(cl_context context, cl_mem_flags flags, cl_int* ret) const;
+    // Blocking copies of 'count' stored rows (columns for COL_MAJOR) starting at 'first'
+    // between the mapping and 'buffer' at byte 'offset', with no staging copy.
+    // CL_INVALID_VALUE if the lines run past the end of the matrix.
+    cl_int upload(cl_command_queue queue, cl_mem buffer, size_t first, size_t count, size_t offset = 0) const;
+    cl_int download(cl_command_queue queue, cl_mem buffer, size_t first, size_t count, size_t offset = 0);
+
+    private:
+
+    std::string name;
+    matrixFileHeader hdr;
+    size_t nRows = 0, nCols = 0;
+    void* mapping = NULL;  // whole file, header included
+    size_t mappedBytes = 0;
+    void* elements = NULL;
+    bool shared = false;
+    cl_int err = CL_SUCCESS;
+
+    // Reports 'what' (with errno for failed system calls) and sets error()
+    void fail(const char* what, bool system = true);
+    // Bytes of one stored row (column for COL_MAJOR)
+    size_t lineBytes() const;
+    // True if stored lines [first, first + count) are within the matrix
+    bool validLines(size_t first, size_t count) const;
+};
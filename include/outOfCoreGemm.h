@@ -0,0 +1,53 @@
+#pragma once
+
+#include "clSession.h"
+#include <iostream>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+// Out-of-core GEMM: C (M x N) = A (M x K) * B (K x N), row major host matrices that
+// need not fit on the device. A, B and C are cut into blocks that, together, fit in a
+// fixed device memory budget. Blocks of A and B are kept in an LRU set of device slots
+// and the output tiles are walked in serpentine order, so panels shared by
+// neighbouring tiles are reused instead of uploaded again.
+class outOfCoreGemm {
+    public:
+
+    struct stats {
+        size_t bytesUploaded = 0;
+        size_t bytesDownloaded = 0;
+        size_t blockLoads = 0;   // A/B blocks uploaded
+        size_t blockReuses = 0;  // A/B blocks found resident on the device
+        size_t launches = 0;
+        size_t deviceBytes = 0;  // device memory actually used, <= budget
+        size_t slots = 0;
+        int blockM = 0, blockN = 0, blockK = 0;
+    };
+
+    outOfCoreGemm(clSession& session, size_t budgetBytes);
+
+    // C = A * B. Empty products return at once (K == 0 zeroes C), negative sizes are
+    // CL_INVALID_VALUE.
+    cl_int run(const float* A, const float* B, float* C, int M, int K, int N);
+
+    const stats& statistics() const { return st; }
+    void report(std::ostream& os = std::cout) const;
+
+    private:
+
+    clSession& session;
+    size_t budget;
+    stats st;
+
+    // Resident A/B blocks: key -> slot, plus LRU order
+    std::vector<cl_mem> slots;
+    std::map<uint64_t, size_t> resident;
+    std::vector<uint64_t> slotKey;
+    std::vector<size_t> lastUse;
+    size_t clock = 0;
+
+    bool chooseBlocks(int M, int K, int N, size_t maxAlloc);
+    cl_mem block(uint64_t key, const float* host, size_t hostCols, size_t row, size_t col,
+                 size_t rows, size_t cols, cl_int* ret);
+};
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "CL/cl.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk cache of built program binaries.
+// Entries are keyed by a hash of the source, device, driver/platform version
+// and build options. Set CL_PROGRAM_CACHE_DIR to move the cache and
+// CL_PROGRAM_CACHE_DISABLE=1 to always build from source.
+class programCache {
+    public:
+
+    static programCache& instance(){
+        static programCache cache;
+        return cache;
+    }
+
+    // Builds 'source' for 'device', loading a cached binary when a valid one exists.
+    // On return clProgram holds a built program (or the failed source build).
+    // Safe to call from several threads, builds are serialized.
+    cl_int build(cl_context clContext, cl_device_id device, const std::string& source,
+                 const char* options, cl_program& clProgram){
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto start = std::chrono::high_resolution_clock::now();
+        std::string opts = options ? options : "";
+        std::string path = dir + "/" + key(device, source, opts) + ".bin";
+
+        cl_int ret;
+        if(enabled && loadBinary(path, clContext, device, opts, clProgram)){
+            ++nHits;
+        } else {
+            ++nMisses;
+            const char * str_src = source.c_str();
+            const size_t src_size = source.size();
+            clProgram = clCreateProgramWithSource(clContext, 1, &str_src, &src_size, &ret);
+            if(ret != CL_SUCCESS)
+                return ret;
+            ret = clBuildProgram(clProgram, 1, &device, opts.c_str(), NULL, NULL);
+            if(ret != CL_SUCCESS)
+                return ret;
+            if(enabled)
+                storeBinary(path, clProgram);
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+        buildTimeUs += std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        return CL_SUCCESS;
+    }
+
+    unsigned hits() const { return nHits; }
+    unsigned misses() const { return nMisses; }
+
+    void report(std::ostream& os = std::cout) const {
+        os << "Program Cache: " << nHits << " hits, " << nMisses << " misses, "
+           << buildTimeUs / 1000.0 << " ms building (" << dir << ")" << std::endl;
+    }
+
+    private:
+
+    static const uint32_t MAGIC = 0x43504c43; // "CLPC"
+
+    std::string dir;
+    bool enabled;
+    unsigned nHits = 0;
+    unsigned nMisses = 0;
+    long buildTimeUs = 0;
+    std::mutex mutex;
+
+    programCache(){
+        const char* envDir = getenv("CL_PROGRAM_CACHE_DIR");
+        const char* envOff = getenv("CL_PROGRAM_CACHE_DISABLE");
+        dir = envDir ? envDir : ".clcache";
+        enabled = !(envOff && envOff[0] == '1');
+        if(enabled)
+            mkdir(dir.c_str(), 0755);
+    }
+
+    // FNV-1a
+    static uint64_t hash(const void* data, size_t size, uint64_t h = 14695981039346656037ULL){
+        const unsigned char* p = (const unsigned char*)data;
+        for(size_t i = 0; i < size; ++i){
+            h ^= p[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    static std::string deviceString(cl_device_id device, cl_device_info param){
+        size_t size = 0;
+        clGetDeviceInfo(device, param, 0, NULL, &size);
+        std::string value(size, '\0');
+        clGetDeviceInfo(device, param, size, &value[0], NULL);
+        return value;
+    }
+
+    static std::string key(cl_device_id device, const std::string& source, const std::string& options){
+        cl_platform_id platform;
+        clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+        char platVersion[128] = {0};
+        clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(platVersion) - 1, platVersion, NULL);
+
+        std::string id = deviceString(device, CL_DEVICE_NAME) + '\n' +
+                         deviceString(device, CL_DEVICE_VENDOR) + '\n' +
+                         deviceString(device, CL_DRIVER_VERSION) + '\n' +
+                         platVersion + '\n' + options;
+
+        uint64_t h = hash(source.data(), source.size());
+        h = hash(id.data(), id.size(), h);
+
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+        return hex;
+    }
+
+    // Any failure (missing, truncated, checksum mismatch, rejected by the driver)
+    // returns false so the caller rebuilds from source and overwrites the entry.
+    static bool loadBinary(const std::string& path, cl_context clContext, cl_device_id device,
+                           const std::string& options, cl_program& clProgram){
+        std::ifstream file(path, std::ios::binary);
+        if(!file.is_open())
+            return false;
+
+        file.seekg(0, std::ios::end);
+        const uint64_t fileSize = file.tellg();
+        file.seekg(0, std::ios::beg);
+
+        uint32_t magic = 0;
+        uint64_t size = 0, checksum = 0;
+        file.read((char*)&magic, sizeof(magic));
+        file.read((char*)&size, sizeof(size));
+        file.read((char*)&checksum, sizeof(checksum));
+        const uint64_t header = sizeof(magic) + sizeof(size) + sizeof(checksum);
+        if(!file || magic != MAGIC || size == 0 || size != fileSize - header)
+            return false;
+
+        std::vector<unsigned char> binary(size);
+        file.read((char*)binary.data(), size);
+        if(!file || hash(binary.data(), binary.size()) != checksum)
+            return false;
+
+        const unsigned char* bin = binary.data();
+        const size_t binSize = binary.size();
+        cl_int status, ret;
+        clProgram = clCreateProgramWithBinary(clContext, 1, &device, &binSize, &bin, &status, &ret);
+        if(ret != CL_SUCCESS)
+            return false;
+        if(status != CL_SUCCESS){
+            clReleaseProgram(clProgram);
+            return false;
+        }
+
+        if(clBuildProgram(clProgram, 1, &device, options.c_str(), NULL, NULL) != CL_SUCCESS){
+            clReleaseProgram(clProgram);
+            return false;
+        }
+        return true;
+    }
+
+    static void storeBinary(const std::string& path, cl_program clProgram){
+        size_t size = 0;
+        if(clGetProgramInfo(clProgram, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0)
+            return;
+
+        std::vector<unsigned char> binary(size);
+        unsigned char* bin = binary.data();
+        if(clGetProgramInfo(clProgram, CL_PROGRAM_BINARIES, sizeof(bin), &bin, NULL) != CL_SUCCESS)
+            return;
+
+        // Write to a temporary file and rename so concurrent runs never see a partial entry
+        std::string tmp = path + "." + std::to_string(getpid()) + ".tmp";
+        std::ofstream file(tmp, std::ios::binary);
+        uint32_t magic = MAGIC;
+        uint64_t size64 = size;
+        uint64_t checksum = hash(binary.data(), binary.size());
+        file.write((const char*)&magic, sizeof(magic));
+        file.write((const char*)&size64, sizeof(size64));
+        file.write((const char*)&checksum, sizeof(checksum));
+        file.write((const char*)binary.data(), binary.size());
+        file.close();
+        if(file)
+            std::rename(tmp.c_str(), path.c_str());
+        else
+            std::remove(tmp.c_str());
+    }
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "clSession.h"
+#include "deviceMatrix.h"
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <string>
+
+// Sparse float matrix on the device, for products with dense vectors and matrices
+// (kernels/sparse_kernel.cl). The formats:
+//   CSR  row offsets, column indices and values of the nonzeros; suits any row length
+//   ELL  every row padded to the longest one and stored column major, so the loads of
+//        neighbouring rows coalesce without the row offset indirection. Wastes memory
+//        and work when a few rows are much longer than the rest (see paddingRatio()).
+// The device copy is made once in the constructor and is read only afterwards.
+class sparseMatrix {
+    public:
+
+    enum format { CSR, ELL };
+
+    typedef Eigen::SparseMatrix<float, Eigen::RowMajor, int> hostSparse;
+    typedef deviceMatrix::hostMatrix hostMatrix;
+
+    sparseMatrix(clSession& session, const hostSparse& A, format f = CSR);
+    // The entries of 'dense' with |value| > threshold
+    sparseMatrix(clSession& session, const hostMatrix& dense, format f = CSR, float threshold = 0.0f);
+    ~sparseMatrix();
+
+    sparseMatrix(const sparseMatrix&) = delete;
+    sparseMatrix& operator=(const sparseMatrix&) = delete;
+
+    static hostSparse fromDense(const hostMatrix& dense, float threshold = 0.0f);
+    // Reads a Matrix Market coordinate file (real, integer or pattern; general, symmetric
+    // or skew-symmetric). CL_INVALID_VALUE if it cannot be read or parsed.
+    static cl_int loadMatrixMarket(const std::string& path, hostSparse& A);
+
+    cl_int error() const { return err; }
+    format storage() const { return fmt; }
+    int rows() const { return nRows; }
+    int cols() const { return nCols; }
+    size_t nonZeros() const { return nnz; }
+    // ELL entries per row, the longest row
+    int width() const { return ellWidth; }
+    // Stored entries per nonzero: 1 for CSR, above 1 for ELL with uneven rows
+    double paddingRatio() const;
+    size_t deviceBytes() const { return bytes; }
+
+    // C (rows x N) = A * B (cols x N), row major device buffers, enqueued on queue(queue)
+    // without waiting. N = 1 is y = A * x. C must not be B (CL_INVALID_VALUE).
+    cl_int multiply(cl_mem B, cl_mem C, int N = 1, unsigned queue = 0) const;
+    // C = A * B with deviceMatrix operands (vectors are N = 1), C's host copy becomes stale
+    cl_int multiply(const deviceMatrix& B, deviceMatrix& C) const;
+
+    private:
+
+    clSession& session;
+    format fmt;
+    int nRows = 0, nCols = 0;
+    size_t nnz = 0;
+    int ellWidth = 0;
+    size_t bytes = 0;
+    cl_mem rowPtr = NULL; // CSR only
+    cl_mem colIdx = NULL;
+    cl_mem values = NULL;
+    cl_int err = CL_SUCCESS;
+
+    void upload(const hostSparse& A);
+    cl_mem buffer(const void* host, size_t size);
+};
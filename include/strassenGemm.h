@@ -0,0 +1,114 @@
+#pragma once
+
+#include "clSession.h"
+#include <iostream>
+#include <vector>
+
+// Strassen-Winograd GEMM for large square matrices: C (n x n) = A * B, row major.
+// Each level splits the operands into quadrants and forms C from 7 half size products
+// and 15 quadrant additions instead of 8 products, cutting the flops by 1/8 per level.
+// The recursion stops at the crossover size, below which the tiled kernel is faster;
+// the products there run on clSession::matrixMultStrided straight on the quadrants.
+// Sizes that do not halve evenly down to the crossover are zero padded.
+//
+// Everything stays on the device and on one queue. The temporaries, two quadrants per
+// level in the schedule of Douglas et al. (the C quadrants hold the other products),
+// and the padded copies come from a workspace that is allocated once and only grows.
+//
+// Strassen-type products are less accurate than the classic one: the error bound grows
+// like (n / n0)^log2(18) instead of n (n0 the size at the bottom). checkError() measures
+// the error against the classic product and reports it next to both bounds.
+class strassenGemm {
+    public:
+
+    // Error of a Strassen-Winograd product, max |C - C_classic| divided by max |A| max |B|,
+    // and the first order error bounds in the same units (Higham, Accuracy and Stability
+    // of Numerical Algorithms, 2nd ed., sec. 23.2): bound for this product, classicBound
+    // for the classic one. The measured difference is within their sum.
+    struct errorReport {
+        int n = 0;
+        int levels = 0;
+        int base = 0;
+        double measured = 0;
+        double bound = 0;
+        double classicBound = 0;
+    };
+
+    struct stats {
+        int n = 0;
+        int paddedN = 0;      // n rounded up to base * 2^levels
+        int levels = 0;
+        int base = 0;         // size of the products at the bottom of the recursion
+        size_t products = 0;  // tiled kernel launches
+        size_t additions = 0; // quadrant additions
+        double flops = 0;     // of the products and additions
+        double classicFlops = 0;
+    };
+
+    // 'crossover' is the largest size multiplied directly. 0 reads CL_STRASSEN_CROSSOVER,
+    // or measures it with calibrate() on the first run if that is not set either.
+    explicit strassenGemm(clSession& session, int crossover = 0);
+    ~strassenGemm();
+
+    strassenGemm(const strassenGemm&) = delete;
+    strassenGemm& operator=(const strassenGemm&) = delete;
+
+    // Times the tiled kernel against one recursion level on top of it for n = 128, 256,
+    // .. up to maxN. The crossover becomes half the first size where the level wins;
+    // if it never does, the recursion stays off (crossover INT_MAX).
+    cl_int calibrate(int maxN = 2048);
+    int crossover() const { return cross; }
+    void setCrossover(int n) { cross = n; }
+    // Recursion levels for an n x n product with the current crossover
+    int levels(int n) const;
+
+    // Allocates the workspace for n x n products now instead of on the first run
+    cl_int reserve(int n);
+    size_t workspaceBytes() const;
+
+    // Host matrices, uploaded and read back through the session
+    cl_int run(const float* A, const float* B, float* C, int n);
+    // Device buffers of n x n floats. Enqueued on queue 0 without waiting. C must not be
+    // A or B (CL_INVALID_VALUE): it holds intermediate products while they are read.
+    cl_int run(cl_mem A, cl_mem B, cl_mem C, int n);
+
+    // Computes the classic product of A and B on the device and compares C with it.
+    // The last report is also printed by report().
+    cl_int checkError(cl_mem A, cl_mem B, cl_mem C, int n, errorReport& r);
+    // Bounds of errorReport for an n x n product with 'levels' levels
+    static void errorBounds(int n, int levels, errorReport& r);
+
+    const stats& statistics() const { return st; }
+    void report(std::ostream& os = std::cout) const;
+
+    private:
+
+    // Sub-matrix of a buffer: starts 'off' floats in, rows 'ld' floats apart
+    struct view {
+        cl_mem buffer;
+        int off;
+        int ld;
+        view quadrant(int i, int j, int h) const { return {buffer, off + i * h * ld + j * h, ld}; }
+    };
+
+    enum { PAD_A, PAD_B, PAD_C, TEMPORARIES }; // workspace slots, then two per level
+
+    clSession& session;
+    int cross;
+    stats st;
+    errorReport lastError;
+    std::vector<cl_mem> workspace;
+    std::vector<size_t> capacity; // floats
+
+    // Slot 'index' of the workspace with room for 'floats', grown if needed
+    cl_mem slot(size_t index, size_t floats, cl_int* ret);
+    // Workspace of a paddedN product with 'depth' levels
+    cl_int prepare(int paddedN, int depth, bool padded);
+
+    cl_int multiply(const view& C, const view& A, const view& B, int n, int level, int depth);
+    // out = X + beta * Y on n x n views
+    cl_int combine(const view& out, const view& X, const view& Y, float beta, int n);
+    // out (outRows x outCols, packed) = X (rows x cols, row stride ldX), zero padded or cropped
+    cl_int copy(cl_mem out, int outRows, int outCols, cl_mem X, int ldX, int rows, int cols);
+    cl_int zero(cl_mem out, int n) { return copy(out, n, n, out, n, 0, 0); }
+};
@@ -0,0 +1,72 @@
+// Elementwise kernels: out = f(X, Y, Z, a) over n floats.
+// Every kernel has the same arguments (operands it does not use may be NULL):
+//   X, Y, Z  inputs
+//   a        scalar
+//   out      output, may alias an input
+//   n        element count
+// Work-items walk the array in VW wide vectors with a grid-stride loop, so any
+// global size works and the launch does not depend on n. The n % VW elements
+// after the last whole vector are done one by one by the first work-items.
+
+// Elements per vector load/store: 1, 2, 4, 8 or 16 (-DVW=..)
+#ifndef VW
+#define VW 4
+#endif
+
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+
+// Storage: float, or half with -DHALF_STORAGE, read and written with vload_half /
+// vstore_half (core OpenCL, no cl_khr_fp16 needed); the arithmetic stays in float
+#ifdef HALF_STORAGE
+#define STORAGE half
+#if VW == 1
+#define VLOAD(P) vload_half(i, P)
+#define VSTORE(v, P) vstore_half(v, i, P)
+#else
+#define VLOAD(P) CAT(vload_half, VW)(i, P)
+#define VSTORE(v, P) CAT(vstore_half, VW)(v, i, P)
+#endif
+#define SLOAD(P) vload_half(i, P)
+#define SSTORE(v, P) vstore_half(v, i, P)
+#else
+#define STORAGE float
+#if VW == 1
+#define VLOAD(P) P[i]
+#define VSTORE(v, P) P[i] = (v)
+#else
+#define VLOAD(P) CAT(vload, VW)(i, P)
+#define VSTORE(v, P) CAT(vstore, VW)(v, i, P)
+#endif
+#define SLOAD(P) P[i]
+#define SSTORE(v, P) P[i] = (v)
+#endif
+
+// Indices are size_t: with n close to INT_MAX, an int index plus the global size
+// would wrap negative and still pass the bounds check
+#define ELEMENTWISE(name, EXPR)                                                \
+  __kernel void name(__global const STORAGE *X, __global const STORAGE *Y,     \
+                     __global const STORAGE *Z, const float a,                 \
+                     __global STORAGE *out, const int n) {                     \
+    const size_t vectors = n / VW;                                             \
+    for (size_t i = get_global_id(0); i < vectors; i += get_global_size(0))    \
+      VSTORE(EXPR(VLOAD), out);                                                \
+    for (size_t i = vectors * VW + get_global_id(0); i < (size_t)n;            \
+         i += get_global_size(0))                                              \
+      SSTORE(EXPR(SLOAD), out);                                                \
+  }
+
+// L is the load: VLOAD in the vector loop, SLOAD for the tail
+#define ADD(L) (L(X) + L(Y))
+#define SUB(L) (L(X) - L(Y))
+#define MUL(L) (L(X) * L(Y))
+#define AXPY(L) (a * L(X) + L(Y))
+#define SCALE(L) (a * L(X))
+#define FMA(L) fma(L(X), L(Y), L(Z))
+
+ELEMENTWISE(ew_add, ADD)     // X + Y
+ELEMENTWISE(ew_sub, SUB)     // X - Y
+ELEMENTWISE(ew_mul, MUL)     // X * Y
+ELEMENTWISE(ew_axpy, AXPY)   // a * X + Y
+ELEMENTWISE(ew_scale, SCALE) // a * X
+ELEMENTWISE(ew_fma, FMA)     // X * Y + Z, fused
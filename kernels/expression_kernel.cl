@@ -0,0 +1,43 @@
+// Template of the fused kernels generated by deviceExpr (include/deviceArray.h).
+// The generator puts two definitions in front of this file:
+//   EXPR_ARGS  the operand arguments, e.g. __global const float *x0, const float s0,
+//   EXPR(L, S) the expression with every array operand read as L(xi) and every
+//              scalar as S(si), e.g. ((L(x0) + (L(x1) * S(s0))) - L(x2))
+// The loop is the one of elementwise_kernel.cl: VW wide vectors with a grid-stride
+// loop, then the n % VW remaining elements one by one. Each element is read once
+// from every operand and written once, whatever the size of the expression.
+
+#ifndef EXPR
+#error "EXPR(L, S) is defined by the expression generator"
+#endif
+
+// Elements per vector load/store: 1, 2, 4, 8 or 16 (-DVW=..)
+#ifndef VW
+#define VW 4
+#endif
+
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+
+#if VW == 1
+#define VTYPE float
+#define VLOAD(P) P[i]
+#define VSTORE(v, P) P[i] = (v)
+#else
+#define VTYPE CAT(float, VW)
+#define VLOAD(P) CAT(vload, VW)(i, P)
+#define VSTORE(v, P) CAT(vstore, VW)(v, i, P)
+#endif
+#define VSCALAR(s) ((VTYPE)(s)) // scalars widened so every built-in sees vectors
+#define SLOAD(P) P[i]
+#define SSCALAR(s) (s)
+
+// size_t indices, as in elementwise_kernel.cl, so i + global size cannot wrap
+__kernel void expression(EXPR_ARGS __global float *out, const int n) {
+  const size_t vectors = n / VW;
+  for (size_t i = get_global_id(0); i < vectors; i += get_global_size(0))
+    VSTORE(EXPR(VLOAD, VSCALAR), out);
+  for (size_t i = vectors * VW + get_global_id(0); i < (size_t)n;
+       i += get_global_size(0))
+    out[i] = EXPR(SLOAD, SSCALAR);
+}
@@ -1,5 +1,49 @@
-__kernel void matrixMult(__global float *A, __global float *B,
-                         __global float *C,int wA, int wB) {
+// Tile size (TS x TS outputs per work-group) and outputs per work-item (WPT).
+// Both can be overridden at build time with -DTS=.. -DWPT=..
+#ifndef TS
+#define TS 16
+#endif
+
+#ifndef WPT
+#define WPT 4
+#endif
+
+#define RTS (TS / WPT)
+
+// Shape specialization: built with -DSHAPE_M=.. -DSHAPE_K=.. -DSHAPE_N=.., the tiled
+// kernels below ignore their M, K and N arguments and use the constants, so every loop
+// bound and edge test is known to the compiler (and folds away when the sizes are
+// multiples of TS). The work-group size is fixed as well, as the host always launches
+// {TS, TS / WPT}.
+#ifdef SHAPE_M
+#define GEMM_M SHAPE_M
+#define GEMM_K SHAPE_K
+#define GEMM_N SHAPE_N
+#define GEMM_ATTRIBUTES __attribute__((reqd_work_group_size(TS, RTS, 1)))
+#else
+#define GEMM_M M
+#define GEMM_K K
+#define GEMM_N N
+#define GEMM_ATTRIBUTES
+#endif
+
+// Storage of A, B and C: float, or half with -DHALF_STORAGE. Halves are read and
+// written with vload_half / vstore_half (core OpenCL, no cl_khr_fp16 needed) and
+// all arithmetic stays in float.
+#ifdef HALF_STORAGE
+#define STORAGE half
+#define LOAD(P, i) vload_half(i, P)
+#define STORE(v, P, i) vstore_half(v, i, P)
+#else
+#define STORAGE float
+#define LOAD(P, i) P[i]
+#define STORE(v, P, i) P[i] = (v)
+#endif
+
+// Naive version: one global-memory dot product per work-item.
+// A is hA x wA, B is wA x wB, C is hA x wB (all row major).
+__kernel void matrixMult(__global STORAGE *A, __global STORAGE *B,
+                         __global STORAGE *C,int wA, int wB) {
 
   int tx = get_global_id(0);
   int ty = get_global_id(1);
@@ -7,8 +51,122 @@ __kernel void matrixMult(__global float *A, __global float *B,
   float value = 0;
   for (int k = 0; k < wA; ++k){
   //     // dot product
-      value += A[ty * wA + k] * B[k * wB + tx];
+      value += LOAD(A, ty * wA + k) * LOAD(B, k * wB + tx);
+  }
+  STORE(value, C, ty * wB + tx);
+
+}
+
+// Tiled version: C (M x N) = A (M x K) * B (K x N), all row major.
+// Each work-group computes a TS x TS tile of C, staging TS x TS tiles of A and B
+// in local memory. Each work-item keeps WPT outputs of one column in registers.
+// Launch with local size {TS, TS / WPT} and global size
+// {ceil(N / TS) * TS, ceil(M / TS) * TS / WPT}. Any M, K, N are valid.
+// With accumulate != 0 the product is added to C instead of overwriting it.
+// Rows of A, B and C are lda, ldb and ldc elements apart (K, N and N when packed).
+void gemmTiled(__global const STORAGE *A, __global const STORAGE *B,
+               __global STORAGE *C, int M, int K, int N, int lda, int ldb,
+               int ldc, int accumulate, __local float (*Asub)[TS],
+               __local float (*Bsub)[TS]) {
+
+  const int lx = get_local_id(0);
+  const int ly = get_local_id(1);
+  const int col = get_group_id(0) * TS + lx;
+  const int rowBase = get_group_id(1) * TS;
+
+  float acc[WPT];
+  for (int w = 0; w < WPT; ++w)
+    acc[w] = 0.0f;
+
+  const int numTiles = (K + TS - 1) / TS;
+  for (int t = 0; t < numTiles; ++t) {
+
+    // Each work-item loads WPT elements of both tiles, zero padding the edges
+    for (int w = 0; w < WPT; ++w) {
+      const int r = ly + w * RTS;
+      const int aRow = rowBase + r;
+      const int aCol = t * TS + lx;
+      const int bRow = t * TS + r;
+      Asub[r][lx] = (aRow < M && aCol < K) ? LOAD(A, aRow * lda + aCol) : 0.0f;
+      Bsub[r][lx] = (bRow < K && col < N) ? LOAD(B, bRow * ldb + col) : 0.0f;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int k = 0; k < TS; ++k) {
+      const float b = Bsub[k][lx];
+      for (int w = 0; w < WPT; ++w)
+        acc[w] += Asub[ly + w * RTS][k] * b;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  for (int w = 0; w < WPT; ++w) {
+    const int row = rowBase + ly + w * RTS;
+    if (row < M && col < N)
+      STORE(accumulate ? LOAD(C, row * ldc + col) + acc[w] : acc[w], C,
+            row * ldc + col);
   }
-  C[ty * wA + tx] = value;
-  
-}   
\ No newline at end of file
+}
+
+__kernel GEMM_ATTRIBUTES void
+matrixMultTiled(__global const STORAGE *A, __global const STORAGE *B,
+                __global STORAGE *C, int M, int K, int N) {
+  __local float Asub[TS][TS];
+  __local float Bsub[TS][TS];
+  gemmTiled(A, B, C, GEMM_M, GEMM_K, GEMM_N, GEMM_K, GEMM_N, GEMM_N, 0, Asub,
+            Bsub);
+}
+
+// C += A * B, same launch geometry as matrixMultTiled
+__kernel GEMM_ATTRIBUTES void
+matrixMultTiledAcc(__global const STORAGE *A, __global const STORAGE *B,
+                   __global STORAGE *C, int M, int K, int N) {
+  __local float Asub[TS][TS];
+  __local float Bsub[TS][TS];
+  gemmTiled(A, B, C, GEMM_M, GEMM_K, GEMM_N, GEMM_K, GEMM_N, GEMM_N, 1, Asub,
+            Bsub);
+}
+
+// Product of sub-matrices, e.g. quadrants: A, B and C start offA, offB and offC
+// elements into their buffers, with rows lda, ldb and ldc elements apart. C += A * B
+// with accumulate != 0. Launch like matrixMultTiled.
+__kernel void matrixMultTiledStrided(__global const STORAGE *A, int offA, int lda,
+                                     __global const STORAGE *B, int offB, int ldb,
+                                     __global STORAGE *C, int offC, int ldc, int M,
+                                     int K, int N, int accumulate) {
+  __local float Asub[TS][TS];
+  __local float Bsub[TS][TS];
+  gemmTiled(A + offA, B + offB, C + offC, M, K, N, lda, ldb, ldc, accumulate,
+            Asub, Bsub);
+}
+
+// Strided batch of same-shaped products: matrix b of the batch starts at
+// A + b * strideA, B + b * strideB and C + b * strideC (strides in floats).
+// Launch like matrixMultTiled with a third dimension of one work-group per matrix:
+// global {ceil(N / TS) * TS, ceil(M / TS) * TS / WPT, batch}, local {TS, TS / WPT, 1}.
+__kernel void matrixMultBatched(__global const STORAGE *A, __global const STORAGE *B,
+                                __global STORAGE *C, int M, int K, int N,
+                                int strideA, int strideB, int strideC) {
+  __local float Asub[TS][TS];
+  __local float Bsub[TS][TS];
+  const long b = get_global_id(2);
+  gemmTiled(A + b * strideA, B + b * strideB, C + b * strideC, M, K, N, K, N, N,
+            0, Asub, Bsub);
+}
+
+// Batch of products of different shapes packed into three buffers. Entry b of
+// 'batch' is {offsetA, offsetB, offsetC, M, K, N} (offsets in floats).
+// Launch as matrixMultBatched, sized for the largest M and N of the batch; the
+// work-groups beyond a smaller matrix's tiles return before any barrier.
+__kernel void matrixMultBatchedVar(__global const STORAGE *A, __global const STORAGE *B,
+                                   __global STORAGE *C, __global const int *batch) {
+  __local float Asub[TS][TS];
+  __local float Bsub[TS][TS];
+  __global const int *e = batch + 6 * get_global_id(2);
+  const int M = e[3], K = e[4], N = e[5];
+  if (get_group_id(0) * TS >= N || get_group_id(1) * TS >= M)
+    return;
+  gemmTiled(A + e[0], B + e[1], C + e[2], M, K, N, K, N, N, 0, Asub, Bsub);
+}
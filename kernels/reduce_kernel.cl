@@ -0,0 +1,79 @@
+// Reductions of n floats to one value, in two launches: every work-group reduces
+// a grid-stride slice of the input to one partial result, then one work-group
+// reduces the partials with reduce_sum or reduce_max.
+// Every kernel has the same arguments:
+//   X, Y     inputs (Y is only read by dot and max_abs_diff, may be NULL otherwise)
+//   partial  output, one float per work-group
+//   scratch  local memory, one float per work-item
+//   n        element count
+// Each work-item accumulates its elements privately. With -DUSE_SUBGROUPS the
+// sub-groups then combine their work-items with sub_group_reduce_*, leaving one
+// value per sub-group for the local-memory tree; without it the tree starts from
+// one value per work-item.
+
+#if defined(USE_SUBGROUPS) && defined(cl_khr_subgroups)
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+
+#define SUM(a, b) ((a) + (b))
+#define MAX(a, b) fmax(a, b)
+
+#ifdef USE_SUBGROUPS
+#define FIRST_STAGE(SUB_GROUP_REDUCE)                                          \
+  acc = SUB_GROUP_REDUCE(acc);                                                 \
+  if (get_sub_group_local_id() == 0)                                           \
+    scratch[get_sub_group_id()] = acc;                                         \
+  barrier(CLK_LOCAL_MEM_FENCE);                                                \
+  int active = get_num_sub_groups();
+#else
+#define FIRST_STAGE(SUB_GROUP_REDUCE)                                          \
+  scratch[lid] = acc;                                                          \
+  barrier(CLK_LOCAL_MEM_FENCE);                                                \
+  int active = get_local_size(0);
+#endif
+
+// Tree over 'active' values, halving (rounded up) each step, so neither the
+// work-group size nor the number of sub-groups has to be a power of two
+#define GROUP_REDUCE(name, COMBINE, SUB_GROUP_REDUCE)                          \
+  float name(float acc, __local float *scratch) {                              \
+    const int lid = get_local_id(0);                                           \
+    FIRST_STAGE(SUB_GROUP_REDUCE)                                              \
+    while (active > 1) {                                                       \
+      const int half = (active + 1) / 2;                                       \
+      if (lid < active - half)                                                 \
+        scratch[lid] = COMBINE(scratch[lid], scratch[lid + half]);             \
+      barrier(CLK_LOCAL_MEM_FENCE);                                            \
+      active = half;                                                           \
+    }                                                                          \
+    return scratch[0];                                                         \
+  }
+
+GROUP_REDUCE(groupSum, SUM, sub_group_reduce_add)
+GROUP_REDUCE(groupMax, MAX, sub_group_reduce_max)
+
+// size_t index: an int one plus the global size could wrap for n near INT_MAX
+#define REDUCE(name, LOAD, IDENTITY, COMBINE, GROUP)                           \
+  __kernel void name(__global const float *X, __global const float *Y,         \
+                     __global float *partial, __local float *scratch,          \
+                     const int n) {                                            \
+    float acc = IDENTITY;                                                      \
+    for (size_t i = get_global_id(0); i < (size_t)n; i += get_global_size(0)) \
+      acc = COMBINE(acc, LOAD(i));                                             \
+    acc = GROUP(acc, scratch);                                                 \
+    if (get_local_id(0) == 0)                                                  \
+      partial[get_group_id(0)] = acc;                                          \
+  }
+
+// A NaN difference counts as infinite, so it cannot hide behind fmax
+#define ABS(i) fabs(X[i])
+#define ABS_DIFF(i) (isnan(X[i] - Y[i]) ? INFINITY : fabs(X[i] - Y[i]))
+#define ELEMENT(i) X[i]
+#define PRODUCT(i) (X[i] * Y[i])
+#define SQUARE(i) (X[i] * X[i])
+
+REDUCE(reduce_sum, ELEMENT, 0.0f, SUM, groupSum)            // sum X
+REDUCE(reduce_dot, PRODUCT, 0.0f, SUM, groupSum)            // sum X * Y
+REDUCE(reduce_sumsq, SQUARE, 0.0f, SUM, groupSum)           // sum X * X, norm2 squared
+REDUCE(reduce_max, ELEMENT, -INFINITY, MAX, groupMax)       // max X
+REDUCE(reduce_max_abs, ABS, 0.0f, MAX, groupMax)            // max |X|
+REDUCE(reduce_max_abs_diff, ABS_DIFF, 0.0f, MAX, groupMax)  // max |X - Y|
@@ -0,0 +1,86 @@
+// Sparse A (M x K) times dense B (K x N, row major) into C (M x N, row major).
+// The spmv kernels are the N = 1 case with B and C vectors x and y.
+//
+// CSR: rowPtr (M + 1 ints) holds where each row starts in colIdx / values (nnz each).
+// ELL: every row padded to 'width' entries, stored column major so that entry j of
+// row r sits at j * M + r and neighbouring work-items (rows) read neighbouring
+// words. Padding entries have column 0 and value 0. M * width and the dense
+// operands can pass INT_MAX elements, so their indices are computed in size_t.
+
+// Work-items sharing a CSR row in csr_spmv, a power of two. The host picks it from
+// the mean row length: 1 is the scalar kernel (a row per work-item), more split
+// long rows so the loads of a row are coalesced and summed in local memory.
+#ifndef LANES
+#define LANES 1
+#endif
+
+__kernel void csr_spmv(__global const int *rowPtr, __global const int *colIdx,
+                       __global const float *values, __global const float *x,
+                       __global float *y, __local float *scratch, const int M) {
+  const int lid = get_local_id(0);
+  const int lane = lid % LANES;
+  const int row = get_global_id(0) / LANES;
+
+  float acc = 0.0f;
+  if (row < M)
+    for (int j = rowPtr[row] + lane; j < rowPtr[row + 1]; j += LANES)
+      acc += values[j] * x[colIdx[j]];
+
+  // Every work-item reaches the barriers, also those past the last row
+  scratch[lid] = acc;
+  barrier(CLK_LOCAL_MEM_FENCE);
+  for (int active = LANES / 2; active > 0; active /= 2) {
+    if (lane < active)
+      scratch[lid] += scratch[lid + active];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if (lane == 0 && row < M)
+    y[row] = scratch[lid];
+}
+
+// One work-item per element of C; dimension 0 runs along a row of B and C, so the
+// work-items of a row read the same A entries and consecutive B elements
+__kernel void csr_spmm(__global const int *rowPtr, __global const int *colIdx,
+                       __global const float *values, __global const float *B,
+                       __global float *C, const int M, const int N) {
+  const int col = get_global_id(0);
+  const int row = get_global_id(1);
+  if (row >= M || col >= N)
+    return;
+
+  float acc = 0.0f;
+  for (int j = rowPtr[row]; j < rowPtr[row + 1]; ++j)
+    acc += values[j] * B[(size_t)colIdx[j] * N + col];
+  C[(size_t)row * N + col] = acc;
+}
+
+__kernel void ell_spmv(__global const int *colIdx, __global const float *values,
+                       __global const float *x, __global float *y, const int M,
+                       const int width) {
+  const int row = get_global_id(0);
+  if (row >= M)
+    return;
+
+  float acc = 0.0f;
+  for (int j = 0; j < width; ++j) {
+    const size_t e = (size_t)j * M + row;
+    acc += values[e] * x[colIdx[e]];
+  }
+  y[row] = acc;
+}
+
+__kernel void ell_spmm(__global const int *colIdx, __global const float *values,
+                       __global const float *B, __global float *C, const int M,
+                       const int N, const int width) {
+  const int col = get_global_id(0);
+  const int row = get_global_id(1);
+  if (row >= M || col >= N)
+    return;
+
+  float acc = 0.0f;
+  for (int j = 0; j < width; ++j) {
+    const size_t e = (size_t)j * M + row;
+    acc += values[e] * B[(size_t)colIdx[e] * N + col];
+  }
+  C[(size_t)row * N + col] = acc;
+}
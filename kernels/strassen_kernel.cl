@@ -0,0 +1,29 @@
+// Quadrant arithmetic of the Strassen-Winograd GEMM (strassenGemm). Every matrix is
+// a view into a buffer: it starts 'off' floats in and its rows are 'ld' floats apart,
+// so quadrants are addressed in place without copying them out.
+
+// out = X + beta * Y on n x n views, beta = 1 or -1.
+// Launch with global size {n, n}; out may be the same view as X or Y.
+__kernel void strassen_combine(__global float *out, int offOut, int ldOut,
+                               __global const float *X, int offX, int ldX,
+                               __global const float *Y, int offY, int ldY,
+                               float beta, int n) {
+  const int j = get_global_id(0);
+  const int i = get_global_id(1);
+  if (i >= n || j >= n)
+    return;
+  out[offOut + i * ldOut + j] = X[offX + i * ldX + j] + beta * Y[offY + i * ldY + j];
+}
+
+// out (outRows x outCols, row stride outCols) = X (rows x cols, row stride ldX)
+// padded with zeros or cropped. rows = 0 just zero fills out.
+// Launch with global size {outCols, outRows}.
+__kernel void strassen_copy(__global float *out, int outRows, int outCols,
+                            __global const float *X, int ldX, int rows,
+                            int cols) {
+  const int j = get_global_id(0);
+  const int i = get_global_id(1);
+  if (i >= outRows || j >= outCols)
+    return;
+  out[i * outCols + j] = (i < rows && j < cols) ? X[i * ldX + j] : 0.0f;
+}
@@ -0,0 +1,183 @@
+#include "asyncQueue.h"
+
+deviceFuture::deviceFuture(const deviceFuture &other) : ev(other.ev), err(other.err)
+{
+        if (ev)
+                clRetainEvent(ev);
+}
+
+deviceFuture &deviceFuture::operator=(const deviceFuture &other)
+{
+        if (other.ev)
+                clRetainEvent(other.ev);
+        if (ev)
+                clReleaseEvent(ev);
+        ev = other.ev;
+        err = other.err;
+        return *this;
+}
+
+deviceFuture::~deviceFuture()
+{
+        if (ev)
+                clReleaseEvent(ev);
+}
+
+bool deviceFuture::ready() const
+{
+        if (!ev)
+                return true;
+        cl_int status = CL_COMPLETE;
+        clGetEventInfo(ev, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+        return status <= CL_COMPLETE;
+}
+
+cl_int deviceFuture::wait() const
+{
+        if (!ev)
+                return err;
+        cl_int ret = clWaitForEvents(1, &ev);
+        cl_int status = CL_COMPLETE;
+        clGetEventInfo(ev, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+        return status < 0 ? status : ret;
+}
+
+static void CL_CALLBACK completed(cl_event, cl_int status, void *data)
+{
+        std::function<void(cl_int)> *callback = (std::function<void(cl_int)> *)data;
+        (*callback)(status < 0 ? status : CL_SUCCESS);
+        delete callback;
+}
+
+cl_int deviceFuture::then(std::function<void(cl_int)> callback) const
+{
+        if (!ev)
+        {
+                callback(err);
+                return CL_SUCCESS;
+        }
+        std::function<void(cl_int)> *data = new std::function<void(cl_int)>(std::move(callback));
+        cl_int ret = clSetEventCallback(ev, CL_COMPLETE, completed, data);
+        if (ret != CL_SUCCESS)
+                delete data;
+        return ret;
+}
+
+asyncQueue::asyncQueue(clSession &session) : session(session)
+{
+        q = session.addQueue(CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &err);
+}
+
+asyncQueue::~asyncQueue()
+{
+        // releaseQueue waits for the commands
+        if (err == CL_SUCCESS)
+                session.releaseQueue(q);
+}
+
+bool asyncQueue::outOfOrder() const
+{
+        return session.queueProperties(q) & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+}
+
+cl_int asyncQueue::waitList(const futures &after, std::vector<cl_event> &events) const
+{
+        if (err != CL_SUCCESS)
+                return err;
+        for (const deviceFuture &f : after)
+        {
+                if (f.error() != CL_SUCCESS)
+                        return f.error();
+                if (f.event())
+                        events.push_back(f.event());
+        }
+        return CL_SUCCESS;
+}
+
+deviceFuture asyncQueue::track(cl_int ret, cl_event ev, clProfiler::stage st, const char *label, double bytes)
+{
+        if (ret != CL_SUCCESS)
+                return deviceFuture(NULL, ret);
+        // The profiler takes ownership of the event it records
+        if (session.profiler())
+        {
+                clRetainEvent(ev);
+                session.profiler()->record(ev, st, label, bytes);
+        }
+        return deviceFuture(ev);
+}
+
+deviceFuture asyncQueue::write(cl_mem buffer, const void *host, size_t bytes, const futures &after)
+{
+        std::vector<cl_event> events;
+        cl_int ret = waitList(after, events);
+        if (ret != CL_SUCCESS)
+                return deviceFuture(NULL, ret);
+        cl_event ev = NULL;
+        ret = clEnqueueWriteBuffer(session.queue(q), buffer, CL_FALSE, 0, bytes, host, events.size(), events.empty() ? NULL : events.data(), &ev);
+        return track(ret, ev, clProfiler::HOST_TO_DEVICE, "async write", bytes);
+}
+
+deviceFuture asyncQueue::read(cl_mem buffer, void *host, size_t bytes, const futures &after)
+{
+        std::vector<cl_event> events;
+        cl_int ret = waitList(after, events);
+        if (ret != CL_SUCCESS)
+                return deviceFuture(NULL, ret);
+        cl_event ev = NULL;
+        ret = clEnqueueReadBuffer(session.queue(q), buffer, CL_FALSE, 0, bytes, host, events.size(), events.empty() ? NULL : events.data(), &ev);
+        return track(ret, ev, clProfiler::DEVICE_TO_HOST, "async read", bytes);
+}
+
+deviceFuture asyncQueue::vectorAdd(cl_mem A, cl_mem B, cl_mem C, size_t n, const futures &after)
+{
+        return elementwise(clSession::EW_ADD, C, A, B, NULL, 0.0f, n, after);
+}
+
+deviceFuture asyncQueue::elementwise(clSession::elementwiseOp op, cl_mem out, cl_mem X, cl_mem Y, cl_mem Z, float a, size_t n,
+                                     const futures &after)
+{
+        // The session records kernels in the profiler itself
+        std::vector<cl_event> events;
+        cl_int ret = waitList(after, events);
+        cl_event ev = NULL;
+        if (ret == CL_SUCCESS)
+                ret = session.elementwise(op, out, X, Y, Z, a, n, q, events, &ev);
+        return deviceFuture(ev, ret);
+}
+
+deviceFuture asyncQueue::matrixMult(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, clSession::gemmKernel variant,
+                                    const futures &after)
+{
+        std::vector<cl_event> events;
+        cl_int ret = waitList(after, events);
+        cl_event ev = NULL;
+        if (ret == CL_SUCCESS)
+                ret = session.matrixMult(A, B, C, M, K, N, variant, q, events, &ev);
+        return deviceFuture(ev, ret);
+}
+
+deviceFuture asyncQueue::join(const futures &after)
+{
+        std::vector<cl_event> events;
+        cl_int ret = waitList(after, events);
+        if (ret != CL_SUCCESS)
+                return deviceFuture(NULL, ret);
+        // An empty wait list would mean every command so far, so only skip the marker when
+        // the futures given were all complete already
+        if (!after.empty() && events.empty())
+                return deviceFuture();
+        cl_event ev = NULL;
+        ret = clEnqueueMarkerWithWaitList(session.queue(q), events.size(), events.empty() ? NULL : events.data(), &ev);
+        return deviceFuture(ret == CL_SUCCESS ? ev : NULL, ret);
+}
+
+cl_int asyncQueue::flush()
+{
+        return err != CL_SUCCESS ? err : clFlush(session.queue(q));
+}
+
+cl_int asyncQueue::finish()
+{
+        return err != CL_SUCCESS ? err : clFinish(session.queue(q));
+}
@@ -0,0 +1,283 @@
+#include "autoTuner.h"
+#include "clProfiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+#define TUNE_REPS 5          // timed launches per candidate, the median counts
+#define MAX_TUNE_DIM 1024    // larger GEMMs are tuned on a MAX_TUNE_DIM sized problem
+#define MAX_TUNE_VECTOR (1 << 24)
+
+static size_t pow2Bucket(size_t x, size_t minimum)
+{
+        size_t b = minimum;
+        while (b < x)
+                b <<= 1;
+        return b;
+}
+
+static size_t deviceSize(cl_device_id device, cl_device_info param)
+{
+        size_t value = 0;
+        clGetDeviceInfo(device, param, sizeof(value), &value, NULL);
+        return value;
+}
+
+autoTuner::autoTuner(clSession &session, const std::string &dbPath) : session(session)
+{
+        const char *env = getenv("CL_TUNE_DB");
+        path = !dbPath.empty() ? dbPath : env ? env : "cltune.db";
+
+        // Tuning results only hold for the device and driver they were measured on
+        char name[256] = {0}, driver[256] = {0};
+        clGetDeviceInfo(session.device(), CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+        clGetDeviceInfo(session.device(), CL_DRIVER_VERSION, sizeof(driver) - 1, driver, NULL);
+        deviceKey = std::string(name) + " / " + driver;
+        load();
+}
+
+void autoTuner::load()
+{
+        // One winner per line: device \t kernel \t bucket \t tile wpt width local us
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line))
+        {
+                size_t t1 = line.find('\t'), t2 = line.find('\t', t1 + 1), t3 = line.find('\t', t2 + 1);
+                if (line.empty() || line[0] == '#' || t3 == std::string::npos)
+                        continue;
+
+                record r;
+                std::istringstream fields(line.substr(t3 + 1));
+                if (!(fields >> r.config.tile >> r.config.wpt >> r.config.width >> r.config.local >> r.us))
+                        continue;
+                if (r.config.tile <= 0 || r.config.wpt <= 0 || r.config.tile % r.config.wpt != 0 ||
+                    r.config.width <= 0 || r.config.width > 16 || (r.config.width & (r.config.width - 1)) != 0)
+                        continue;
+                db[line.substr(0, t3)] = r;
+        }
+}
+
+void autoTuner::save() const
+{
+        // Written next to the database and renamed over it, so readers never see half a file
+        std::string tmp = path + "." + std::to_string(getpid()) + ".tmp";
+        {
+                std::ofstream out(tmp);
+                if (!out)
+                        return;
+                out << "# device\tkernel\tbucket\ttile wpt width local us" << std::endl;
+                for (const auto &entry : db)
+                {
+                        const clSession::kernelConfig &c = entry.second.config;
+                        out << entry.first << '\t' << c.tile << ' ' << c.wpt << ' ' << c.width << ' ' << c.local
+                            << ' ' << entry.second.us << std::endl;
+                }
+        }
+        if (rename(tmp.c_str(), path.c_str()) != 0)
+                remove(tmp.c_str());
+}
+
+bool autoTuner::lookup(const std::string &key, clSession::kernelConfig &config)
+{
+        auto it = db.find(key);
+        if (it == db.end())
+                return false;
+        config = it->second.config;
+        ++nHits;
+        return true;
+}
+
+clSession::kernelConfig autoTuner::gemm(int M, int K, int N)
+{
+        char bucket[64];
+        snprintf(bucket, sizeof(bucket), "%zux%zux%zu", pow2Bucket(M, 16), pow2Bucket(K, 16), pow2Bucket(N, 16));
+        std::string key = deviceKey + "\tmatrixMultTiled\t" + bucket;
+
+        clSession::kernelConfig config;
+        if (lookup(key, config) || !search)
+                return config;
+
+        db[key] = searchGemm(M, K, N);
+        save();
+        return db[key].config;
+}
+
+clSession::kernelConfig autoTuner::elementwise(size_t n)
+{
+        std::string key = deviceKey + "\telementwise\t" + std::to_string(pow2Bucket(n, 1024));
+
+        clSession::kernelConfig config;
+        if (lookup(key, config) || !search)
+                return config;
+
+        db[key] = searchElementwise(n);
+        save();
+        return db[key].config;
+}
+
+double autoTuner::time(const std::function<cl_int()> &launch)
+{
+        // The session records the launches in a private profiler for the duration
+        clProfiler timing;
+        clProfiler *previous = session.profiler();
+        session.setProfiler(&timing);
+
+        cl_int ret = launch();
+        timing.clear();
+        for (int i = 0; i < TUNE_REPS && ret == CL_SUCCESS; ++i)
+                ret = launch();
+        clFinish(session.queue());
+
+        std::vector<double> us;
+        for (const clProfiler::entry &e : timing.entries())
+                if (e.st == clProfiler::KERNEL)
+                        us.push_back((e.end - e.start) * 1e-3);
+        session.setProfiler(previous);
+
+        if (ret != CL_SUCCESS || us.empty())
+                return -1;
+        std::sort(us.begin(), us.end());
+        return us[us.size() / 2];
+}
+
+autoTuner::record autoTuner::searchGemm(int M, int K, int N)
+{
+        auto start = std::chrono::high_resolution_clock::now();
+        ++nSearches;
+        M = std::min(M, MAX_TUNE_DIM);
+        K = std::min(K, MAX_TUNE_DIM);
+        N = std::min(N, MAX_TUNE_DIM);
+
+        cl_device_id device = session.device();
+        size_t maxGroup = deviceSize(device, CL_DEVICE_MAX_WORK_GROUP_SIZE);
+        size_t maxItems[3] = {0, 0, 0};
+        clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(maxItems), maxItems, NULL);
+        cl_ulong localMem = 0;
+        clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMem), &localMem, NULL);
+
+        // Candidates within the device limits, split by whether the work-group size is
+        // a multiple of the kernel's preferred multiple
+        std::vector<clSession::kernelConfig> preferred, other;
+        for (int tile : {8, 16, 32})
+                for (int wpt : {1, 2, 4, 8})
+                {
+                        if (wpt > tile || tile % wpt != 0)
+                                continue;
+                        size_t group = (size_t)tile * tile / wpt;
+                        if (group > maxGroup || (size_t)tile > maxItems[0] || (size_t)(tile / wpt) > maxItems[1] ||
+                            2 * tile * tile * sizeof(float) > localMem)
+                                continue;
+
+                        char options[64];
+                        snprintf(options, sizeof(options), "-DTS=%d -DWPT=%d", tile, wpt);
+                        cl_kernel kernel = session.kernel("matrix_mult_kernel.cl", "matrixMultTiled", options);
+                        if (!kernel)
+                                continue;
+                        size_t kernelGroup = 0, multiple = 1;
+                        clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelGroup), &kernelGroup, NULL);
+                        clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, NULL);
+                        if (kernelGroup && group > kernelGroup)
+                                continue;
+
+                        clSession::kernelConfig c;
+                        c.tile = tile;
+                        c.wpt = wpt;
+                        (multiple <= 1 || group % multiple == 0 ? preferred : other).push_back(c);
+                }
+        if (preferred.empty())
+                preferred = other;
+
+        record best = {clSession::kernelConfig(), -1};
+        bufferPool &pool = session.buffers();
+        cl_int ret;
+        cl_mem a = pool.acquire((size_t)M * K * sizeof(float), CL_MEM_READ_ONLY, &ret);
+        cl_mem b = ret == CL_SUCCESS ? pool.acquire((size_t)K * N * sizeof(float), CL_MEM_READ_ONLY, &ret) : NULL;
+        cl_mem c = ret == CL_SUCCESS ? pool.acquire((size_t)M * N * sizeof(float), CL_MEM_WRITE_ONLY, &ret) : NULL;
+        if (ret == CL_SUCCESS)
+        {
+                // Ones rather than whatever the pool hands back, denormals and NaNs skew timings
+                float one = 1.0f;
+                clEnqueueFillBuffer(session.queue(), a, &one, sizeof(one), 0, (size_t)M * K * sizeof(float), 0, NULL, NULL);
+                clEnqueueFillBuffer(session.queue(), b, &one, sizeof(one), 0, (size_t)K * N * sizeof(float), 0, NULL, NULL);
+
+                for (const clSession::kernelConfig &candidate : preferred)
+                {
+                        double us = time([&]() { return session.matrixMult(a, b, c, M, K, N, clSession::GEMM_TILED, candidate); });
+                        if (us >= 0 && (best.us < 0 || us < best.us))
+                                best = {candidate, us};
+                }
+        }
+
+        for (cl_mem buffer : {a, b, c})
+                if (buffer)
+                        pool.release(buffer);
+        searchMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        return best;
+}
+
+autoTuner::record autoTuner::searchElementwise(size_t n)
+{
+        auto start = std::chrono::high_resolution_clock::now();
+        ++nSearches;
+        n = std::min<size_t>(n, MAX_TUNE_VECTOR);
+
+        cl_device_id device = session.device();
+        size_t maxGroup = deviceSize(device, CL_DEVICE_MAX_WORK_GROUP_SIZE);
+
+        record best = {clSession::kernelConfig(), -1};
+        bufferPool &pool = session.buffers();
+        size_t bytes = n * sizeof(float);
+        cl_int ret;
+        cl_mem a = pool.acquire(bytes, CL_MEM_READ_ONLY, &ret);
+        cl_mem b = ret == CL_SUCCESS ? pool.acquire(bytes, CL_MEM_READ_ONLY, &ret) : NULL;
+        cl_mem c = ret == CL_SUCCESS ? pool.acquire(bytes, CL_MEM_WRITE_ONLY, &ret) : NULL;
+
+        for (int width : {1, 2, 4, 8, 16})
+        {
+                if (ret != CL_SUCCESS)
+                        break;
+
+                char options[32];
+                snprintf(options, sizeof(options), "-DVW=%d", width);
+                cl_kernel kernel = session.kernel("elementwise_kernel.cl", "ew_add", options);
+                if (!kernel)
+                        continue;
+                size_t kernelGroup = 0, multiple = 1;
+                clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernelGroup), &kernelGroup, NULL);
+                clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(multiple), &multiple, NULL);
+                size_t limit = kernelGroup ? std::min(maxGroup, kernelGroup) : maxGroup;
+
+                // The driver's own choice, then powers of two times the preferred multiple
+                std::vector<size_t> locals = {0};
+                for (size_t local = std::max<size_t>(multiple, 1); local <= limit; local *= 2)
+                        locals.push_back(local);
+
+                for (size_t local : locals)
+                {
+                        clSession::kernelConfig candidate;
+                        candidate.width = width;
+                        candidate.local = local;
+                        double us = time([&]() { return session.elementwise(clSession::EW_ADD, c, a, b, NULL, 0.0f, n, candidate); });
+                        if (us >= 0 && (best.us < 0 || us < best.us))
+                                best = {candidate, us};
+                }
+        }
+
+        for (cl_mem buffer : {a, b, c})
+                if (buffer)
+                        pool.release(buffer);
+        searchMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        return best;
+}
+
+void autoTuner::report(std::ostream &os) const
+{
+        os << "Auto Tuner: " << nHits << " hits, " << nSearches << " searches, " << searchMs << " ms searching ("
+           << path << ", " << db.size() << " entries)" << std::endl;
+}
@@ -0,0 +1,992 @@
+#include <iostream>
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include <Eigen/Dense>
+
+#include "clErrors.h"
+#include "clSession.h"
+#include "mappedBuffer.h"
+#include "outOfCoreGemm.h"
+#include "deviceScheduler.h"
+#include "autoTuner.h"
+#include "deviceArray.h"
+#include "hybridDispatcher.h"
+#include "clExecutor.h"
+#include "sparseMatrix.h"
+#include "hostBackend.h"
+#include "strassenGemm.h"
+
+typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Matrix;
+
+using namespace std;
+
+// Usage: bench [--warmup N] [--reps N] [--vec-sizes a,b,..] [--mat-sizes a,b,..]
+//              [--csv file] [--json file] [--zero-copy] [--chunk elements] [--budget-mb n]
+//              [--multi-device] [--tune] [--hybrid] [--batch-sizes a,b,..] [--batch n] [--fp16]
+//              [--clients n] [--sparsity a,b,..] [--mtx file] [--strassen]
+// --zero-copy adds variants that use host memory in place (CL_MEM_USE_HOST_PTR and
+// mapped CL_MEM_ALLOC_HOST_PTR buffers) next to the explicit copy ones.
+// --chunk adds the chunked, multi-queue streaming vector_add with that chunk size.
+// --budget-mb adds the out-of-core GEMM limited to that much device memory; its
+// params column reports the bytes it actually moved.
+// --multi-device adds both operations split over every matching device.
+// --tune runs the OpenCL variants with autotuned launch configurations (searched on
+// the first repetition of a size not yet in the tuning database, see autoTuner.h).
+// --hybrid adds vector_add and matrixMult through the hybrid dispatcher, which runs
+// them on the host backend or OpenCL as its calibrated cost model decides; params shows which.
+// --fp16 adds vector_add and matrixMult with fp16 storage (float arithmetic); params
+// shows the largest error against the fp32 result, relative to its largest element
+// (inf once values leave the fp16 range, 65504).
+// --batch-sizes are the n of the n x n products in the batched GEMM rows, --batch the
+// number of products per call (default: as many as fit in 16 MB of A, at most 16384).
+// --clients adds both operations submitted by that many host threads at once through
+// a clExecutor (CL_EXECUTOR_WORKERS sets its worker count); each repetition is one
+// call per client, and params shows the worst client's p99 latency.
+// --sparsity adds SpMV and SpMM (times an n x n dense matrix) rows for random n x n
+// matrices of the --mat-sizes with that percentage of zeros: Eigen dense and sparse,
+// the dense OpenCL GEMM on the same matrix, and the CSR and ELL kernels. --mtx does
+// the same for a Matrix Market file. gflops counts 2 flops per nonzero for every
+// variant, so the dense rows show how much of their work is wasted on zeros.
+// The OpenCL device is picked with CL_DEVICE_TYPE / CL_DEVICE_NAME, e.g.
+// CL_DEVICE_TYPE=cpu to run against PoCL on machines without a GPU.
+// --strassen adds matrixMult through the Strassen-Winograd GEMM, with the crossover
+// from CL_STRASSEN_CROSSOVER or measured up to the largest --mat-sizes; params shows
+// the recursion and its error against the classic product next to the bound.
+// ocl_tiled_fixed is ocl_tiled with the kernel specialized for the shape (M, K and N
+// built in as constants, see clSession::specialize).
+// host_simd rows run on the multithreaded SIMD host backend (hostBackend.h) with the
+// widest instruction set the CPU has; CL_HOST_ISA=scalar|avx2 caps it.
+
+// The scalar triple loop is skipped above this size, it only adds minutes
+#define MAX_SCALAR_GEMM 512
+
+struct result
+{
+        string op;
+        string variant;
+        string shape;
+        string params; // variant settings, e.g. the streaming chunk size
+        double flops = 0;
+        double bytes = 0;
+        vector<double> wall = {};   // us per repetition, end to end
+        vector<double> kernel = {}; // us per repetition, device kernel time (OpenCL only)
+};
+
+static double percentile(vector<double> v, double p)
+{
+        if (v.empty())
+                return 0;
+        sort(v.begin(), v.end());
+        size_t idx = (size_t)(p * (v.size() - 1) + 0.5);
+        return v[idx];
+}
+
+static vector<int> parseList(const char *s)
+{
+        vector<int> v;
+        for (const char *p = s; *p;)
+        {
+                v.push_back(atoi(p));
+                const char *comma = strchr(p, ',');
+                if (!comma)
+                        break;
+                p = comma + 1;
+        }
+        return v;
+}
+
+// Runs 'op' warmup + reps times. When a profiler is given, the kernel time of each
+// repetition is taken from its KERNEL events.
+static void measure(result &r, int warmup, int reps, clProfiler *profiler, const function<cl_int()> &op)
+{
+        for (int i = 0; i < warmup; ++i)
+                op();
+        if (profiler)
+                profiler->clear();
+
+        for (int i = 0; i < reps; ++i)
+        {
+                auto start = chrono::high_resolution_clock::now();
+                cl_int ret = op();
+                auto end = chrono::high_resolution_clock::now();
+                if (ret != CL_SUCCESS)
+                {
+                        cerr << r.op << "/" << r.variant << " " << r.shape << ": " << getClErrorString(ret) << endl;
+                        return;
+                }
+                r.wall.push_back(chrono::duration<double, micro>(end - start).count());
+
+                if (profiler)
+                {
+                        double kernelUs = 0;
+                        for (const clProfiler::entry &e : profiler->entries())
+                                if (e.st == clProfiler::KERNEL)
+                                        kernelUs += (e.end - e.start) * 1e-3;
+                        r.kernel.push_back(kernelUs);
+                        profiler->clear();
+                }
+        }
+}
+
+static void printResult(const result &r)
+{
+        double med = percentile(r.wall, 0.5);
+        double kmed = percentile(r.kernel, 0.5);
+        double t = kmed > 0 ? kmed : med;
+        printf("%-10s %-18s %-16s %12.1f %12.1f %12.1f %10.2f %10.2f  %s\n", r.op.c_str(), r.variant.c_str(),
+               r.shape.c_str(), med, percentile(r.wall, 0.95), kmed,
+               t > 0 ? r.flops / t * 1e-3 : 0.0, t > 0 ? r.bytes / t * 1e-3 : 0.0, r.params.c_str());
+}
+
+// A CSV field, quoted (RFC 4180) when it holds a comma, quote or line break, as the
+// params of most variants do
+static string csvField(const string &text)
+{
+        if (text.find_first_of(",\"\r\n") == string::npos)
+                return text;
+        string quoted = "\"";
+        for (char c : text)
+        {
+                if (c == '"')
+                        quoted += '"';
+                quoted += c;
+        }
+        return quoted + "\"";
+}
+
+static void writeCsv(const string &path, const vector<result> &results)
+{
+        ofstream file(path);
+        file << "op,variant,shape,params,reps,median_us,p95_us,kernel_median_us,kernel_p95_us,gflops,gbps" << endl;
+        for (const result &r : results)
+        {
+                double med = percentile(r.wall, 0.5), kmed = percentile(r.kernel, 0.5);
+                double t = kmed > 0 ? kmed : med;
+                file << csvField(r.op) << "," << csvField(r.variant) << "," << csvField(r.shape) << "," << csvField(r.params) << ","
+                     << r.wall.size() << ","
+                     << med << "," << percentile(r.wall, 0.95) << "," << kmed << "," << percentile(r.kernel, 0.95) << ","
+                     << (t > 0 ? r.flops / t * 1e-3 : 0) << "," << (t > 0 ? r.bytes / t * 1e-3 : 0) << endl;
+        }
+}
+
+static void writeJson(const string &path, const string &device, const vector<result> &results)
+{
+        ofstream file(path);
+        file << "{\"device\":\"" << clProfiler::jsonEscape(device) << "\",\"results\":[" << endl;
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+                const result &r = results[i];
+                double med = percentile(r.wall, 0.5), kmed = percentile(r.kernel, 0.5);
+                double t = kmed > 0 ? kmed : med;
+                file << "  {\"op\":\"" << clProfiler::jsonEscape(r.op) << "\",\"variant\":\"" << clProfiler::jsonEscape(r.variant)
+                     << "\",\"shape\":\"" << clProfiler::jsonEscape(r.shape) << "\",\"params\":\"" << clProfiler::jsonEscape(r.params)
+                     << "\",\"reps\":" << r.wall.size() << ",\"median_us\":" << med
+                     << ",\"p95_us\":" << percentile(r.wall, 0.95) << ",\"kernel_median_us\":" << kmed
+                     << ",\"kernel_p95_us\":" << percentile(r.kernel, 0.95)
+                     << ",\"gflops\":" << (t > 0 ? r.flops / t * 1e-3 : 0)
+                     << ",\"gbps\":" << (t > 0 ? r.bytes / t * 1e-3 : 0) << "}"
+                     << (i + 1 < results.size() ? "," : "") << endl;
+        }
+        file << "]}" << endl;
+}
+
+// Elementwise operations benchmarked next to vector_add
+struct elementwiseCase
+{
+        const char *name;
+        clSession::elementwiseOp op;
+        double flops; // per element
+};
+
+static const elementwiseCase elementwiseCases[] = {
+    {"ew_sub", clSession::EW_SUB, 1},
+    {"ew_mul", clSession::EW_MUL, 1},
+    {"ew_axpy", clSession::EW_AXPY, 2},
+    {"ew_scale", clSession::EW_SCALE, 1},
+    {"ew_fma", clSession::EW_FMA, 2},
+};
+
+// Launch configuration the session uses for the size (tuned when --tune is given)
+static string configParams(clSession &session, size_t n)
+{
+        clSession::kernelConfig c = session.elementwiseConfig(n);
+        return "vw=" + to_string(c.width) + ",local=" + (c.local ? to_string(c.local) : string("auto"));
+}
+
+static string configParams(clSession &session, int M, int K, int N)
+{
+        clSession::kernelConfig c = session.gemmConfig(M, K, N);
+        return "ts=" + to_string(c.tile) + ",wpt=" + to_string(c.wpt);
+}
+
+// "devices=N,stolen=S,split=a/b/.." for the last scheduler run, split in % of the work
+static string multiParams(const deviceScheduler &scheduler)
+{
+        const vector<deviceScheduler::deviceStats> &st = scheduler.statistics();
+        size_t stolen = 0, units = 0;
+        for (const deviceScheduler::deviceStats &d : st)
+        {
+                stolen += d.stolen;
+                units += d.units;
+        }
+        string params = "devices=" + to_string(st.size()) + ",stolen=" + to_string(stolen) + ",split=";
+        for (size_t i = 0; i < st.size(); ++i)
+                params += (i ? "/" : "") + to_string(units ? (int)(100.0 * st[i].units / units + 0.5) : 0);
+        return params;
+}
+
+// "backend=host|device" of the dispatcher's last decision
+static string backendParams(const hybridDispatcher &dispatcher)
+{
+        const auto &d = dispatcher.decisions();
+        if (d.empty())
+                return "";
+        return string("backend=") + (d.back().chosen == hybridDispatcher::HOST ? "host" : "device");
+}
+
+// Accuracy of an fp16 storage result: max |result - exact| / max |exact|
+template <typename A, typename B>
+static string halfParams(const A &result, const B &exact)
+{
+        char params[64];
+        float scale = exact.abs().maxCoeff();
+        snprintf(params, sizeof(params), "rel_err=%.2e", (result - exact).abs().maxCoeff() / (scale > 0 ? scale : 1.0f));
+        return params;
+}
+
+// Batch size and throughput in products per second at the median wall time
+static string batchParams(const result &r, int batch)
+{
+        char params[64];
+        snprintf(params, sizeof(params), "batch=%d,matrices/s=%.3g", batch, batch / (percentile(r.wall, 0.5) * 1e-6));
+        return params;
+}
+
+// Runs op(client) once per client, each on a host thread of its own, and waits for all
+static cl_int concurrently(int clients, const function<cl_int(int)> &op)
+{
+        vector<cl_int> ret(clients, CL_SUCCESS);
+        vector<thread> threads;
+        for (int c = 0; c < clients; ++c)
+                threads.emplace_back([&, c]() { ret[c] = op(c); });
+        for (thread &t : threads)
+                t.join();
+        for (cl_int r : ret)
+                if (r != CL_SUCCESS)
+                        return r;
+        return CL_SUCCESS;
+}
+
+// "clients=N,workers=W,p99_us=x", x the largest per-client p99 latency since the last reset
+static string executorParams(const clExecutor &executor, int clients)
+{
+        double p99 = 0;
+        for (const auto &entry : executor.latencies())
+                p99 = max(p99, entry.second.p99);
+        char params[96];
+        snprintf(params, sizeof(params), "clients=%d,workers=%u,p99_us=%.1f", clients, executor.workers(), p99);
+        return params;
+}
+
+// Dense products are skipped for matrices above this many elements
+#define MAX_SPARSE_DENSE (4096 * 4096)
+
+// SpMV and SpMM rows for one sparse matrix, see --sparsity. All OpenCL operands stay
+// on the device, so the rows compare the kernels alone.
+static void benchSparse(clSession *session, clProfiler &profiler, const sparseMatrix::hostSparse &S, const string &shape,
+                        int warmup, int reps, vector<result> &results)
+{
+        int M = S.rows(), K = S.cols(), N = min(K, 1024);
+        bool dense = (size_t)M * K <= MAX_SPARSE_DENSE;
+        Matrix A = dense ? Matrix(S) : Matrix();
+        Eigen::VectorXf x = Eigen::VectorXf::Random(K), y(M);
+        Matrix B = Matrix::Random(K, N), C(M, N);
+        double nnz = S.nonZeros();
+        string density = "nnz=" + to_string(S.nonZeros());
+
+        for (int cols : {1, N})
+        {
+                const char *op = cols == 1 ? "spmv" : "spmm";
+                double flops = 2.0 * nnz * cols;
+                double bytes = nnz * (sizeof(int) + sizeof(float)) + ((double)K + M) * cols * sizeof(float);
+                string opShape = shape + (cols == 1 ? "" : "*" + to_string(cols));
+
+                result r;
+                if (dense)
+                {
+                        r = {op, "eigen_dense", opShape, density, flops, bytes};
+                        measure(r, warmup, reps, NULL, [&]() {
+                                if (cols == 1)
+                                        y.noalias() = A * x;
+                                else
+                                        C.noalias() = A * B;
+                                return CL_SUCCESS;
+                        });
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                r = {op, "eigen_sparse", opShape, density, flops, bytes};
+                measure(r, warmup, reps, NULL, [&]() {
+                        if (cols == 1)
+                                y.noalias() = S * x;
+                        else
+                                C.noalias() = S * B;
+                        return CL_SUCCESS;
+                });
+                printResult(r);
+                results.push_back(r);
+
+                if (!session)
+                        continue;
+                deviceArray in(*session, cols == 1 ? x.data() : B.data(), (size_t)K * cols), out(*session, (size_t)M * cols);
+                if (dense)
+                {
+                        deviceArray a(*session, A.data(), A.size());
+                        r = {op, "ocl_dense", opShape, density, flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() {
+                                cl_int ret = session->matrixMult(a.buffer(), in.buffer(), out.buffer(), M, K, cols);
+                                return ret == CL_SUCCESS ? clFinish(session->queue()) : ret;
+                        });
+                        printResult(r);
+                        results.push_back(r);
+                }
+                for (sparseMatrix::format f : {sparseMatrix::CSR, sparseMatrix::ELL})
+                {
+                        sparseMatrix sparse(*session, S, f);
+                        char params[96];
+                        snprintf(params, sizeof(params), "%s,pad=%.2f,kb=%.0f", density.c_str(), sparse.paddingRatio(),
+                                 sparse.deviceBytes() / 1024.0);
+                        r = {op, f == sparseMatrix::CSR ? "ocl_csr" : "ocl_ell", opShape, params, flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() {
+                                cl_int ret = sparse.multiply(in.buffer(), out.buffer(), cols);
+                                return ret == CL_SUCCESS ? clFinish(session->queue()) : ret;
+                        });
+                        printResult(r);
+                        results.push_back(r);
+                }
+        }
+}
+
+int main(int argc, char **argv)
+{
+        int warmup = 2, reps = 10;
+        vector<int> vecSizes = {1 << 10, 1 << 14, 1 << 18, 1 << 22, 1 << 24};
+        vector<int> matSizes = {32, 64, 128, 256, 512, 1024};
+        vector<int> batchSizes = {4, 8, 16, 32, 64};
+        int batchCount = 0;
+        string csvPath, jsonPath;
+        bool zeroCopy = false;
+        size_t chunk = 0;
+        double budgetMB = 0;
+        bool multiDevice = false;
+        bool tune = false;
+        bool hybrid = false;
+        bool fp16 = false;
+        bool useStrassen = false;
+        int clients = 0;
+        vector<int> sparsities;
+        string mtxPath;
+
+        for (int i = 1; i < argc; ++i)
+        {
+                string arg = argv[i];
+                if (arg == "--zero-copy")
+                {
+                        zeroCopy = true;
+                        continue;
+                }
+                if (arg == "--multi-device")
+                {
+                        multiDevice = true;
+                        continue;
+                }
+                if (arg == "--tune")
+                {
+                        tune = true;
+                        continue;
+                }
+                if (arg == "--hybrid")
+                {
+                        hybrid = true;
+                        continue;
+                }
+                if (arg == "--fp16")
+                {
+                        fp16 = true;
+                        continue;
+                }
+                if (arg == "--strassen")
+                {
+                        useStrassen = true;
+                        continue;
+                }
+                if (i + 1 >= argc)
+                        break;
+                if (arg == "--warmup")
+                        warmup = atoi(argv[++i]);
+                else if (arg == "--reps")
+                        reps = max(1, atoi(argv[++i]));
+                else if (arg == "--vec-sizes")
+                        vecSizes = parseList(argv[++i]);
+                else if (arg == "--mat-sizes")
+                        matSizes = parseList(argv[++i]);
+                else if (arg == "--batch-sizes")
+                        batchSizes = parseList(argv[++i]);
+                else if (arg == "--batch")
+                        batchCount = atoi(argv[++i]);
+                else if (arg == "--csv")
+                        csvPath = argv[++i];
+                else if (arg == "--json")
+                        jsonPath = argv[++i];
+                else if (arg == "--chunk")
+                        chunk = atol(argv[++i]);
+                else if (arg == "--budget-mb")
+                        budgetMB = atof(argv[++i]);
+                else if (arg == "--clients")
+                        clients = atoi(argv[++i]);
+                else if (arg == "--sparsity")
+                        sparsities = parseList(argv[++i]);
+                else if (arg == "--mtx")
+                        mtxPath = argv[++i];
+        }
+
+        // Without a usable device only the host variants run
+        // Three queues for the streaming variant
+        clSession *session = clSession::fromEnv(3);
+        clProfiler profiler;
+        bool useCL = session->error() == CL_SUCCESS;
+        string device = useCL ? session->deviceName() : "none";
+        // Rows use the generic kernels; the shape specialized GEMM is its own row
+        if (useCL)
+        {
+                session->setProfiler(&profiler);
+                session->setSpecializeAfter(0);
+        }
+        else
+                cerr << "No OpenCL device (" << getClErrorString(session->error()) << "), host variants only" << endl;
+
+        hostBackend cpu;
+        string cpuParams = "isa=" + string(hostBackend::isaName(cpu.instructions())) + ",threads=" + to_string(cpu.threads());
+
+        autoTuner *tuner = NULL;
+        if (useCL && tune)
+        {
+                tuner = new autoTuner(*session);
+                session->setTuner(tuner);
+        }
+
+        deviceScheduler *scheduler = NULL;
+        if (useCL && multiDevice)
+        {
+                scheduler = deviceScheduler::fromEnv();
+                if (scheduler->calibrate() != CL_SUCCESS)
+                {
+                        delete scheduler;
+                        scheduler = NULL;
+                }
+        }
+
+        hybridDispatcher *dispatcher = NULL;
+        if (useCL && hybrid)
+        {
+                dispatcher = new hybridDispatcher(*session);
+                if (dispatcher->prepare() != CL_SUCCESS)
+                {
+                        delete dispatcher;
+                        dispatcher = NULL;
+                }
+        }
+
+        clExecutor *executor = NULL;
+        if (useCL && clients > 0)
+        {
+                executor = clExecutor::fromEnv();
+                if (executor->error() != CL_SUCCESS)
+                {
+                        cerr << "Executor: " << getClErrorString(executor->error()) << endl;
+                        delete executor;
+                        executor = NULL;
+                }
+        }
+
+        strassenGemm *strassen = NULL;
+        if (useCL && useStrassen)
+        {
+                strassen = new strassenGemm(*session);
+                if (!strassen->crossover() && strassen->calibrate(matSizes.empty() ? 0 : *max_element(matSizes.begin(), matSizes.end())) != CL_SUCCESS)
+                {
+                        cerr << "Strassen calibration failed" << endl;
+                        delete strassen;
+                        strassen = NULL;
+                }
+        }
+
+        cout << "Device: " << device << ", warmup " << warmup << ", reps " << reps << endl;
+        printf("%-10s %-18s %-16s %12s %12s %12s %10s %10s  %s\n", "op", "variant", "shape",
+               "median_us", "p95_us", "kernel_us", "GFLOP/s", "GB/s", "params");
+
+        vector<result> results;
+
+        for (int n : vecSizes)
+        {
+                float *A = (float *)alignedHostAlloc(n * sizeof(float));
+                float *B = (float *)alignedHostAlloc(n * sizeof(float));
+                float *C = (float *)alignedHostAlloc(n * sizeof(float));
+                for (int i = 0; i < n; ++i)
+                {
+                        A[i] = i;
+                        B[i] = n - i;
+                }
+                string shape = to_string(n);
+                double flops = n, bytes = 3.0 * n * sizeof(float);
+
+                result r = {"vector_add", "cpu_scalar", shape, "", flops, bytes};
+                measure(r, warmup, reps, NULL, [&]() {
+                        for (int i = 0; i < n; ++i)
+                                C[i] = A[i] + B[i];
+                        return CL_SUCCESS;
+                });
+                printResult(r);
+                results.push_back(r);
+
+                r = {"vector_add", "eigen", shape, "", flops, bytes};
+                measure(r, warmup, reps, NULL, [&]() {
+                        Eigen::Map<Eigen::VectorXf>(C, n) = Eigen::Map<Eigen::VectorXf>(A, n) + Eigen::Map<Eigen::VectorXf>(B, n);
+                        return CL_SUCCESS;
+                });
+                printResult(r);
+                results.push_back(r);
+
+                r = {"vector_add", "host_simd", shape, cpuParams, flops, bytes};
+                measure(r, warmup, reps, NULL, [&]() { return cpu.vectorAdd(A, B, C, n); });
+                printResult(r);
+                results.push_back(r);
+
+                if (useCL)
+                {
+                        r = {"vector_add", "ocl", shape, configParams(*session, n), flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() { return session->vectorAdd(A, B, C, n); });
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (useCL && fp16)
+                {
+                        r = {"vector_add", "ocl_fp16", shape, "", flops, bytes / 2};
+                        measure(r, warmup, reps, &profiler, [&]() { return session->elementwiseHalf(clSession::EW_ADD, C, A, B, NULL, 0.0f, n); });
+                        Eigen::ArrayXf exact = Eigen::Map<Eigen::ArrayXf>(A, n) + Eigen::Map<Eigen::ArrayXf>(B, n);
+                        r.params = halfParams(Eigen::Map<Eigen::ArrayXf>(C, n), exact);
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (useCL && chunk)
+                {
+                        r = {"vector_add", "ocl_stream", shape, "chunk=" + to_string(chunk), flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() { return session->vectorAddStreamed(A, B, C, n, chunk); });
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (scheduler)
+                {
+                        // Kernel times are spread over several devices, only wall time is reported
+                        r = {"vector_add", "ocl_multi", shape, "", flops, bytes};
+                        measure(r, warmup, reps, NULL, [&]() { return scheduler->vectorAdd(A, B, C, n, chunk); });
+                        r.params = multiParams(*scheduler);
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (executor)
+                {
+                        // Every client writes its own result, figures are for all clients together
+                        vector<vector<float>> out(clients, vector<float>(n));
+                        r = {"vector_add", "ocl_executor", shape, "", flops * clients, bytes * clients};
+                        executor->resetStatistics();
+                        measure(r, warmup, reps, NULL, [&]() {
+                                return concurrently(clients, [&](int c) { return executor->vectorAdd(c, A, B, out[c].data(), n).get(); });
+                        });
+                        r.params = executorParams(*executor, clients);
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (dispatcher)
+                {
+                        // Host data in and out, as an application would call it
+                        r = {"vector_add", "hybrid", shape, "", flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() {
+                                deviceMatrix a(*session, A, n, 1), b(*session, B, n, 1), c(*session, C, n, 1);
+                                cl_int ret = dispatcher->elementwise(clSession::EW_ADD, c, &a, &b, NULL, 0.0f);
+                                return ret == CL_SUCCESS ? c.syncHost() : ret;
+                        });
+                        r.params = backendParams(*dispatcher);
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (useCL && zeroCopy)
+                {
+                        session->setZeroCopy(true);
+                        r = {"vector_add", "ocl_zerocopy", shape, "", flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() { return session->vectorAdd(A, B, C, n); });
+                        printResult(r);
+                        results.push_back(r);
+                        session->setZeroCopy(false);
+
+                        // Inputs written once in place, each repetition runs the kernel and maps C
+                        size_t nb = n * sizeof(float);
+                        mappedBuffer a(session->context(), session->queue(), nb, CL_MEM_READ_ONLY);
+                        mappedBuffer b(session->context(), session->queue(), nb, CL_MEM_READ_ONLY);
+                        mappedBuffer c(session->context(), session->queue(), nb, CL_MEM_WRITE_ONLY);
+                        if (a.error() == CL_SUCCESS && b.error() == CL_SUCCESS && c.error() == CL_SUCCESS)
+                        {
+                                memcpy(a.map(CL_MAP_WRITE_INVALIDATE_REGION), A, nb);
+                                memcpy(b.map(CL_MAP_WRITE_INVALIDATE_REGION), B, nb);
+                                a.unmap();
+                                b.unmap();
+
+                                r = {"vector_add", "ocl_mapped", shape, "", flops, bytes};
+                                measure(r, warmup, reps, &profiler, [&]() {
+                                        cl_int ret = session->vectorAdd(a.mem(), b.mem(), c.mem(), n);
+                                        if (ret == CL_SUCCESS && !c.map(CL_MAP_READ))
+                                                ret = c.error();
+                                        c.unmap();
+                                        return ret;
+                                });
+                                printResult(r);
+                                results.push_back(r);
+                        }
+                }
+
+                // The rest of the elementwise family; C doubles as the third fma operand
+                float *D = (float *)alignedHostAlloc(n * sizeof(float));
+                Eigen::Map<Eigen::VectorXf> a(A, n), b(B, n), c(C, n), d(D, n);
+                const float s = 0.5f;
+                for (const elementwiseCase &e : elementwiseCases)
+                {
+                        double elementBytes = (clSession::elementwiseInputs(e.op) + 1.0) * sizeof(float);
+                        r = {e.name, "eigen", shape, "", e.flops * n, elementBytes * n};
+                        measure(r, warmup, reps, NULL, [&]() {
+                                switch (e.op)
+                                {
+                                case clSession::EW_SUB: d = a - b; break;
+                                case clSession::EW_MUL: d = a.cwiseProduct(b); break;
+                                case clSession::EW_AXPY: d = s * a + b; break;
+                                case clSession::EW_SCALE: d = s * a; break;
+                                default: d = a.cwiseProduct(b) + c; break;
+                                }
+                                return CL_SUCCESS;
+                        });
+                        printResult(r);
+                        results.push_back(r);
+
+                        if (useCL)
+                        {
+                                r = {e.name, "ocl", shape, configParams(*session, n), e.flops * n, elementBytes * n};
+                                measure(r, warmup, reps, &profiler, [&]() { return session->elementwise(e.op, D, A, B, C, s, n); });
+                                printResult(r);
+                                results.push_back(r);
+                        }
+                }
+
+                // D = A + B * s - C: Eigen, two elementwise launches through a temporary, and
+                // one fused expression kernel. Inputs stay on the device, D is read back.
+                // Bytes are the fused minimum, so GB/s shows the saving of the fusion.
+                const string expr = "a+b*s-c";
+                r = {expr, "eigen", shape, "", 3.0 * n, 4.0 * n * sizeof(float)};
+                measure(r, warmup, reps, NULL, [&]() {
+                        d = a + b * s - c;
+                        return CL_SUCCESS;
+                });
+                printResult(r);
+                results.push_back(r);
+
+                if (useCL)
+                {
+                        deviceArray dA(*session, A, n), dB(*session, B, n), dC(*session, C, n), dD(*session, n), dT(*session, n);
+                        r = {expr, "ocl_chain", shape, "launches=2", 3.0 * n, 4.0 * n * sizeof(float)};
+                        measure(r, warmup, reps, &profiler, [&]() {
+                                cl_int ret = session->elementwise(clSession::EW_AXPY, dT.buffer(), dB.buffer(), dA.buffer(), NULL, s, n);
+                                if (ret == CL_SUCCESS)
+                                        ret = session->elementwise(clSession::EW_SUB, dD.buffer(), dT.buffer(), dC.buffer(), NULL, 0.0f, n);
+                                return ret == CL_SUCCESS ? dD.read(D) : ret;
+                        });
+                        printResult(r);
+                        results.push_back(r);
+
+                        r = {expr, "ocl_fused", shape, "launches=1", 3.0 * n, 4.0 * n * sizeof(float)};
+                        measure(r, warmup, reps, &profiler, [&]() {
+                                dD = dA + dB * s - dC;
+                                return dD.error() == CL_SUCCESS ? dD.read(D) : dD.error();
+                        });
+                        printResult(r);
+                        results.push_back(r);
+                }
+                alignedHostFree(D);
+
+                alignedHostFree(A);
+                alignedHostFree(B);
+                alignedHostFree(C);
+        }
+
+        for (int n : matSizes)
+        {
+                Matrix A = Matrix::Random(n, n), B = Matrix::Random(n, n), C(n, n);
+                string shape = to_string(n) + "x" + to_string(n) + "x" + to_string(n);
+                double flops = 2.0 * n * n * n, bytes = 3.0 * n * n * sizeof(float);
+
+                result r = {"matrixMult", "cpu_scalar", shape, "", flops, bytes};
+                if (n <= MAX_SCALAR_GEMM)
+                {
+                        measure(r, warmup, reps, NULL, [&]() {
+                                C.setZero();
+                                for (int i = 0; i < n; ++i)
+                                        for (int k = 0; k < n; ++k)
+                                                for (int j = 0; j < n; ++j)
+                                                        C(i, j) += A(i, k) * B(k, j);
+                                return CL_SUCCESS;
+                        });
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                r = {"matrixMult", "eigen", shape, "", flops, bytes};
+                measure(r, warmup, reps, NULL, [&]() {
+                        C.noalias() = A * B;
+                        return CL_SUCCESS;
+                });
+                printResult(r);
+                results.push_back(r);
+
+                r = {"matrixMult", "host_simd", shape, cpuParams, flops, bytes};
+                measure(r, warmup, reps, NULL, [&]() { return cpu.matrixMult(A.data(), B.data(), C.data(), n, n, n); });
+                printResult(r);
+                results.push_back(r);
+
+                if (useCL)
+                {
+                        r = {"matrixMult", "ocl_naive", shape, "", flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() { return session->matrixMult(A.data(), B.data(), C.data(), n, n, n, clSession::GEMM_NAIVE); });
+                        printResult(r);
+                        results.push_back(r);
+
+                        r = {"matrixMult", "ocl_tiled", shape, configParams(*session, n, n, n), flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() { return session->matrixMult(A.data(), B.data(), C.data(), n, n, n, clSession::GEMM_TILED); });
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (useCL && fp16)
+                {
+                        r = {"matrixMult", "ocl_tiled_fp16", shape, "", flops, bytes / 2};
+                        measure(r, warmup, reps, &profiler, [&]() { return session->matrixMultHalf(A.data(), B.data(), C.data(), n, n, n); });
+                        Matrix exact = A * B;
+                        r.params = halfParams(C.array(), exact.array());
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (dispatcher)
+                {
+                        r = {"matrixMult", "hybrid", shape, "", flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() {
+                                deviceMatrix a(*session, A.data(), n, n), b(*session, B.data(), n, n), c(*session, C.data(), n, n);
+                                cl_int ret = dispatcher->gemm(c, a, b);
+                                return ret == CL_SUCCESS ? c.syncHost() : ret;
+                        });
+                        r.params = backendParams(*dispatcher);
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (useCL && zeroCopy)
+                {
+                        session->setZeroCopy(true);
+                        r = {"matrixMult", "ocl_tiled_zerocopy", shape, "", flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() { return session->matrixMult(A.data(), B.data(), C.data(), n, n, n, clSession::GEMM_TILED); });
+                        printResult(r);
+                        results.push_back(r);
+                        session->setZeroCopy(false);
+                }
+
+                if (scheduler)
+                {
+                        r = {"matrixMult", "ocl_multi", shape, "", flops, bytes};
+                        measure(r, warmup, reps, NULL, [&]() { return scheduler->matrixMult(A.data(), B.data(), C.data(), n, n, n); });
+                        r.params = multiParams(*scheduler);
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (executor)
+                {
+                        vector<Matrix> out(clients, Matrix(n, n));
+                        r = {"matrixMult", "ocl_executor", shape, "", flops * clients, bytes * clients};
+                        executor->resetStatistics();
+                        measure(r, warmup, reps, NULL, [&]() {
+                                return concurrently(clients, [&](int c) {
+                                        return executor->matrixMult(c, A.data(), B.data(), out[c].data(), n, n, n).get();
+                                });
+                        });
+                        r.params = executorParams(*executor, clients);
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (useCL && budgetMB > 0)
+                {
+                        outOfCoreGemm ooc(*session, (size_t)(budgetMB * 1048576));
+                        r = {"matrixMult", "ocl_ooc", shape, "", flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() { return ooc.run(A.data(), B.data(), C.data(), n, n, n); });
+                        const outOfCoreGemm::stats &st = ooc.statistics();
+                        char params[128];
+                        snprintf(params, sizeof(params), "budget=%gMB,h2d=%.1fMB,d2h=%.1fMB", budgetMB,
+                                 st.bytesUploaded / 1048576.0, st.bytesDownloaded / 1048576.0);
+                        r.params = params;
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                if (strassen)
+                {
+                        r = {"matrixMult", "ocl_strassen", shape, "", flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() { return strassen->run(A.data(), B.data(), C.data(), n); });
+                        deviceMatrix dA(*session, A.data(), n, n), dB(*session, B.data(), n, n), dC(*session, C.data(), n, n);
+                        strassenGemm::errorReport e;
+                        if (strassen->checkError(dA.device().buffer(), dB.device().buffer(), dC.device().buffer(), n, e) == CL_SUCCESS)
+                        {
+                                char params[128];
+                                snprintf(params, sizeof(params), "levels=%d,base=%d,err=%.2g,bound=%.2g", e.levels, e.base, e.measured, e.bound);
+                                r.params = params;
+                        }
+                        printResult(r);
+                        results.push_back(r);
+                }
+
+                // Last, as every later product of this shape would also run specialized.
+                // Built before measuring, so it differs from ocl_tiled only in the kernel.
+                if (useCL)
+                {
+                        r = {"matrixMult", "ocl_tiled_fixed", shape, configParams(*session, n, n, n), flops, bytes};
+                        if (session->specialize(n, n, n) == CL_SUCCESS)
+                        {
+                                measure(r, warmup, reps, &profiler, [&]() { return session->matrixMult(A.data(), B.data(), C.data(), n, n, n, clSession::GEMM_TILED); });
+                                printResult(r);
+                                results.push_back(r);
+                        }
+                }
+        }
+
+        // Many small products per call: Eigen one at a time, OpenCL as one launch over
+        // the packed batch (strided) and through the pointer-array interface
+        for (int n : batchSizes)
+        {
+                int batch = batchCount > 0 ? batchCount : min(16384, (1 << 22) / (n * n));
+                size_t elements = (size_t)n * n * batch;
+                vector<float> A(elements), B(elements), C(elements);
+                Eigen::Map<Eigen::VectorXf>(A.data(), elements).setRandom();
+                Eigen::Map<Eigen::VectorXf>(B.data(), elements).setRandom();
+                string shape = to_string(n) + "x" + to_string(n) + "x" + to_string(n);
+                double flops = 2.0 * n * n * n * batch, bytes = 3.0 * elements * sizeof(float);
+
+                result r = {"gemm_batched", "eigen", shape, "", flops, bytes};
+                measure(r, warmup, reps, NULL, [&]() {
+                        for (int b = 0; b < batch; ++b)
+                        {
+                                size_t offset = (size_t)n * n * b;
+                                Eigen::Map<Matrix> c(C.data() + offset, n, n);
+                                c.noalias() = Eigen::Map<const Matrix>(A.data() + offset, n, n) * Eigen::Map<const Matrix>(B.data() + offset, n, n);
+                        }
+                        return CL_SUCCESS;
+                });
+                r.params = batchParams(r, batch);
+                printResult(r);
+                results.push_back(r);
+
+                if (useCL)
+                {
+                        r = {"gemm_batched", "ocl_strided", shape, "", flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() { return session->matrixMultBatched(A.data(), B.data(), C.data(), n, n, n, batch); });
+                        r.params = batchParams(r, batch);
+                        printResult(r);
+                        results.push_back(r);
+
+                        vector<const float *> pA(batch), pB(batch);
+                        vector<float *> pC(batch);
+                        vector<int> dims(batch, n);
+                        for (int b = 0; b < batch; ++b)
+                        {
+                                size_t offset = (size_t)n * n * b;
+                                pA[b] = A.data() + offset;
+                                pB[b] = B.data() + offset;
+                                pC[b] = C.data() + offset;
+                        }
+                        r = {"gemm_batched", "ocl_pointers", shape, "", flops, bytes};
+                        measure(r, warmup, reps, &profiler, [&]() {
+                                return session->matrixMultBatched(pA.data(), pB.data(), pC.data(), dims.data(), dims.data(), dims.data(), batch);
+                        });
+                        r.params = batchParams(r, batch);
+                        printResult(r);
+                        results.push_back(r);
+                }
+        }
+
+        for (int sparsity : sparsities)
+                for (int n : matSizes)
+                {
+                        // Uniformly scattered nonzeros
+                        Matrix dense = Matrix::Random(n, n);
+                        Matrix keep = (Matrix::Random(n, n).array() + 1.0f) * 50.0f;
+                        dense = (keep.array() < 100 - sparsity).select(dense, 0.0f);
+                        string shape = to_string(n) + "x" + to_string(n) + "@" + to_string(sparsity) + "%";
+                        benchSparse(useCL ? session : NULL, profiler, sparseMatrix::fromDense(dense), shape, warmup, reps, results);
+                }
+
+        if (!mtxPath.empty())
+        {
+                sparseMatrix::hostSparse S;
+                if (sparseMatrix::loadMatrixMarket(mtxPath, S) == CL_SUCCESS)
+                        benchSparse(useCL ? session : NULL, profiler, S, to_string(S.rows()) + "x" + to_string(S.cols()), warmup,
+                                    reps, results);
+        }
+
+        if (!csvPath.empty())
+                writeCsv(csvPath, results);
+        if (!jsonPath.empty())
+                writeJson(jsonPath, device, results);
+
+        if (tuner)
+                tuner->report();
+        if (dispatcher)
+                dispatcher->report();
+        if (executor)
+                executor->report();
+        if (strassen)
+                strassen->report();
+
+        session->setProfiler(NULL);
+        delete executor;
+        delete strassen;
+        delete dispatcher;
+        delete scheduler;
+        delete tuner;
+        delete session;
+        return 0;
+}
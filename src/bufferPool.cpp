@@ -0,0 +1,170 @@
+#include "bufferPool.h"
+
+#include <algorithm>
+
+bufferPool::bufferPool(cl_context clContext, cl_device_id device, size_t slabSize, size_t maxSubBuffer)
+    : clContext(clContext), slabSize(slabSize), maxSubBuffer(maxSubBuffer)
+{
+        cl_uint alignBits = 0;
+        clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(alignBits), &alignBits, NULL);
+        align = std::max<size_t>(alignBits / 8, 256);
+        cl_ulong maxAllocBytes = 0;
+        clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAllocBytes), &maxAllocBytes, NULL);
+        maxAlloc = maxAllocBytes;
+}
+
+bufferPool::~bufferPool()
+{
+        // Sub-buffers must go before the slabs they live in
+        for (cl_mem buffer : subBuffers)
+                clReleaseMemObject(buffer);
+        for (auto &f : freeLists)
+                for (cl_mem buffer : f.second)
+                        if (f.first.first > maxSubBuffer)
+                                clReleaseMemObject(buffer);
+        for (auto &u : inUse)
+                if (u.second.key.first > maxSubBuffer)
+                        clReleaseMemObject(u.first);
+        for (slab &s : slabs)
+                clReleaseMemObject(s.buffer);
+}
+
+size_t bufferPool::sizeClass(size_t size) const
+{
+        size_t bytes = align;
+        while (bytes < size && bytes < maxSubBuffer)
+                bytes <<= 1;
+        if (bytes >= size)
+                return bytes;
+
+        // Stand-alone buffers: four classes per power of two, so a request wastes at
+        // most a quarter of its size, rounded to the alignment
+        size_t octave = maxSubBuffer;
+        while (octave <= size / 2)
+                octave <<= 1;
+        size_t step = std::max(octave / 4, align);
+        bytes = (size + step - 1) / step * step;
+        // A request the device can allocate must not be rounded past its limit
+        if (maxAlloc && size <= maxAlloc && bytes > maxAlloc)
+                bytes = size;
+        return bytes;
+}
+
+cl_mem bufferPool::carve(size_t bytes, cl_mem_flags flags, cl_int *ret)
+{
+        // Classes are powers of two no smaller than the base alignment, so bumping
+        // 'used' by whole classes keeps every sub-buffer origin aligned
+        slab *target = NULL;
+        for (slab &s : slabs)
+        {
+                size_t offset = (s.used + bytes - 1) / bytes * bytes;
+                if (offset + bytes <= slabSize)
+                {
+                        s.used = offset;
+                        target = &s;
+                        break;
+                }
+        }
+
+        if (!target)
+        {
+                cl_mem buffer = clCreateBuffer(clContext, CL_MEM_READ_WRITE, slabSize, NULL, ret);
+                if (*ret != CL_SUCCESS)
+                        return NULL;
+                slabs.push_back({buffer, 0});
+                st.slabs++;
+                st.slabBytes += slabSize;
+                target = &slabs.back();
+        }
+
+        cl_buffer_region region = {target->used, bytes};
+        cl_mem buffer = clCreateSubBuffer(target->buffer, flags, CL_BUFFER_CREATE_TYPE_REGION, &region, ret);
+        if (*ret != CL_SUCCESS)
+                return NULL;
+        target->used += bytes;
+        subBuffers.push_back(buffer);
+        return buffer;
+}
+
+cl_mem bufferPool::acquire(size_t size, cl_mem_flags flags, cl_int *ret)
+{
+        cl_int err = CL_SUCCESS;
+        if (!ret)
+                ret = &err;
+        *ret = CL_SUCCESS;
+
+        st.requests++;
+        classKey key(sizeClass(size), flags);
+
+        cl_mem buffer = NULL;
+        std::vector<cl_mem> &freeList = freeLists[key];
+        if (!freeList.empty())
+        {
+                buffer = freeList.back();
+                freeList.pop_back();
+                st.hits++;
+                st.bytesCached -= key.first;
+        }
+        else
+        {
+                st.misses++;
+                if (key.first <= maxSubBuffer)
+                {
+                        buffer = carve(key.first, flags, ret);
+                }
+                else
+                {
+                        buffer = clCreateBuffer(clContext, flags, key.first, NULL, ret);
+                        if (*ret == CL_MEM_OBJECT_ALLOCATION_FAILURE || *ret == CL_OUT_OF_RESOURCES)
+                        {
+                                // Give cached buffers back to the driver and try once more
+                                trim();
+                                buffer = clCreateBuffer(clContext, flags, key.first, NULL, ret);
+                        }
+                }
+                if (*ret != CL_SUCCESS)
+                        return NULL;
+        }
+
+        inUse[buffer] = {key, size};
+        st.bytesInUse += key.first;
+        st.highWater = std::max(st.highWater, st.bytesInUse);
+        st.requestedInUse += size;
+        st.requestedHighWater = std::max(st.requestedHighWater, st.requestedInUse);
+        return buffer;
+}
+
+void bufferPool::release(cl_mem buffer)
+{
+        auto it = inUse.find(buffer);
+        if (it == inUse.end())
+                return;
+
+        freeLists[it->second.key].push_back(buffer);
+        st.bytesInUse -= it->second.key.first;
+        st.bytesCached += it->second.key.first;
+        st.requestedInUse -= it->second.requested;
+        inUse.erase(it);
+}
+
+void bufferPool::trim()
+{
+        // Sub-buffers stay cached: their slab space is never handed back individually
+        for (auto &f : freeLists)
+        {
+                if (f.first.first <= maxSubBuffer)
+                        continue;
+                for (cl_mem buffer : f.second)
+                        clReleaseMemObject(buffer);
+                st.bytesCached -= f.first.first * f.second.size();
+                f.second.clear();
+        }
+}
+
+void bufferPool::report(std::ostream &os) const
+{
+        os << "Buffer Pool: " << st.requests << " requests, " << st.hits << " hits ("
+           << st.hitRate() * 100.0 << "%), " << st.misses << " misses, high water "
+           << st.highWater / 1024.0 << " KB (" << st.requestedHighWater / 1024.0 << " KB requested), cached " << st.bytesCached / 1024.0 << " KB, "
+           << st.slabs << " slabs (" << st.slabBytes / 1024.0 << " KB)" << std::endl;
+}
@@ -0,0 +1,218 @@
+#include "clExecutor.h"
+#include "clErrors.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+
+#define MAX_DEFAULT_WORKERS 4
+
+static double micros(std::chrono::high_resolution_clock::time_point from, std::chrono::high_resolution_clock::time_point to)
+{
+        return std::chrono::duration<double, std::micro>(to - from).count();
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const std::vector<double> &sorted, double p)
+{
+        if (sorted.empty())
+                return 0;
+        size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+        return sorted[std::min(i, sorted.size() - 1)];
+}
+
+clExecutor::clExecutor(cl_device_id device, unsigned workers)
+{
+        start(device, workers);
+}
+
+clExecutor::clExecutor(cl_device_type type, const std::string &name, unsigned workers)
+{
+        std::vector<cl_device_id> found = clSession::devices(type, name);
+        if (found.empty())
+        {
+                err = CL_DEVICE_NOT_FOUND;
+                return;
+        }
+        start(found[0], workers);
+}
+
+clExecutor::~clExecutor()
+{
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+        }
+        available.notify_all();
+        for (std::thread &t : threads)
+                t.join();
+        for (clSession *session : sessions)
+                delete session;
+}
+
+clExecutor *clExecutor::fromEnv()
+{
+        const char *devName = getenv("CL_DEVICE_NAME");
+        const char *workers = getenv("CL_EXECUTOR_WORKERS");
+        return new clExecutor(clSession::parseDeviceType(getenv("CL_DEVICE_TYPE")), devName ? devName : "",
+                              workers ? atoi(workers) : 0);
+}
+
+const std::string &clExecutor::deviceName() const
+{
+        static const std::string none;
+        return sessions.empty() ? none : sessions[0]->deviceName();
+}
+
+void clExecutor::start(cl_device_id device, unsigned workers)
+{
+        if (workers == 0)
+                workers = std::max(1u, std::min(std::thread::hardware_concurrency(), (unsigned)MAX_DEFAULT_WORKERS));
+
+        for (unsigned i = 0; i < workers; ++i)
+        {
+                clSession *session = new clSession(device);
+                if (session->error() != CL_SUCCESS)
+                {
+                        err = session->error();
+                        delete session;
+                        break;
+                }
+                sessions.push_back(session);
+        }
+        if (err != CL_SUCCESS)
+                return;
+
+        for (size_t i = 0; i < sessions.size(); ++i)
+                threads.emplace_back(&clExecutor::work, this, i);
+}
+
+void clExecutor::work(size_t worker)
+{
+        clSession &session = *sessions[worker];
+        for (;;)
+        {
+                task t;
+                {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        available.wait(lock, [this]() { return stopping || !pending.empty(); });
+                        // Drain the queue before stopping so no future is left unfulfilled
+                        if (pending.empty())
+                                return;
+                        t = std::move(pending.front());
+                        pending.pop_front();
+                }
+
+                auto started = std::chrono::high_resolution_clock::now();
+                // A throwing task must not take the worker down or leave its future unfulfilled
+                cl_int ret = CL_SUCCESS;
+                std::exception_ptr failure;
+                try
+                {
+                        ret = t.run(session);
+                }
+                catch (...)
+                {
+                        failure = std::current_exception();
+                }
+                auto finished = std::chrono::high_resolution_clock::now();
+
+                {
+                        std::lock_guard<std::mutex> lock(statsMutex);
+                        samples &s = stats[t.client];
+                        s.total.push_back(micros(t.submitted, finished));
+                        s.wait.push_back(micros(t.submitted, started));
+                }
+                if (failure)
+                        t.result.set_exception(failure);
+                else
+                        t.result.set_value(ret);
+        }
+}
+
+std::future<cl_int> clExecutor::submit(unsigned client, std::function<cl_int(clSession &)> run)
+{
+        task t;
+        t.client = client;
+        t.run = std::move(run);
+        t.submitted = std::chrono::high_resolution_clock::now();
+        std::future<cl_int> result = t.result.get_future();
+
+        if (err != CL_SUCCESS)
+        {
+                t.result.set_value(err);
+                return result;
+        }
+
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.push_back(std::move(t));
+        }
+        available.notify_one();
+        return result;
+}
+
+std::future<cl_int> clExecutor::vectorAdd(unsigned client, const float *A, const float *B, float *C, size_t n)
+{
+        return submit(client, [=](clSession &session) { return session.vectorAdd(A, B, C, n); });
+}
+
+std::future<cl_int> clExecutor::elementwise(unsigned client, clSession::elementwiseOp op, float *out,
+                                            const float *X, const float *Y, const float *Z, float a, size_t n)
+{
+        return submit(client, [=](clSession &session) { return session.elementwise(op, out, X, Y, Z, a, n); });
+}
+
+std::future<cl_int> clExecutor::matrixMult(unsigned client, const float *A, const float *B, float *C, int M, int K, int N,
+                                           clSession::gemmKernel variant)
+{
+        return submit(client, [=](clSession &session) { return session.matrixMult(A, B, C, M, K, N, variant); });
+}
+
+std::map<unsigned, clExecutor::latencyStats> clExecutor::latencies() const
+{
+        std::map<unsigned, samples> copy;
+        {
+                std::lock_guard<std::mutex> lock(statsMutex);
+                copy = stats;
+        }
+
+        std::map<unsigned, latencyStats> result;
+        for (auto &entry : copy)
+        {
+                samples &s = entry.second;
+                std::sort(s.total.begin(), s.total.end());
+                std::sort(s.wait.begin(), s.wait.end());
+                latencyStats &l = result[entry.first];
+                l.count = s.total.size();
+                l.p50 = percentile(s.total, 0.5);
+                l.p95 = percentile(s.total, 0.95);
+                l.p99 = percentile(s.total, 0.99);
+                l.max = s.total.empty() ? 0 : s.total.back();
+                l.waitP50 = percentile(s.wait, 0.5);
+        }
+        return result;
+}
+
+void clExecutor::resetStatistics()
+{
+        std::lock_guard<std::mutex> lock(statsMutex);
+        stats.clear();
+}
+
+void clExecutor::report(std::ostream &os) const
+{
+        char line[128];
+        os << "Executor: " << workers() << " workers on " << deviceName() << std::endl;
+        snprintf(line, sizeof(line), "  %-8s %8s %12s %12s %12s %12s %12s\n", "client", "tasks", "p50_us", "p95_us", "p99_us",
+                 "max_us", "wait_p50_us");
+        os << line;
+        for (const auto &entry : latencies())
+        {
+                const latencyStats &l = entry.second;
+                snprintf(line, sizeof(line), "  %-8u %8zu %12.1f %12.1f %12.1f %12.1f %12.1f\n", entry.first, l.count, l.p50,
+                         l.p95, l.p99, l.max, l.waitP50);
+                os << line;
+        }
+}
@@ -0,0 +1,154 @@
+#include "clProfiler.h"
+
+#include <fstream>
+#include <cstdio>
+#include <algorithm>
+
+std::string clProfiler::jsonEscape(const std::string &text)
+{
+        std::string out;
+        for (unsigned char c : text)
+        {
+                if (c == '"' || c == '\\')
+                {
+                        out += '\\';
+                        out += c;
+                }
+                else if (c < 0x20)
+                {
+                        char code[8];
+                        snprintf(code, sizeof(code), "\\u%04x", c);
+                        out += code;
+                }
+                else
+                        out += c;
+        }
+        return out;
+}
+
+clProfiler::~clProfiler()
+{
+        clear();
+}
+
+const char *clProfiler::stageName(stage st)
+{
+        switch (st)
+        {
+        case HOST_TO_DEVICE:
+                return "H2D";
+        case KERNEL:
+                return "Kernel";
+        case DEVICE_TO_HOST:
+                return "D2H";
+        default:
+                return "?";
+        }
+}
+
+void clProfiler::record(cl_event event, stage st, const std::string &label, double bytes, double flops)
+{
+        if (!event)
+                return;
+        events.push_back({event, {st, label, bytes, flops, 0, 0, 0, 0}});
+}
+
+void clProfiler::resolve()
+{
+        for (pending &p : events)
+        {
+                clWaitForEvents(1, &p.event);
+                clGetEventProfilingInfo(p.event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &p.e.queued, NULL);
+                clGetEventProfilingInfo(p.event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &p.e.submit, NULL);
+                clGetEventProfilingInfo(p.event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &p.e.start, NULL);
+                clGetEventProfilingInfo(p.event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &p.e.end, NULL);
+                clReleaseEvent(p.event);
+                done.push_back(p.e);
+        }
+        events.clear();
+}
+
+void clProfiler::clear()
+{
+        for (pending &p : events)
+                clReleaseEvent(p.event);
+        events.clear();
+        done.clear();
+}
+
+void clProfiler::report(std::ostream &os)
+{
+        resolve();
+        if (done.empty())
+                return;
+
+        char line[256];
+        os << "Profile (us):" << std::endl;
+        snprintf(line, sizeof(line), "  %-6s %-24s %10s %10s %10s   %s", "Stage", "Command",
+                 "Queue>Sub", "Sub>Start", "Exec", "Rate");
+        os << line << std::endl;
+
+        double total[NUM_STAGES] = {0}, bytes[NUM_STAGES] = {0}, flops[NUM_STAGES] = {0};
+        for (const entry &e : done)
+        {
+                double queuedUs = (e.submit - e.queued) * 1e-3;
+                double submitUs = (e.start - e.submit) * 1e-3;
+                double execUs = (e.end - e.start) * 1e-3;
+                total[e.st] += execUs;
+                bytes[e.st] += e.bytes;
+                flops[e.st] += e.flops;
+
+                // bytes / us * 1e-3 = GB/s, flops / us * 1e-3 = GFLOP/s
+                char rate[64] = "";
+                if (execUs > 0 && e.flops > 0)
+                        snprintf(rate, sizeof(rate), "%.2f GFLOP/s, %.2f GB/s", e.flops / execUs * 1e-3, e.bytes / execUs * 1e-3);
+                else if (execUs > 0 && e.bytes > 0)
+                        snprintf(rate, sizeof(rate), "%.2f GB/s", e.bytes / execUs * 1e-3);
+
+                snprintf(line, sizeof(line), "  %-6s %-24s %10.1f %10.1f %10.1f   %s", stageName(e.st),
+                         e.label.c_str(), queuedUs, submitUs, execUs, rate);
+                os << line << std::endl;
+        }
+
+        for (int s = 0; s < NUM_STAGES; ++s)
+        {
+                if (total[s] == 0)
+                        continue;
+                snprintf(line, sizeof(line), "  Total %-6s %10.1f us", stageName((stage)s), total[s]);
+                os << line;
+                if (flops[s] > 0)
+                        os << "  " << flops[s] / total[s] * 1e-3 << " GFLOP/s";
+                if (bytes[s] > 0)
+                        os << "  " << bytes[s] / total[s] * 1e-3 << " GB/s";
+                os << std::endl;
+        }
+}
+
+bool clProfiler::writeChromeTrace(const std::string &path)
+{
+        resolve();
+        std::ofstream file(path);
+        if (!file.is_open())
+                return false;
+
+        cl_ulong origin = ~(cl_ulong)0;
+        for (const entry &e : done)
+                origin = std::min(origin, e.queued);
+
+        // One track per stage; the args keep the queue/submit latencies
+        file << "{\"traceEvents\":[" << std::endl;
+        for (size_t i = 0; i < done.size(); ++i)
+        {
+                const entry &e = done[i];
+                file << "  {\"name\":\"" << jsonEscape(e.label) << "\",\"cat\":\"" << stageName(e.st)
+                     << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << (int)e.st
+                     << ",\"ts\":" << (e.start - origin) * 1e-3
+                     << ",\"dur\":" << (e.end - e.start) * 1e-3
+                     << ",\"args\":{\"queued_us\":" << (e.submit - e.queued) * 1e-3
+                     << ",\"submit_us\":" << (e.start - e.submit) * 1e-3
+                     << ",\"bytes\":" << e.bytes << ",\"flops\":" << e.flops << "}}"
+                     << (i + 1 < done.size() ? "," : "") << std::endl;
+        }
+        file << "],\"displayTimeUnit\":\"ns\"}" << std::endl;
+        return (bool)file;
+}
@@ -0,0 +1,1201 @@
+#include "clSession.h"
+#include "clErrors.h"
+#include "programCache.h"
+#include "embeddedKernels.h"
+#include "clProfiler.h"
+#include "autoTuner.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <Eigen/Dense>
+
+#define STREAM_CHUNK (1 << 20) // default elements per chunk in vectorAddStreamed
+#define EW_GROUPS_PER_CU 8 // elementwise grid-stride launches: work-groups per compute unit
+#define EW_DEFAULT_GROUP 256 // work-group size assumed for the launch cap when the driver picks
+#define REDUCE_GROUP 256 // reductions: work-group size, and most partials the second pass takes
+#define SPMV_GROUP 128 // csr_spmv: work-group size, rows share it LANES work-items each
+#define SPMV_MAX_LANES 32
+#define MAX_SPECIALIZED_SHAPES 32 // GEMM shapes with a -D specialized variant per session
+#define MAX_COUNTED_SHAPES 1024 // use counts are dropped beyond this many distinct shapes
+#define MAX_GENERATED_KERNELS 64 // generated programs (deviceExpr) kept per session
+
+static std::string lower(std::string s)
+{
+        std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+        return s;
+}
+
+// GEMM shapes: no negative sizes, and every matrix addressable by the kernels' int indices
+static cl_int gemmShape(int M, int K, int N)
+{
+        if (M < 0 || K < 0 || N < 0)
+                return CL_INVALID_VALUE;
+        if ((size_t)M * K > INT_MAX || (size_t)K * N > INT_MAX || (size_t)M * N > INT_MAX)
+                return CL_INVALID_BUFFER_SIZE;
+        return CL_SUCCESS;
+}
+
+std::vector<cl_device_id> clSession::devices(cl_device_type type, const std::string &devName)
+{
+        std::vector<cl_device_id> found;
+        cl_uint n_platforms = 0;
+        if (clGetPlatformIDs(0, NULL, &n_platforms) != CL_SUCCESS || n_platforms == 0)
+                return found;
+
+        std::vector<cl_platform_id> platforms(n_platforms);
+        clGetPlatformIDs(n_platforms, platforms.data(), NULL);
+
+        for (cl_platform_id platform : platforms)
+        {
+                cl_uint deviceCount = 0;
+                if (clGetDeviceIDs(platform, type, 0, NULL, &deviceCount) != CL_SUCCESS || deviceCount == 0)
+                        continue;
+
+                std::vector<cl_device_id> ids(deviceCount);
+                clGetDeviceIDs(platform, type, deviceCount, ids.data(), NULL);
+
+                for (cl_device_id device : ids)
+                {
+                        char value[256] = {0};
+                        clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(value) - 1, value, NULL);
+                        if (devName.empty() || lower(value).find(lower(devName)) != std::string::npos)
+                                found.push_back(device);
+                }
+        }
+        return found;
+}
+
+clSession::clSession(cl_device_type type, const std::string &devName, unsigned nQueues)
+{
+        // First device of the requested type whose name matches
+        std::vector<cl_device_id> found = devices(type, devName);
+        if (found.empty())
+        {
+                err = CL_DEVICE_NOT_FOUND;
+                return;
+        }
+        init(found[0], nQueues);
+}
+
+clSession::clSession(cl_device_id device, unsigned nQueues)
+{
+        init(device, nQueues);
+}
+
+void clSession::init(cl_device_id device, unsigned nQueues)
+{
+        clDevice = device;
+        char value[256] = {0};
+        clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(value) - 1, value, NULL);
+        name = value;
+        clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(computeUnits), &computeUnits, NULL);
+        clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxGroupSize), &maxGroupSize, NULL);
+        if (getenv("CL_KERNEL_DIR"))
+                kernelDir = getenv("CL_KERNEL_DIR");
+        if (getenv("CL_SPECIALIZE"))
+                specializeUses = atoi(getenv("CL_SPECIALIZE"));
+
+        // Intel sub-groups work in OpenCL C 1.2, the Khronos ones need a 2.0 compiler
+        size_t size = 0;
+        clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &size);
+        std::string extensions(size, '\0');
+        clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, size, &extensions[0], NULL);
+        clGetDeviceInfo(device, CL_DEVICE_OPENCL_C_VERSION, sizeof(value) - 1, value, NULL);
+        if (extensions.find("cl_intel_subgroups") != std::string::npos)
+                subGroupOptions = "-DUSE_SUBGROUPS";
+        else if (extensions.find("cl_khr_subgroups") != std::string::npos && strncmp(value, "OpenCL C 2.", 11) == 0)
+                subGroupOptions = "-cl-std=CL2.0 -DUSE_SUBGROUPS";
+
+        clContext = clCreateContext(NULL, 1, &clDevice, NULL, NULL, &err);
+        if (err != CL_SUCCESS)
+                return;
+
+        pool = new bufferPool(clContext, clDevice);
+
+        for (unsigned i = 0; i < std::max(nQueues, 1u); ++i)
+        {
+                cl_command_queue queue = clCreateCommandQueue(clContext, clDevice, CL_QUEUE_PROFILING_ENABLE, &err);
+                if (err != CL_SUCCESS)
+                        return;
+                queues.push_back(queue);
+        }
+}
+
+clSession::~clSession()
+{
+        for (cl_command_queue queue : queues)
+                clFinish(queue);
+        for (auto &k : kernels)
+                clReleaseKernel(k.second);
+        for (auto &p : programs)
+                clReleaseProgram(p.second);
+        delete pool;
+        for (cl_command_queue queue : queues)
+                clReleaseCommandQueue(queue);
+        if (clContext)
+                clReleaseContext(clContext);
+}
+
+cl_device_type clSession::parseDeviceType(const char *type)
+{
+        if (!type)
+                return CL_DEVICE_TYPE_ALL;
+        std::string t = lower(type);
+        if (t == "cpu")
+                return CL_DEVICE_TYPE_CPU;
+        if (t == "gpu")
+                return CL_DEVICE_TYPE_GPU;
+        if (t == "accelerator")
+                return CL_DEVICE_TYPE_ACCELERATOR;
+        if (t == "default")
+                return CL_DEVICE_TYPE_DEFAULT;
+        return CL_DEVICE_TYPE_ALL;
+}
+
+clSession *clSession::fromEnv(unsigned nQueues)
+{
+        const char *devName = getenv("CL_DEVICE_NAME");
+        return new clSession(parseDeviceType(getenv("CL_DEVICE_TYPE")), devName ? devName : "", nQueues);
+}
+
+cl_program clSession::program(const std::string &file, const std::string &options)
+{
+        std::string key = file + '|' + options;
+        auto it = programs.find(key);
+        if (it != programs.end())
+                return it->second;
+
+        std::string source = kernelSource(file);
+        if (source.empty())
+        {
+                std::cerr << "Kernel source " << file << " not found" << std::endl;
+                return NULL;
+        }
+        cl_program clProgram = NULL;
+        cl_int ret = programCache::instance().build(clContext, clDevice, source, options.c_str(), clProgram);
+        if (ret != CL_SUCCESS)
+        {
+                char log[4096] = {0};
+                clGetProgramBuildInfo(clProgram, clDevice, CL_PROGRAM_BUILD_LOG, sizeof(log) - 1, log, NULL);
+                std::cerr << "Build " << file << ": " << getClErrorString(ret) << std::endl
+                          << log << std::endl;
+                if (clProgram)
+                        clReleaseProgram(clProgram);
+                return NULL;
+        }
+
+        programs[key] = clProgram;
+        return clProgram;
+}
+
+cl_kernel clSession::kernel(const std::string &file, const std::string &kernelName, const std::string &options)
+{
+        std::string key = file + '|' + options + '|' + kernelName;
+        auto it = kernels.find(key);
+        if (it != kernels.end())
+                return it->second;
+
+        cl_program clProgram = program(file, options);
+        if (!clProgram)
+                return NULL;
+
+        cl_int ret;
+        cl_kernel clKernel = clCreateKernel(clProgram, kernelName.c_str(), &ret);
+        if (ret != CL_SUCCESS)
+        {
+                std::cerr << "Kernel " << kernelName << ": " << getClErrorString(ret) << std::endl;
+                return NULL;
+        }
+
+        kernels[key] = clKernel;
+        return clKernel;
+}
+
+std::string clSession::kernelSource(const std::string &file) const
+{
+        if (kernelDir.empty())
+        {
+                for (const embeddedKernel *k = embeddedKernels; k->file; ++k)
+                        if (file == k->file)
+                                return k->source;
+                return "";
+        }
+        std::ifstream in(kernelDir + "/" + file);
+        std::stringstream source;
+        source << in.rdbuf();
+        return source.str();
+}
+
+cl_kernel clSession::generatedKernel(const std::string &key, const std::function<std::string()> &source,
+                                     const std::string &kernelName, const std::string &options)
+{
+        std::string programKey = "<generated>|" + key + '|' + options;
+        auto it = kernels.find(programKey);
+        if (it != kernels.end())
+        {
+                generatedOrder.splice(generatedOrder.begin(), generatedOrder,
+                                      std::find(generatedOrder.begin(), generatedOrder.end(), programKey));
+                return it->second;
+        }
+
+        // Through the binary cache as well, so a new process skips the compiler too
+        cl_program clProgram = NULL;
+        cl_int ret = programCache::instance().build(clContext, clDevice, source(), options.c_str(), clProgram);
+        if (ret != CL_SUCCESS)
+        {
+                char log[4096] = {0};
+                clGetProgramBuildInfo(clProgram, clDevice, CL_PROGRAM_BUILD_LOG, sizeof(log) - 1, log, NULL);
+                std::cerr << "Build " << key << ": " << getClErrorString(ret) << std::endl
+                          << log << std::endl;
+                if (clProgram)
+                        clReleaseProgram(clProgram);
+                return NULL;
+        }
+        cl_kernel clKernel = clCreateKernel(clProgram, kernelName.c_str(), &ret);
+        if (ret != CL_SUCCESS)
+        {
+                std::cerr << "Kernel " << kernelName << ": " << getClErrorString(ret) << std::endl;
+                clReleaseProgram(clProgram);
+                return NULL;
+        }
+
+        // Every distinct expression is a program of its own, so drop the least recently used
+        while (generatedOrder.size() >= MAX_GENERATED_KERNELS)
+        {
+                const std::string &oldest = generatedOrder.back();
+                clReleaseKernel(kernels[oldest]);
+                clReleaseProgram(programs[oldest]);
+                kernels.erase(oldest);
+                programs.erase(oldest);
+                generatedOrder.pop_back();
+        }
+        generatedOrder.push_front(programKey);
+        programs[programKey] = clProgram;
+        kernels[programKey] = clKernel;
+        return clKernel;
+}
+
+void clSession::track(cl_int ret, cl_event ev, cl_event *done, clProfiler::stage st, const std::string &label, double bytes, double flops)
+{
+        // The profiler takes ownership of its event, so the caller gets a reference of its own
+        if (done)
+        {
+                *done = ret == CL_SUCCESS ? ev : NULL;
+                if (prof && *done)
+                        clRetainEvent(ev);
+        }
+        if (prof)
+                prof->record(ev, st, label, bytes, flops);
+}
+
+unsigned clSession::addQueue(cl_command_queue_properties properties, cl_int *ret)
+{
+        // Properties the device does not support are dropped, e.g. out-of-order execution
+        cl_command_queue_properties supported = 0;
+        clGetDeviceInfo(clDevice, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, NULL);
+        properties = (properties & supported) | CL_QUEUE_PROFILING_ENABLE;
+        if (ret)
+                *ret = CL_SUCCESS;
+
+        // A released queue first, so sessions used by many short-lived asyncQueues stay small
+        for (auto it = freeQueues.begin(); it != freeQueues.end(); ++it)
+                if (queueProperties(*it) == properties)
+                {
+                        unsigned i = *it;
+                        freeQueues.erase(it);
+                        return i;
+                }
+
+        cl_int created;
+        cl_command_queue queue = clCreateCommandQueue(clContext, clDevice, properties, &created);
+        if (created != CL_SUCCESS)
+        {
+                if (ret)
+                        *ret = created;
+                return 0;
+        }
+        queues.push_back(queue);
+        return queues.size() - 1;
+}
+
+void clSession::releaseQueue(unsigned i)
+{
+        if (i >= queues.size() || std::find(freeQueues.begin(), freeQueues.end(), i) != freeQueues.end())
+                return;
+        clFinish(queues[i]);
+        freeQueues.push_back(i);
+}
+
+cl_command_queue_properties clSession::queueProperties(unsigned i) const
+{
+        cl_command_queue_properties properties = 0;
+        clGetCommandQueueInfo(queues[i], CL_QUEUE_PROPERTIES, sizeof(properties), &properties, NULL);
+        return properties;
+}
+
+cl_mem clSession::upload(const void *host, size_t bytes, const char *label, cl_int *ret)
+{
+        // Zero-copy: the device works on the host allocation directly, nothing is copied up front
+        if (zeroCopy)
+                return clCreateBuffer(clContext, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, bytes, (void *)host, ret);
+
+        cl_event ev = NULL;
+        cl_mem buffer = pool->acquire(bytes, CL_MEM_READ_ONLY, ret);
+        if (*ret == CL_SUCCESS)
+                *ret = clEnqueueWriteBuffer(queues[0], buffer, CL_FALSE, 0, bytes, host, 0, NULL, evt(ev));
+        if (prof)
+                prof->record(ev, clProfiler::HOST_TO_DEVICE, label, bytes);
+        return buffer;
+}
+
+cl_mem clSession::resultBuffer(void *host, size_t bytes, cl_int *ret)
+{
+        if (zeroCopy)
+                return clCreateBuffer(clContext, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, bytes, host, ret);
+        return pool->acquire(bytes, CL_MEM_WRITE_ONLY, ret);
+}
+
+cl_int clSession::download(cl_mem buffer, void *host, size_t bytes, const char *label)
+{
+        cl_int ret;
+        cl_event ev = NULL;
+        if (zeroCopy)
+        {
+                // Mapping is what makes the device writes visible in the host allocation;
+                // on devices sharing host memory it does not copy
+                void *ptr = clEnqueueMapBuffer(queues[0], buffer, CL_TRUE, CL_MAP_READ, 0, bytes, 0, NULL, evt(ev), &ret);
+                if (ret == CL_SUCCESS)
+                        ret = clEnqueueUnmapMemObject(queues[0], buffer, ptr, 0, NULL, NULL);
+        }
+        else
+        {
+                ret = clEnqueueReadBuffer(queues[0], buffer, CL_TRUE, 0, bytes, host, 0, NULL, evt(ev));
+        }
+        if (prof)
+                prof->record(ev, clProfiler::DEVICE_TO_HOST, label, bytes);
+        return ret;
+}
+
+void clSession::recycle(cl_mem buffer)
+{
+        if (!buffer)
+                return;
+        if (pool->owns(buffer))
+                pool->release(buffer);
+        else
+                clReleaseMemObject(buffer);
+}
+
+clSession::kernelConfig clSession::gemmConfig(int M, int K, int N)
+{
+        return tune ? tune->gemm(M, K, N) : kernelConfig();
+}
+
+clSession::kernelConfig clSession::elementwiseConfig(size_t n)
+{
+        return tune ? tune->elementwise(n) : kernelConfig();
+}
+
+int clSession::elementwiseInputs(elementwiseOp op)
+{
+        return op == EW_SCALE ? 1 : op == EW_FMA ? 3 : 2;
+}
+
+cl_int clSession::vectorAdd(cl_mem A, cl_mem B, cl_mem C, size_t n, unsigned queue)
+{
+        return elementwise(EW_ADD, C, A, B, NULL, 0.0f, n, queue);
+}
+
+cl_int clSession::elementwise(elementwiseOp op, cl_mem out, cl_mem X, cl_mem Y, cl_mem Z, float a, size_t n, unsigned queue,
+                              const std::vector<cl_event> &after, cl_event *done)
+{
+        return elementwiseStorage(op, out, X, Y, Z, a, n, elementwiseConfig(n), queue, false, after, done);
+}
+
+cl_int clSession::elementwise(elementwiseOp op, cl_mem out, cl_mem X, cl_mem Y, cl_mem Z, float a, size_t n,
+                              const kernelConfig &config, unsigned queue)
+{
+        return elementwiseStorage(op, out, X, Y, Z, a, n, config, queue, false, std::vector<cl_event>(), NULL);
+}
+
+cl_int clSession::elementwiseHalf(elementwiseOp op, cl_mem out, cl_mem X, cl_mem Y, cl_mem Z, float a, size_t n, unsigned queue)
+{
+        return elementwiseStorage(op, out, X, Y, Z, a, n, elementwiseConfig(n), queue, true, std::vector<cl_event>(), NULL);
+}
+
+cl_int clSession::elementwiseStorage(elementwiseOp op, cl_mem out, cl_mem X, cl_mem Y, cl_mem Z, float a, size_t n,
+                                     const kernelConfig &config, unsigned queue, bool half,
+                                     const std::vector<cl_event> &after, cl_event *done)
+{
+        static const char *names[] = {"ew_add", "ew_sub", "ew_mul", "ew_axpy", "ew_scale", "ew_fma"};
+        static const double flopsPerElement[] = {1, 1, 1, 2, 1, 2};
+
+        // The kernels count elements in int
+        if (n > INT_MAX)
+                return CL_INVALID_VALUE;
+
+        char buildOptions[48];
+        snprintf(buildOptions, sizeof(buildOptions), "-DVW=%d%s", config.width, half ? " -DHALF_STORAGE" : "");
+        cl_kernel clKernel = kernel("elementwise_kernel.cl", names[op], buildOptions);
+        if (!clKernel)
+                return CL_INVALID_KERNEL;
+
+        int elements = (int)n;
+        clSetKernelArg(clKernel, 0, sizeof(cl_mem), &X);
+        clSetKernelArg(clKernel, 1, sizeof(cl_mem), &Y);
+        clSetKernelArg(clKernel, 2, sizeof(cl_mem), &Z);
+        clSetKernelArg(clKernel, 3, sizeof(float), &a);
+        clSetKernelArg(clKernel, 4, sizeof(cl_mem), &out);
+        clSetKernelArg(clKernel, 5, sizeof(int), &elements);
+        size_t element = half ? sizeof(cl_half) : sizeof(float);
+        return launchElementwise(clKernel, n, config, queue, half ? names[op] + std::string(" fp16") : names[op],
+                                 (elementwiseInputs(op) + 1.0) * n * element, flopsPerElement[op] * n, after, done);
+}
+
+clSession::kernelConfig clSession::batchedConfig(int M, int N)
+{
+        // Small matrices get small tiles, so work-groups are not mostly padding:
+        // 4 x 4 tiles of one work-item per output up to 16 x 16 tiles of four
+        kernelConfig config;
+        config.tile = 4;
+        while (config.tile < 16 && config.tile < std::max(M, N))
+                config.tile *= 2;
+        config.wpt = config.tile / 4;
+        return config;
+}
+
+cl_int clSession::matrixMultBatched(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, int batch,
+                                    int strideA, int strideB, int strideC, unsigned queue)
+{
+        if (batch < 0 || M < 0 || K < 0 || N < 0)
+                return CL_INVALID_VALUE;
+        if (batch == 0 || M == 0 || N == 0)
+                return CL_SUCCESS;
+        // Packed strides are ints like the kernel's
+        if (gemmShape(M, K, N) != CL_SUCCESS)
+                return CL_INVALID_BUFFER_SIZE;
+        strideA = strideA ? strideA : M * K;
+        strideB = strideB ? strideB : K * N;
+        strideC = strideC ? strideC : M * N;
+
+        kernelConfig config = batchedConfig(M, N);
+        char buildOptions[64];
+        snprintf(buildOptions, sizeof(buildOptions), "-DTS=%d -DWPT=%d", config.tile, config.wpt);
+        cl_kernel clKernel = kernel("matrix_mult_kernel.cl", "matrixMultBatched", buildOptions);
+        if (!clKernel)
+                return CL_INVALID_KERNEL;
+
+        cl_event ev = NULL;
+        clSetKernelArg(clKernel, 0, sizeof(cl_mem), &A);
+        clSetKernelArg(clKernel, 1, sizeof(cl_mem), &B);
+        clSetKernelArg(clKernel, 2, sizeof(cl_mem), &C);
+        clSetKernelArg(clKernel, 3, sizeof(int), &M);
+        clSetKernelArg(clKernel, 4, sizeof(int), &K);
+        clSetKernelArg(clKernel, 5, sizeof(int), &N);
+        clSetKernelArg(clKernel, 6, sizeof(int), &strideA);
+        clSetKernelArg(clKernel, 7, sizeof(int), &strideB);
+        clSetKernelArg(clKernel, 8, sizeof(int), &strideC);
+
+        // matrixMultTiled's geometry for one matrix, repeated along the third dimension
+        size_t ts = config.tile;
+        size_t global_item_size[3] = {(N + ts - 1) / ts * ts, (M + ts - 1) / ts * ts / config.wpt, (size_t)batch};
+        size_t local_item_size[3] = {ts, ts / config.wpt, 1};
+        cl_int ret = clEnqueueNDRangeKernel(queues[queue], clKernel, 3, NULL, global_item_size, local_item_size, 0, NULL, evt(ev));
+        if (prof)
+                prof->record(ev, clProfiler::KERNEL, "matrixMultBatched",
+                             ((double)M * K + (double)K * N + (double)M * N) * batch * sizeof(float), 2.0 * M * N * K * batch);
+        return ret;
+}
+
+cl_int clSession::matrixMultBatched(cl_mem A, cl_mem B, cl_mem C, const std::vector<gemmBatchEntry> &batch, unsigned queue)
+{
+        if (batch.empty())
+                return CL_SUCCESS;
+
+        int maxM = 1, maxN = 1;
+        double bytes = 0, flops = 0;
+        for (const gemmBatchEntry &e : batch)
+        {
+                if (e.M < 0 || e.K < 0 || e.N < 0 || e.offsetA < 0 || e.offsetB < 0 || e.offsetC < 0)
+                        return CL_INVALID_VALUE;
+                maxM = std::max(maxM, e.M);
+                maxN = std::max(maxN, e.N);
+                bytes += ((double)e.M * e.K + (double)e.K * e.N + (double)e.M * e.N) * sizeof(float);
+                flops += 2.0 * e.M * e.N * e.K;
+        }
+
+        kernelConfig config = batchedConfig(maxM, maxN);
+        char buildOptions[64];
+        snprintf(buildOptions, sizeof(buildOptions), "-DTS=%d -DWPT=%d", config.tile, config.wpt);
+        cl_kernel clKernel = kernel("matrix_mult_kernel.cl", "matrixMultBatchedVar", buildOptions);
+        if (!clKernel)
+                return CL_INVALID_KERNEL;
+
+        // The entries travel with the launch; released right away, the runtime keeps the
+        // buffer alive until the kernel has run
+        cl_int ret;
+        cl_mem entries = clCreateBuffer(clContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, batch.size() * sizeof(gemmBatchEntry),
+                                        (void *)batch.data(), &ret);
+        if (ret != CL_SUCCESS)
+                return ret;
+
+        cl_event ev = NULL;
+        clSetKernelArg(clKernel, 0, sizeof(cl_mem), &A);
+        clSetKernelArg(clKernel, 1, sizeof(cl_mem), &B);
+        clSetKernelArg(clKernel, 2, sizeof(cl_mem), &C);
+        clSetKernelArg(clKernel, 3, sizeof(cl_mem), &entries);
+
+        size_t ts = config.tile;
+        size_t global_item_size[3] = {(maxN + ts - 1) / ts * ts, (maxM + ts - 1) / ts * ts / config.wpt, batch.size()};
+        size_t local_item_size[3] = {ts, ts / config.wpt, 1};
+        ret = clEnqueueNDRangeKernel(queues[queue], clKernel, 3, NULL, global_item_size, local_item_size, 0, NULL, evt(ev));
+        clReleaseMemObject(entries);
+        if (prof)
+                prof->record(ev, clProfiler::KERNEL, "matrixMultBatchedVar", bytes, flops);
+        return ret;
+}
+
+cl_int clSession::reduce(reduceOp op, cl_mem X, cl_mem Y, size_t n, float *result, unsigned queue)
+{
+        static const char *names[] = {"reduce_sum", "reduce_dot", "reduce_sumsq", "reduce_max", "reduce_max_abs", "reduce_max_abs_diff"};
+        static const int inputs[] = {1, 2, 1, 1, 1, 2};
+        bool maximum = op >= REDUCE_MAX;
+        if (n == 0)
+        {
+                *result = op == REDUCE_MAX ? -INFINITY : 0.0f;
+                return CL_SUCCESS;
+        }
+        // The kernels count elements in int
+        if (n > INT_MAX)
+                return CL_INVALID_VALUE;
+
+        cl_kernel first = kernel("reduce_kernel.cl", names[op], subGroupOptions);
+        cl_kernel second = kernel("reduce_kernel.cl", maximum ? "reduce_max" : "reduce_sum", subGroupOptions);
+        if (!first || !second)
+                return CL_INVALID_KERNEL;
+
+        // At most as many partials as the second pass has work-items
+        size_t group = std::min<size_t>(REDUCE_GROUP, maxGroupSize);
+        size_t groups = std::min<size_t>({(n + group - 1) / group, (size_t)computeUnits * EW_GROUPS_PER_CU, group});
+        cl_int ret;
+        cl_mem partial = pool->acquire(groups * sizeof(float), CL_MEM_READ_WRITE, &ret);
+        if (ret != CL_SUCCESS)
+                return ret;
+        cl_mem total = pool->acquire(sizeof(float), CL_MEM_READ_WRITE, &ret);
+        if (ret != CL_SUCCESS)
+        {
+                pool->release(partial);
+                return ret;
+        }
+
+        cl_event ev = NULL;
+        int elements = (int)n;
+        Y = Y ? Y : X;
+        clSetKernelArg(first, 0, sizeof(cl_mem), &X);
+        clSetKernelArg(first, 1, sizeof(cl_mem), &Y);
+        clSetKernelArg(first, 2, sizeof(cl_mem), &partial);
+        clSetKernelArg(first, 3, group * sizeof(float), NULL);
+        clSetKernelArg(first, 4, sizeof(int), &elements);
+        size_t global_item_size = groups * group;
+        ret = clEnqueueNDRangeKernel(queues[queue], first, 1, NULL, &global_item_size, &group, 0, NULL, evt(ev));
+        if (prof)
+                prof->record(ev, clProfiler::KERNEL, names[op], (double)inputs[op] * n * sizeof(float),
+                             (op == REDUCE_SUM || op == REDUCE_MAX ? 1.0 : 2.0) * n);
+
+        if (ret == CL_SUCCESS)
+        {
+                int partials = (int)groups;
+                clSetKernelArg(second, 0, sizeof(cl_mem), &partial);
+                clSetKernelArg(second, 1, sizeof(cl_mem), &partial);
+                clSetKernelArg(second, 2, sizeof(cl_mem), &total);
+                clSetKernelArg(second, 3, group * sizeof(float), NULL);
+                clSetKernelArg(second, 4, sizeof(int), &partials);
+                ret = clEnqueueNDRangeKernel(queues[queue], second, 1, NULL, &group, &group, 0, NULL, evt(ev));
+                if (prof)
+                        prof->record(ev, clProfiler::KERNEL, maximum ? "reduce_max" : "reduce_sum", groups * sizeof(float), groups);
+        }
+        if (ret == CL_SUCCESS)
+        {
+                ret = clEnqueueReadBuffer(queues[queue], total, CL_TRUE, 0, sizeof(float), result, 0, NULL, evt(ev));
+                if (prof)
+                        prof->record(ev, clProfiler::DEVICE_TO_HOST, "read result", sizeof(float));
+        }
+        else
+                clFinish(queues[queue]);
+        if (ret == CL_SUCCESS && op == REDUCE_NORM2)
+                *result = std::sqrt(*result);
+
+        pool->release(partial);
+        pool->release(total);
+        return ret;
+}
+
+cl_int clSession::csrMultiply(cl_mem rowPtr, cl_mem colIdx, cl_mem values, int M, size_t nnz, cl_mem B, cl_mem C, int N,
+                              unsigned queue)
+{
+        if (M <= 0 || N <= 0)
+                return CL_SUCCESS;
+
+        // Index and value arrays, gathered B elements, C
+        double bytes = (M + 1.0) * sizeof(int) + nnz * (sizeof(int) + sizeof(float)) + (double)nnz * N * sizeof(float) +
+                       (double)M * N * sizeof(float);
+        cl_event ev = NULL;
+        cl_int ret;
+        if (N == 1)
+        {
+                // A work-item per 4 entries of the mean row, up to a sub-group's worth
+                double mean = (double)nnz / M;
+                int lanes = 1;
+                while (lanes < SPMV_MAX_LANES && lanes * 4 <= mean && (size_t)lanes * 2 <= maxGroupSize)
+                        lanes *= 2;
+                size_t group = std::max<size_t>(lanes, std::min<size_t>(SPMV_GROUP, maxGroupSize) / lanes * lanes);
+
+                char buildOptions[32];
+                snprintf(buildOptions, sizeof(buildOptions), "-DLANES=%d", lanes);
+                cl_kernel clKernel = kernel("sparse_kernel.cl", "csr_spmv", buildOptions);
+                if (!clKernel)
+                        return CL_INVALID_KERNEL;
+                clSetKernelArg(clKernel, 0, sizeof(cl_mem), &rowPtr);
+                clSetKernelArg(clKernel, 1, sizeof(cl_mem), &colIdx);
+                clSetKernelArg(clKernel, 2, sizeof(cl_mem), &values);
+                clSetKernelArg(clKernel, 3, sizeof(cl_mem), &B);
+                clSetKernelArg(clKernel, 4, sizeof(cl_mem), &C);
+                clSetKernelArg(clKernel, 5, group * sizeof(float), NULL);
+                clSetKernelArg(clKernel, 6, sizeof(int), &M);
+                size_t global_item_size = ((size_t)M * lanes + group - 1) / group * group;
+                ret = clEnqueueNDRangeKernel(queues[queue], clKernel, 1, NULL, &global_item_size, &group, 0, NULL, evt(ev));
+        }
+        else
+        {
+                cl_kernel clKernel = kernel("sparse_kernel.cl", "csr_spmm");
+                if (!clKernel)
+                        return CL_INVALID_KERNEL;
+                clSetKernelArg(clKernel, 0, sizeof(cl_mem), &rowPtr);
+                clSetKernelArg(clKernel, 1, sizeof(cl_mem), &colIdx);
+                clSetKernelArg(clKernel, 2, sizeof(cl_mem), &values);
+                clSetKernelArg(clKernel, 3, sizeof(cl_mem), &B);
+                clSetKernelArg(clKernel, 4, sizeof(cl_mem), &C);
+                clSetKernelArg(clKernel, 5, sizeof(int), &M);
+                clSetKernelArg(clKernel, 6, sizeof(int), &N);
+                size_t global_item_size[2] = {(size_t)N, (size_t)M};
+                ret = clEnqueueNDRangeKernel(queues[queue], clKernel, 2, NULL, global_item_size, NULL, 0, NULL, evt(ev));
+        }
+        if (prof)
+                prof->record(ev, clProfiler::KERNEL, N == 1 ? "csr_spmv" : "csr_spmm", bytes, 2.0 * nnz * N);
+        return ret;
+}
+
+cl_int clSession::ellMultiply(cl_mem colIdx, cl_mem values, int M, int width, cl_mem B, cl_mem C, int N, unsigned queue)
+{
+        if (M <= 0 || N <= 0)
+                return CL_SUCCESS;
+
+        double entries = (double)M * width;
+        double bytes = entries * (sizeof(int) + sizeof(float)) + entries * N * sizeof(float) + (double)M * N * sizeof(float);
+        cl_kernel clKernel = kernel("sparse_kernel.cl", N == 1 ? "ell_spmv" : "ell_spmm");
+        if (!clKernel)
+                return CL_INVALID_KERNEL;
+
+        cl_event ev = NULL;
+        int arg = 0;
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &colIdx);
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &values);
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &B);
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &C);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &M);
+        if (N != 1)
+                clSetKernelArg(clKernel, arg++, sizeof(int), &N);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &width);
+        size_t global_item_size[2] = {N == 1 ? (size_t)M : (size_t)N, N == 1 ? 1 : (size_t)M};
+        cl_int ret = clEnqueueNDRangeKernel(queues[queue], clKernel, N == 1 ? 1 : 2, NULL, global_item_size, NULL, 0, NULL, evt(ev));
+        // Padding entries are multiplied as well and count in the flops
+        if (prof)
+                prof->record(ev, clProfiler::KERNEL, N == 1 ? "ell_spmv" : "ell_spmm", bytes, 2.0 * entries * N);
+        return ret;
+}
+
+cl_int clSession::relativeError(cl_mem X, cl_mem reference, size_t n, float *result, unsigned queue)
+{
+        float difference, scale;
+        cl_int ret = reduce(REDUCE_MAX_ABS_DIFF, X, reference, n, &difference, queue);
+        if (ret == CL_SUCCESS)
+                ret = reduce(REDUCE_MAX_ABS, reference, NULL, n, &scale, queue);
+        if (ret == CL_SUCCESS)
+                *result = scale > 0 ? difference / scale : difference;
+        return ret;
+}
+
+cl_int clSession::launchElementwise(cl_kernel clKernel, size_t n, const kernelConfig &config, unsigned queue,
+                                    const std::string &label, double bytes, double flops,
+                                    const std::vector<cl_event> &after, cl_event *done)
+{
+        // One work-item per vector, up to a few work-groups per compute unit; beyond that
+        // the grid-stride loop gives each work-item several vectors
+        cl_event ev = NULL;
+        size_t local_item_size = config.local;
+        size_t group = local_item_size ? local_item_size : EW_DEFAULT_GROUP;
+        size_t global_item_size = std::max<size_t>(1, (n + config.width - 1) / config.width);
+        global_item_size = std::min<size_t>(global_item_size, (size_t)computeUnits * EW_GROUPS_PER_CU * group);
+        if (local_item_size)
+                global_item_size = (global_item_size + local_item_size - 1) / local_item_size * local_item_size;
+        cl_int ret = clEnqueueNDRangeKernel(queues[queue], clKernel, 1, NULL, &global_item_size,
+                                            local_item_size ? &local_item_size : NULL, after.size(), after.empty() ? NULL : after.data(),
+                                            evt(ev, done));
+        track(ret, ev, done, clProfiler::KERNEL, label, bytes, flops);
+        return ret;
+}
+
+cl_int clSession::matrixMult(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, gemmKernel variant, unsigned queue,
+                             const std::vector<cl_event> &after, cl_event *done)
+{
+        kernelConfig config = variant == GEMM_NAIVE ? kernelConfig() : gemmConfig(M, K, N);
+        return matrixMultStorage(A, B, C, M, K, N, variant, config, queue, false, after, done);
+}
+
+cl_int clSession::matrixMult(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, gemmKernel variant, const kernelConfig &config, unsigned queue)
+{
+        return matrixMultStorage(A, B, C, M, K, N, variant, config, queue, false, std::vector<cl_event>(), NULL, false);
+}
+
+cl_int clSession::matrixMultHalf(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, gemmKernel variant, unsigned queue)
+{
+        return matrixMultStorage(A, B, C, M, K, N, variant, gemmConfig(M, K, N), queue, true, std::vector<cl_event>(), NULL);
+}
+
+cl_int clSession::matrixMultStorage(cl_mem A, cl_mem B, cl_mem C, int M, int K, int N, gemmKernel variant,
+                                    const kernelConfig &config, unsigned queue, bool half,
+                                    const std::vector<cl_event> &after, cl_event *done, bool specializable)
+{
+        cl_int shape = gemmShape(M, K, N);
+        if (shape != CL_SUCCESS || M == 0 || N == 0)
+        {
+                if (done)
+                        *done = NULL;
+                return shape;
+        }
+
+        // Keep the kernel tile configuration in sync with the launch geometry below
+        std::string buildOptions = gemmOptions(config, half);
+        const char *kernelName = variant == GEMM_NAIVE ? "matrixMult" : variant == GEMM_TILED_ACC ? "matrixMultTiledAcc" : "matrixMultTiled";
+        cl_kernel clKernel = variant == GEMM_NAIVE || !specializable ? kernel("matrix_mult_kernel.cl", kernelName, buildOptions)
+                                                                     : gemmKernelFor(kernelName, buildOptions, M, K, N);
+        if (!clKernel)
+                return CL_INVALID_KERNEL;
+
+        cl_int ret;
+        cl_event ev = NULL;
+        clSetKernelArg(clKernel, 0, sizeof(cl_mem), &A);
+        clSetKernelArg(clKernel, 1, sizeof(cl_mem), &B);
+        clSetKernelArg(clKernel, 2, sizeof(cl_mem), &C);
+
+        if (variant == GEMM_NAIVE)
+        {
+                // One work-item per element of C
+                clSetKernelArg(clKernel, 3, sizeof(int), &K);
+                clSetKernelArg(clKernel, 4, sizeof(int), &N);
+                size_t global_item_size[2] = {(size_t)N, (size_t)M};
+                ret = clEnqueueNDRangeKernel(queues[queue], clKernel, 2, NULL, global_item_size, NULL, after.size(),
+                                             after.empty() ? NULL : after.data(), evt(ev, done));
+        }
+        else
+        {
+                clSetKernelArg(clKernel, 3, sizeof(int), &M);
+                clSetKernelArg(clKernel, 4, sizeof(int), &K);
+                clSetKernelArg(clKernel, 5, sizeof(int), &N);
+
+                // One work-group per tile x tile block of C, rounded up to cover the edges
+                size_t ts = config.tile;
+                size_t tilesX = (N + ts - 1) / ts;
+                size_t tilesY = (M + ts - 1) / ts;
+                size_t global_item_size[2] = {tilesX * ts, tilesY * ts / config.wpt};
+                size_t local_item_size[2] = {ts, ts / config.wpt};
+                ret = clEnqueueNDRangeKernel(queues[queue], clKernel, 2, NULL, global_item_size, local_item_size, after.size(),
+                                             after.empty() ? NULL : after.data(), evt(ev, done));
+        }
+
+        track(ret, ev, done, clProfiler::KERNEL, half ? kernelName + std::string(" fp16") : kernelName,
+              ((double)M * K + (double)K * N + (double)M * N) * (half ? sizeof(cl_half) : sizeof(float)), 2.0 * M * N * K);
+        return ret;
+}
+
+cl_int clSession::matrixMultStrided(cl_mem A, int offA, int lda, cl_mem B, int offB, int ldb, cl_mem C, int offC, int ldc,
+                                    int M, int K, int N, bool accumulate, unsigned queue)
+{
+        kernelConfig config = gemmConfig(M, K, N);
+        cl_kernel clKernel = kernel("matrix_mult_kernel.cl", "matrixMultTiledStrided", gemmOptions(config, false));
+        if (!clKernel)
+                return CL_INVALID_KERNEL;
+
+        int acc = accumulate;
+        int arg = 0;
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &A);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &offA);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &lda);
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &B);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &offB);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &ldb);
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &C);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &offC);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &ldc);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &M);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &K);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &N);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &acc);
+
+        // matrixMultTiled's geometry
+        size_t ts = config.tile;
+        size_t global_item_size[2] = {(N + ts - 1) / ts * ts, (M + ts - 1) / ts * ts / config.wpt};
+        size_t local_item_size[2] = {ts, ts / config.wpt};
+        cl_event ev = NULL;
+        cl_int ret = clEnqueueNDRangeKernel(queues[queue], clKernel, 2, NULL, global_item_size, local_item_size, 0, NULL, evt(ev));
+        if (prof)
+                prof->record(ev, clProfiler::KERNEL, "matrixMultTiledStrided", ((double)M * K + (double)K * N + (double)M * N) * sizeof(float),
+                             2.0 * M * N * K);
+        return ret;
+}
+
+std::string clSession::gemmOptions(const kernelConfig &config, bool half)
+{
+        char options[64];
+        snprintf(options, sizeof(options), "-DTS=%d -DWPT=%d%s", config.tile, config.wpt, half ? " -DHALF_STORAGE" : "");
+        return options;
+}
+
+cl_kernel clSession::gemmKernelFor(const char *kernelName, const std::string &options, int M, int K, int N, bool force)
+{
+        char shape[64];
+        snprintf(shape, sizeof(shape), "%dx%dx%d", M, K, N);
+        auto it = specializedShapes.find(shape);
+        if (it == specializedShapes.end() && (force || (specializeUses && specializedShapes.size() < MAX_SPECIALIZED_SHAPES)))
+        {
+                // Counted until the shape has earned its variant
+                if (shapeUses.size() >= MAX_COUNTED_SHAPES && !shapeUses.count(shape))
+                        shapeUses.clear();
+                if (force || ++shapeUses[shape] >= specializeUses)
+                {
+                        shapeUses.erase(shape);
+                        it = specializedShapes.insert(std::make_pair(std::string(shape), true)).first;
+                }
+        }
+
+        if (it != specializedShapes.end() && it->second)
+        {
+                char shapeOptions[96];
+                snprintf(shapeOptions, sizeof(shapeOptions), " -DSHAPE_M=%d -DSHAPE_K=%d -DSHAPE_N=%d", M, K, N);
+                cl_kernel clKernel = kernel("matrix_mult_kernel.cl", kernelName, options + shapeOptions);
+                if (clKernel)
+                        return clKernel;
+                // Not tried again, the generic kernel does the work
+                it->second = false;
+        }
+        return kernel("matrix_mult_kernel.cl", kernelName, options);
+}
+
+cl_int clSession::specialize(int M, int K, int N, gemmKernel variant)
+{
+        if (variant == GEMM_NAIVE || M <= 0 || K <= 0 || N <= 0)
+                return CL_INVALID_VALUE;
+        const char *kernelName = variant == GEMM_TILED_ACC ? "matrixMultTiledAcc" : "matrixMultTiled";
+        if (!gemmKernelFor(kernelName, gemmOptions(gemmConfig(M, K, N), false), M, K, N, true))
+                return CL_INVALID_KERNEL;
+        return specialized(M, K, N) ? CL_SUCCESS : CL_BUILD_PROGRAM_FAILURE;
+}
+
+bool clSession::specialized(int M, int K, int N) const
+{
+        char shape[64];
+        snprintf(shape, sizeof(shape), "%dx%dx%d", M, K, N);
+        auto it = specializedShapes.find(shape);
+        return it != specializedShapes.end() && it->second;
+}
+
+cl_int clSession::vectorAdd(const float *A, const float *B, float *C, size_t n)
+{
+        cl_int ret;
+        size_t bytes = n * sizeof(float);
+        cl_mem a_mem_obj = upload(A, bytes, "write A", &ret);
+        cl_mem b_mem_obj = ret == CL_SUCCESS ? upload(B, bytes, "write B", &ret) : NULL;
+        cl_mem c_mem_obj = ret == CL_SUCCESS ? resultBuffer(C, bytes, &ret) : NULL;
+
+        if (ret == CL_SUCCESS)
+                ret = vectorAdd(a_mem_obj, b_mem_obj, c_mem_obj, n);
+        if (ret == CL_SUCCESS)
+                ret = download(c_mem_obj, C, bytes, "read C");
+
+        clFinish(queues[0]);
+        recycle(a_mem_obj);
+        recycle(b_mem_obj);
+        recycle(c_mem_obj);
+        return ret;
+}
+
+cl_int clSession::elementwise(elementwiseOp op, float *out, const float *X, const float *Y, const float *Z, float a, size_t n)
+{
+        cl_int ret = CL_SUCCESS;
+        size_t bytes = n * sizeof(float);
+        int inputs = elementwiseInputs(op);
+        cl_mem x = upload(X, bytes, "write X", &ret);
+        cl_mem y = ret == CL_SUCCESS && inputs > 1 ? upload(Y, bytes, "write Y", &ret) : NULL;
+        cl_mem z = ret == CL_SUCCESS && inputs > 2 ? upload(Z, bytes, "write Z", &ret) : NULL;
+        cl_mem o = ret == CL_SUCCESS ? resultBuffer(out, bytes, &ret) : NULL;
+
+        if (ret == CL_SUCCESS)
+                ret = elementwise(op, o, x, y, z, a, n);
+        if (ret == CL_SUCCESS)
+                ret = download(o, out, bytes, "read out");
+
+        clFinish(queues[0]);
+        recycle(x);
+        recycle(y);
+        recycle(z);
+        recycle(o);
+        return ret;
+}
+
+cl_int clSession::matrixMult(const float *A, const float *B, float *C, int M, int K, int N, gemmKernel variant)
+{
+        cl_int ret = gemmShape(M, K, N);
+        if (ret != CL_SUCCESS || M == 0 || N == 0)
+                return ret;
+        // Nothing to upload for an empty inner dimension: C = 0, or C += 0
+        if (K == 0)
+        {
+                if (variant != GEMM_TILED_ACC)
+                        std::fill(C, C + (size_t)M * N, 0.0f);
+                return CL_SUCCESS;
+        }
+
+        size_t bytesA = (size_t)M * K * sizeof(float);
+        size_t bytesB = (size_t)K * N * sizeof(float);
+        size_t bytesC = (size_t)M * N * sizeof(float);
+        cl_mem a_mem_obj = upload(A, bytesA, "write A", &ret);
+        cl_mem b_mem_obj = ret == CL_SUCCESS ? upload(B, bytesB, "write B", &ret) : NULL;
+        cl_mem c_mem_obj = ret == CL_SUCCESS ? resultBuffer(C, bytesC, &ret) : NULL;
+
+        if (ret == CL_SUCCESS)
+                ret = matrixMult(a_mem_obj, b_mem_obj, c_mem_obj, M, K, N, variant);
+        if (ret == CL_SUCCESS)
+                ret = download(c_mem_obj, C, bytesC, "read C");
+
+        clFinish(queues[0]);
+        recycle(a_mem_obj);
+        recycle(b_mem_obj);
+        recycle(c_mem_obj);
+        return ret;
+}
+
+// Host float <-> device half conversion, rounding to nearest even
+static std::vector<Eigen::half> toHalf(const float *host, size_t n)
+{
+        std::vector<Eigen::half> converted(n);
+        Eigen::Map<Eigen::Array<Eigen::half, Eigen::Dynamic, 1>>(converted.data(), n) = Eigen::Map<const Eigen::ArrayXf>(host, n).cast<Eigen::half>();
+        return converted;
+}
+
+static void fromHalf(const std::vector<Eigen::half> &converted, float *host)
+{
+        Eigen::Map<Eigen::ArrayXf>(host, converted.size()) = Eigen::Map<const Eigen::Array<Eigen::half, Eigen::Dynamic, 1>>(converted.data(), converted.size()).cast<float>();
+}
+
+cl_int clSession::elementwiseHalf(elementwiseOp op, float *out, const float *X, const float *Y, const float *Z, float a, size_t n)
+{
+        cl_int ret = CL_SUCCESS;
+        size_t bytes = n * sizeof(Eigen::half);
+        int inputs = elementwiseInputs(op);
+        std::vector<Eigen::half> x = toHalf(X, n), y = inputs > 1 ? toHalf(Y, n) : std::vector<Eigen::half>(),
+                                 z = inputs > 2 ? toHalf(Z, n) : std::vector<Eigen::half>(), o(n);
+        cl_mem xm = upload(x.data(), bytes, "write X fp16", &ret);
+        cl_mem ym = ret == CL_SUCCESS && inputs > 1 ? upload(y.data(), bytes, "write Y fp16", &ret) : NULL;
+        cl_mem zm = ret == CL_SUCCESS && inputs > 2 ? upload(z.data(), bytes, "write Z fp16", &ret) : NULL;
+        cl_mem om = ret == CL_SUCCESS ? resultBuffer(o.data(), bytes, &ret) : NULL;
+
+        if (ret == CL_SUCCESS)
+                ret = elementwiseHalf(op, om, xm, ym, zm, a, n);
+        if (ret == CL_SUCCESS)
+                ret = download(om, o.data(), bytes, "read out fp16");
+
+        clFinish(queues[0]);
+        recycle(xm);
+        recycle(ym);
+        recycle(zm);
+        recycle(om);
+        if (ret == CL_SUCCESS)
+                fromHalf(o, out);
+        return ret;
+}
+
+cl_int clSession::matrixMultHalf(const float *A, const float *B, float *C, int M, int K, int N, gemmKernel variant)
+{
+        cl_int ret = gemmShape(M, K, N);
+        if (ret != CL_SUCCESS || M == 0 || N == 0)
+                return ret;
+        if (K == 0)
+        {
+                if (variant != GEMM_TILED_ACC)
+                        std::fill(C, C + (size_t)M * N, 0.0f);
+                return CL_SUCCESS;
+        }
+
+        std::vector<Eigen::half> a = toHalf(A, (size_t)M * K), b = toHalf(B, (size_t)K * N), c((size_t)M * N);
+        cl_mem a_mem_obj = upload(a.data(), a.size() * sizeof(Eigen::half), "write A fp16", &ret);
+        cl_mem b_mem_obj = ret == CL_SUCCESS ? upload(b.data(), b.size() * sizeof(Eigen::half), "write B fp16", &ret) : NULL;
+        cl_mem c_mem_obj = ret == CL_SUCCESS ? resultBuffer(c.data(), c.size() * sizeof(Eigen::half), &ret) : NULL;
+
+        if (ret == CL_SUCCESS)
+                ret = matrixMultHalf(a_mem_obj, b_mem_obj, c_mem_obj, M, K, N, variant);
+        if (ret == CL_SUCCESS)
+                ret = download(c_mem_obj, c.data(), c.size() * sizeof(Eigen::half), "read C fp16");
+
+        clFinish(queues[0]);
+        recycle(a_mem_obj);
+        recycle(b_mem_obj);
+        recycle(c_mem_obj);
+        if (ret == CL_SUCCESS)
+                fromHalf(c, C);
+        return ret;
+}
+
+cl_int clSession::matrixMultBatched(const float *A, const float *B, float *C, int M, int K, int N, int batch)
+{
+        if (batch < 0 || M < 0 || K < 0 || N < 0)
+                return CL_INVALID_VALUE;
+        if (batch == 0 || M == 0 || N == 0)
+                return CL_SUCCESS;
+
+        // The whole batch moves in one transfer per operand
+        cl_int ret;
+        size_t bytesA = (size_t)M * K * batch * sizeof(float);
+        size_t bytesB = (size_t)K * N * batch * sizeof(float);
+        size_t bytesC = (size_t)M * N * batch * sizeof(float);
+        cl_mem a_mem_obj = upload(A, bytesA, "write A", &ret);
+        cl_mem b_mem_obj = ret == CL_SUCCESS ? upload(B, bytesB, "write B", &ret) : NULL;
+        cl_mem c_mem_obj = ret == CL_SUCCESS ? resultBuffer(C, bytesC, &ret) : NULL;
+
+        if (ret == CL_SUCCESS)
+                ret = matrixMultBatched(a_mem_obj, b_mem_obj, c_mem_obj, M, K, N, batch);
+        if (ret == CL_SUCCESS)
+                ret = download(c_mem_obj, C, bytesC, "read C");
+
+        clFinish(queues[0]);
+        recycle(a_mem_obj);
+        recycle(b_mem_obj);
+        recycle(c_mem_obj);
+        return ret;
+}
+
+cl_int clSession::matrixMultBatched(const float *const *A, const float *const *B, float *const *C,
+                                    const int *M, const int *K, const int *N, int batch)
+{
+        if (batch <= 0)
+                return CL_SUCCESS;
+
+        // Packed back to back on the host, so the device sees three buffers and one launch.
+        // The kernel addresses them with int offsets.
+        std::vector<gemmBatchEntry> entries(batch);
+        size_t sizeA = 0, sizeB = 0, sizeC = 0;
+        for (int b = 0; b < batch; ++b)
+        {
+                if (M[b] < 0 || K[b] < 0 || N[b] < 0)
+                        return CL_INVALID_VALUE;
+                entries[b] = {(int)sizeA, (int)sizeB, (int)sizeC, M[b], K[b], N[b]};
+                sizeA += (size_t)M[b] * K[b];
+                sizeB += (size_t)K[b] * N[b];
+                sizeC += (size_t)M[b] * N[b];
+                if (sizeA > INT_MAX || sizeB > INT_MAX || sizeC > INT_MAX)
+                        return CL_INVALID_BUFFER_SIZE;
+        }
+        if (sizeA == 0 || sizeB == 0 || sizeC == 0)
+                return CL_SUCCESS;
+        std::vector<float> packedA(sizeA), packedB(sizeB), packedC(sizeC);
+        for (int b = 0; b < batch; ++b)
+        {
+                std::copy(A[b], A[b] + (size_t)M[b] * K[b], packedA.begin() + entries[b].offsetA);
+                std::copy(B[b], B[b] + (size_t)K[b] * N[b], packedB.begin() + entries[b].offsetB);
+        }
+
+        cl_int ret;
+        cl_mem a_mem_obj = upload(packedA.data(), sizeA * sizeof(float), "write A", &ret);
+        cl_mem b_mem_obj = ret == CL_SUCCESS ? upload(packedB.data(), sizeB * sizeof(float), "write B", &ret) : NULL;
+        cl_mem c_mem_obj = ret == CL_SUCCESS ? resultBuffer(packedC.data(), sizeC * sizeof(float), &ret) : NULL;
+
+        if (ret == CL_SUCCESS)
+                ret = matrixMultBatched(a_mem_obj, b_mem_obj, c_mem_obj, entries);
+        if (ret == CL_SUCCESS)
+                ret = download(c_mem_obj, packedC.data(), sizeC * sizeof(float), "read C");
+
+        clFinish(queues[0]);
+        recycle(a_mem_obj);
+        recycle(b_mem_obj);
+        recycle(c_mem_obj);
+
+        if (ret == CL_SUCCESS)
+                for (int b = 0; b < batch; ++b)
+                        std::copy(packedC.begin() + entries[b].offsetC, packedC.begin() + entries[b].offsetC + (size_t)M[b] * N[b], C[b]);
+        return ret;
+}
+
+cl_int clSession::vectorAddStreamed(const float *A, const float *B, float *C, size_t n, size_t chunk)
+{
+        // A chunk buffer can be no larger than the pool serves in one buffer, which is
+        // the device's limit for one allocation
+        if (chunk == 0)
+                chunk = STREAM_CHUNK;
+        chunk = std::min<size_t>(chunk, pool->largestRequest() / sizeof(float));
+        chunk = std::max<size_t>(1, std::min(chunk, n));
+
+        // One set of A/B/C buffers per queue; a set is only reused by its own in-order
+        // queue, after the previous chunk on that queue has been read back
+        cl_int ret = CL_SUCCESS;
+        unsigned nSlots = queues.size();
+        std::vector<cl_mem> slots(3 * nSlots, (cl_mem)NULL);
+        size_t bytes = chunk * sizeof(float);
+        for (unsigned s = 0; s < nSlots && ret == CL_SUCCESS; ++s)
+        {
+                slots[3 * s] = pool->acquire(bytes, CL_MEM_READ_ONLY, &ret);
+                if (ret == CL_SUCCESS)
+                        slots[3 * s + 1] = pool->acquire(bytes, CL_MEM_READ_ONLY, &ret);
+                if (ret == CL_SUCCESS)
+                        slots[3 * s + 2] = pool->acquire(bytes, CL_MEM_WRITE_ONLY, &ret);
+        }
+
+        for (size_t offset = 0, i = 0; offset < n && ret == CL_SUCCESS; offset += chunk, ++i)
+        {
+                unsigned s = i % nSlots;
+                cl_command_queue q = queues[s];
+                size_t len = std::min(chunk, n - offset);
+                size_t len_bytes = len * sizeof(float);
+                cl_mem a = slots[3 * s], b = slots[3 * s + 1], c = slots[3 * s + 2];
+                cl_event ev[3] = {NULL, NULL, NULL};
+                std::string tag = " #" + std::to_string(i);
+
+                ret = clEnqueueWriteBuffer(q, a, CL_FALSE, 0, len_bytes, A + offset, 0, NULL, evt(ev[0]));
+                if (ret == CL_SUCCESS)
+                        ret = clEnqueueWriteBuffer(q, b, CL_FALSE, 0, len_bytes, B + offset, 0, NULL, evt(ev[1]));
+                if (ret == CL_SUCCESS)
+                        ret = vectorAdd(a, b, c, len, s);
+                if (ret == CL_SUCCESS)
+                        ret = clEnqueueReadBuffer(q, c, CL_FALSE, 0, len_bytes, C + offset, 0, NULL, evt(ev[2]));
+                if (prof)
+                {
+                        prof->record(ev[0], clProfiler::HOST_TO_DEVICE, "write A" + tag, len_bytes);
+                        prof->record(ev[1], clProfiler::HOST_TO_DEVICE, "write B" + tag, len_bytes);
+                        prof->record(ev[2], clProfiler::DEVICE_TO_HOST, "read C" + tag, len_bytes);
+                }
+
+                // Push work to the device now so queues progress concurrently
+                clFlush(q);
+        }
+
+        for (cl_command_queue q : queues)
+                clFinish(q);
+        for (cl_mem buffer : slots)
+                recycle(buffer);
+        return ret;
+}
@@ -0,0 +1,186 @@
+#include "deviceArray.h"
+#include "clProfiler.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+
+deviceExpr::deviceExpr(const deviceArray &array)
+{
+        node *n = new node();
+        n->k = node::ARRAY;
+        n->array = &array;
+        root.reset(n);
+}
+
+deviceExpr::deviceExpr(float value)
+{
+        node *n = new node();
+        n->k = node::SCALAR;
+        n->value = value;
+        root.reset(n);
+}
+
+deviceExpr::deviceExpr(node::kind k, const char *op, std::vector<std::shared_ptr<const node>> args)
+{
+        node *n = new node();
+        n->k = k;
+        n->op = op;
+        n->args = std::move(args);
+        root.reset(n);
+}
+
+deviceExpr operator-(const deviceExpr &a) { return deviceExpr(deviceExpr::node::OPERATOR, "-", {a.root}); }
+deviceExpr operator+(const deviceExpr &a, const deviceExpr &b) { return deviceExpr(deviceExpr::node::OPERATOR, "+", {a.root, b.root}); }
+deviceExpr operator-(const deviceExpr &a, const deviceExpr &b) { return deviceExpr(deviceExpr::node::OPERATOR, "-", {a.root, b.root}); }
+deviceExpr operator*(const deviceExpr &a, const deviceExpr &b) { return deviceExpr(deviceExpr::node::OPERATOR, "*", {a.root, b.root}); }
+deviceExpr operator/(const deviceExpr &a, const deviceExpr &b) { return deviceExpr(deviceExpr::node::OPERATOR, "/", {a.root, b.root}); }
+deviceExpr sqrt(const deviceExpr &a) { return deviceExpr(deviceExpr::node::CALL, "sqrt", {a.root}); }
+deviceExpr exp(const deviceExpr &a) { return deviceExpr(deviceExpr::node::CALL, "exp", {a.root}); }
+deviceExpr abs(const deviceExpr &a) { return deviceExpr(deviceExpr::node::CALL, "fabs", {a.root}); }
+deviceExpr min(const deviceExpr &a, const deviceExpr &b) { return deviceExpr(deviceExpr::node::CALL, "fmin", {a.root, b.root}); }
+deviceExpr max(const deviceExpr &a, const deviceExpr &b) { return deviceExpr(deviceExpr::node::CALL, "fmax", {a.root, b.root}); }
+deviceExpr fma(const deviceExpr &a, const deviceExpr &b, const deviceExpr &c) { return deviceExpr(deviceExpr::node::CALL, "fma", {a.root, b.root, c.root}); }
+
+void deviceExpr::emit(const node &n, program &p)
+{
+        switch (n.k)
+        {
+        case node::ARRAY:
+        {
+                // An array used several times is one operand, loaded once per element
+                size_t i = 0;
+                while (i < p.arrays.size() && p.arrays[i] != n.array)
+                        ++i;
+                if (i == p.arrays.size())
+                        p.arrays.push_back(n.array);
+                p.text += "L(x" + std::to_string(i) + ")";
+                break;
+        }
+        case node::SCALAR:
+                // Passed as an argument, so expressions differing only in constants share a kernel
+                p.text += "S(s" + std::to_string(p.scalars.size()) + ")";
+                p.scalars.push_back(n.value);
+                break;
+        case node::OPERATOR:
+                p.text += "(";
+                if (n.args.size() == 1)
+                        p.text += n.op;
+                emit(*n.args[0], p);
+                if (n.args.size() == 2)
+                {
+                        p.text += std::string(" ") + n.op + " ";
+                        emit(*n.args[1], p);
+                }
+                p.text += ")";
+                p.flops += 1;
+                break;
+        case node::CALL:
+                p.text += std::string(n.op) + "(";
+                for (size_t i = 0; i < n.args.size(); ++i)
+                {
+                        if (i)
+                                p.text += ", ";
+                        emit(*n.args[i], p);
+                }
+                p.text += ")";
+                p.flops += n.args.size() == 3 ? 2 : 1;
+                break;
+        }
+}
+
+void deviceExpr::compile(program &p) const
+{
+        emit(*root, p);
+        p.signature = std::to_string(p.arrays.size()) + "x " + std::to_string(p.scalars.size()) + "s " + p.text;
+}
+
+deviceArray::deviceArray(clSession &session, size_t n) : s(session), n(n)
+{
+        mem = s.buffers().acquire(std::max<size_t>(n, 1) * sizeof(float), CL_MEM_READ_WRITE, &err);
+}
+
+deviceArray::deviceArray(clSession &session, const float *host, size_t n) : deviceArray(session, n)
+{
+        if (err == CL_SUCCESS)
+                write(host);
+}
+
+deviceArray::~deviceArray()
+{
+        if (mem)
+        {
+                // Pending work on any of the session's queues (streaming, asyncQueue) may
+                // still use the buffer before it goes back to the pool
+                for (unsigned q = 0; q < s.numQueues(); ++q)
+                        clFinish(s.queue(q));
+                s.buffers().release(mem);
+        }
+}
+
+cl_int deviceArray::write(const float *host)
+{
+        cl_event ev = NULL;
+        err = clEnqueueWriteBuffer(s.queue(), mem, CL_TRUE, 0, n * sizeof(float), host, 0, NULL, s.profiler() ? &ev : NULL);
+        if (s.profiler())
+                s.profiler()->record(ev, clProfiler::HOST_TO_DEVICE, "write array", n * sizeof(float));
+        return err;
+}
+
+cl_int deviceArray::read(float *host)
+{
+        cl_event ev = NULL;
+        err = clEnqueueReadBuffer(s.queue(), mem, CL_TRUE, 0, n * sizeof(float), host, 0, NULL, s.profiler() ? &ev : NULL);
+        if (s.profiler())
+                s.profiler()->record(ev, clProfiler::DEVICE_TO_HOST, "read array", n * sizeof(float));
+        return err;
+}
+
+cl_int deviceArray::assign(const deviceExpr &e, unsigned queue)
+{
+        if (!mem)
+                return err;
+
+        deviceExpr::program p;
+        e.compile(p);
+        if (p.arrays.empty())
+                return err = CL_INVALID_VALUE; // no operand gives the element count
+        for (const deviceArray *a : p.arrays)
+        {
+                if (&a->s != &s)
+                        return err = CL_INVALID_CONTEXT;
+                if (a->n != n)
+                        return err = CL_INVALID_BUFFER_SIZE;
+        }
+        if (n == 0)
+                return err = CL_SUCCESS;
+        // The kernel counts elements in int
+        if (n > INT_MAX)
+                return err = CL_INVALID_VALUE;
+
+        clSession::kernelConfig config = s.elementwiseConfig(n);
+        char buildOptions[32];
+        snprintf(buildOptions, sizeof(buildOptions), "-DVW=%d", config.width);
+        cl_kernel clKernel = s.generatedKernel("expression " + p.signature, [&]() {
+                std::string args;
+                for (size_t i = 0; i < p.arrays.size(); ++i)
+                        args += "__global const float *x" + std::to_string(i) + ", ";
+                for (size_t i = 0; i < p.scalars.size(); ++i)
+                        args += "const float s" + std::to_string(i) + ", ";
+                return "#define EXPR_ARGS " + args + "\n#define EXPR(L, S) " + p.text + "\n" + s.kernelSource("expression_kernel.cl");
+        }, "expression", buildOptions);
+        if (!clKernel)
+                return err = CL_INVALID_KERNEL;
+
+        cl_uint arg = 0;
+        for (const deviceArray *a : p.arrays)
+                clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &a->mem);
+        for (float value : p.scalars)
+                clSetKernelArg(clKernel, arg++, sizeof(float), &value);
+        int elements = (int)n;
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &mem);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &elements);
+
+        return err = s.launchElementwise(clKernel, n, config, queue, "expression " + p.text,
+                                         (p.arrays.size() + 1.0) * n * sizeof(float), p.flops * n);
+}
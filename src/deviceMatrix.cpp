@@ -0,0 +1,104 @@
+#include "deviceMatrix.h"
+
+deviceMatrix::deviceMatrix(clSession &session, int rows, int cols)
+    : session(session), nRows(rows), nCols(cols), dev(session, (size_t)rows * cols)
+{
+        err = dev.error();
+}
+
+deviceMatrix::deviceMatrix(clSession &session, float *host, int rows, int cols)
+    : session(session), nRows(rows), nCols(cols), dev(session, (size_t)rows * cols), hostPtr(host)
+{
+        err = dev.error();
+        deviceValid = false;
+}
+
+float *deviceMatrix::hostStorage() const
+{
+        if (!hostPtr)
+        {
+                owned.resize(size());
+                hostPtr = owned.data();
+        }
+        return hostPtr;
+}
+
+cl_int deviceMatrix::syncHost() const
+{
+        if (hostValid)
+                return CL_SUCCESS;
+        // deviceArray::read is blocking, so pending kernels writing the device copy are done
+        err = dev.read(hostStorage());
+        if (err == CL_SUCCESS)
+        {
+                hostValid = true;
+                ++nDownloads;
+        }
+        return err;
+}
+
+cl_int deviceMatrix::syncDevice() const
+{
+        if (deviceValid)
+                return CL_SUCCESS;
+        err = dev.write(hostStorage());
+        if (err == CL_SUCCESS)
+        {
+                deviceValid = true;
+                ++nUploads;
+        }
+        return err;
+}
+
+Eigen::Map<const deviceMatrix::hostMatrix> deviceMatrix::host() const
+{
+        syncHost();
+        return Eigen::Map<const hostMatrix>(hostStorage(), nRows, nCols);
+}
+
+Eigen::Map<deviceMatrix::hostMatrix> deviceMatrix::hostWrite()
+{
+        syncHost();
+        deviceValid = false;
+        return Eigen::Map<hostMatrix>(hostStorage(), nRows, nCols);
+}
+
+Eigen::Map<deviceMatrix::hostMatrix> deviceMatrix::hostOverwrite()
+{
+        hostValid = true;
+        deviceValid = false;
+        return Eigen::Map<hostMatrix>(hostStorage(), nRows, nCols);
+}
+
+const deviceArray &deviceMatrix::device() const
+{
+        syncDevice();
+        return dev;
+}
+
+deviceArray &deviceMatrix::deviceWrite()
+{
+        hostValid = false;
+        deviceValid = true;
+        return dev;
+}
+
+cl_int deviceMatrix::product(const deviceMatrix &A, const deviceMatrix &B, clSession::gemmKernel variant)
+{
+        if (A.nCols != B.nRows || A.nRows != nRows || B.nCols != nCols)
+                return err = CL_INVALID_VALUE;
+        if ((err = A.syncDevice()) != CL_SUCCESS || (err = B.syncDevice()) != CL_SUCCESS)
+                return err;
+        if (variant == clSession::GEMM_TILED_ACC && syncDevice() != CL_SUCCESS)
+                return err;
+
+        err = session.matrixMult(A.dev.buffer(), B.dev.buffer(), deviceWrite().buffer(), nRows, A.nCols, nCols, variant);
+        return err;
+}
+
+deviceMatrix &deviceMatrix::operator=(const deviceExpr &e)
+{
+        // Operands were synced by device() when the expression was built
+        err = deviceWrite().assign(e);
+        return *this;
+}
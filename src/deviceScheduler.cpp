@@ -0,0 +1,305 @@
+#include "deviceScheduler.h"
+#include "clErrors.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#define CHUNKS_PER_DEVICE 8 // default chunking, leaves work to steal near the end
+#define MIN_VECTOR_CHUNK (1 << 16)
+#define ROW_ALIGN 16 // matrixMult chunks are whole GEMM tiles of rows
+
+struct vectorArgs
+{
+        const float *A, *B;
+        float *C;
+        size_t n, chunk;
+};
+
+struct matrixArgs
+{
+        const float *A, *B;
+        float *C;
+        int M, K, N;
+        size_t chunk;
+};
+
+static double seconds(std::chrono::high_resolution_clock::time_point since)
+{
+        return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - since).count();
+}
+
+deviceScheduler::deviceScheduler(cl_device_type type, const std::string &name)
+{
+        for (cl_device_id device : clSession::devices(type, name))
+        {
+                clSession *session = new clSession(device);
+                if (session->error() == CL_SUCCESS)
+                        sessions.push_back(session);
+                else
+                        delete session;
+        }
+
+        // Equal shares until calibrated
+        for (int o = 0; o < NUM_OPS; ++o)
+                share[o].assign(sessions.size(), sessions.empty() ? 0.0 : 1.0 / sessions.size());
+}
+
+deviceScheduler::~deviceScheduler()
+{
+        for (clSession *session : sessions)
+                delete session;
+}
+
+deviceScheduler *deviceScheduler::fromEnv()
+{
+        const char *devName = getenv("CL_DEVICE_NAME");
+        return new deviceScheduler(clSession::parseDeviceType(getenv("CL_DEVICE_TYPE")), devName ? devName : "");
+}
+
+cl_int deviceScheduler::calibrate(size_t vecElements, int matSize)
+{
+        std::vector<float> A(std::max(vecElements, (size_t)matSize * matSize), 1.0f);
+        std::vector<float> B(A.size(), 2.0f), C(A.size());
+        std::vector<double> rate[NUM_OPS];
+
+        // One device at a time so the measurements do not disturb each other.
+        // The first call of each operation builds the kernels and is not timed.
+        // A device that fails is dropped, the others still share the work.
+        std::vector<clSession *> healthy;
+        cl_int failure = CL_SUCCESS;
+        for (clSession *session : sessions)
+        {
+                cl_int ret = session->vectorAdd(A.data(), B.data(), C.data(), vecElements);
+                auto start = std::chrono::high_resolution_clock::now();
+                if (ret == CL_SUCCESS)
+                        ret = session->vectorAdd(A.data(), B.data(), C.data(), vecElements);
+                rate[VECTOR_ADD].push_back(vecElements / seconds(start));
+
+                if (ret == CL_SUCCESS)
+                        ret = session->matrixMult(A.data(), B.data(), C.data(), matSize, matSize, matSize);
+                start = std::chrono::high_resolution_clock::now();
+                if (ret == CL_SUCCESS)
+                        ret = session->matrixMult(A.data(), B.data(), C.data(), matSize, matSize, matSize);
+                rate[MATRIX_MULT].push_back(2.0 * matSize * matSize * matSize / seconds(start));
+
+                if (ret != CL_SUCCESS)
+                {
+                        std::cerr << "Calibrating " << session->deviceName() << ": " << getClErrorString(ret) << ", device dropped" << std::endl;
+                        rate[VECTOR_ADD].pop_back();
+                        rate[MATRIX_MULT].pop_back();
+                        failure = ret;
+                        delete session;
+                        continue;
+                }
+                healthy.push_back(session);
+        }
+        sessions = healthy;
+        if (sessions.empty())
+                return failure;
+
+        for (int o = 0; o < NUM_OPS; ++o)
+        {
+                double total = 0;
+                for (double r : rate[o])
+                        total += r;
+                share[o].assign(sessions.size(), 0.0);
+                for (size_t i = 0; i < sessions.size(); ++i)
+                        share[o][i] = rate[o][i] / total;
+        }
+        calibrated = true;
+        return CL_SUCCESS;
+}
+
+void deviceScheduler::partition(op o, size_t nChunks)
+{
+        // Contiguous runs of chunks proportional to the shares
+        next.assign(sessions.size(), 0);
+        end.assign(sessions.size(), 0);
+        double cumulative = 0;
+        size_t begin = 0;
+        for (size_t i = 0; i < sessions.size(); ++i)
+        {
+                cumulative += share[o][i];
+                size_t stop = i + 1 == sessions.size() ? nChunks : std::min(nChunks, (size_t)(cumulative * nChunks + 0.5));
+                next[i] = begin;
+                end[i] = std::max(begin, stop);
+                begin = end[i];
+        }
+}
+
+bool deviceScheduler::take(size_t device, size_t &chunk)
+{
+        std::lock_guard<std::mutex> lock(mutex);
+        if (status != CL_SUCCESS)
+                return false;
+
+        if (next[device] < end[device])
+        {
+                chunk = next[device]++;
+                return true;
+        }
+
+        // Steal from the back of the device with the most time left on its chunks
+        size_t victim = sessions.size();
+        double mostLeft = 0;
+        for (size_t i = 0; i < sessions.size(); ++i)
+        {
+                double left = (end[i] - next[i]) / std::max(share[last][i], 1e-9);
+                if (end[i] > next[i] && left > mostLeft)
+                {
+                        mostLeft = left;
+                        victim = i;
+                }
+        }
+        if (victim == sessions.size())
+                return false;
+
+        chunk = --end[victim];
+        st[device].stolen++;
+        return true;
+}
+
+void deviceScheduler::fail(cl_int ret)
+{
+        std::lock_guard<std::mutex> lock(mutex);
+        if (status == CL_SUCCESS)
+                status = ret;
+}
+
+cl_int deviceScheduler::run(op o, size_t nChunks, cl_int (deviceScheduler::*worker)(size_t, const void *), const void *args)
+{
+        if (sessions.empty())
+                return CL_DEVICE_NOT_FOUND;
+        if (!calibrated)
+        {
+                cl_int ret = calibrate();
+                if (ret != CL_SUCCESS)
+                        return ret;
+        }
+
+        last = o;
+        status = CL_SUCCESS;
+        st.assign(sessions.size(), deviceStats());
+        partition(o, nChunks);
+
+        // Each session is only touched by its own thread
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < sessions.size(); ++i)
+                threads.emplace_back([=]() {
+                        cl_int ret = (this->*worker)(i, args);
+                        if (ret != CL_SUCCESS)
+                                fail(ret);
+                });
+        for (std::thread &t : threads)
+                t.join();
+        return status;
+}
+
+cl_int deviceScheduler::vectorAddWorker(size_t device, const void *args)
+{
+        const vectorArgs &a = *(const vectorArgs *)args;
+        clSession &session = *sessions[device];
+        size_t chunk;
+        while (take(device, chunk))
+        {
+                auto start = std::chrono::high_resolution_clock::now();
+                size_t offset = chunk * a.chunk, len = std::min(a.chunk, a.n - offset);
+                cl_int ret = session.vectorAdd(a.A + offset, a.B + offset, a.C + offset, len);
+                if (ret != CL_SUCCESS)
+                        return ret;
+                st[device].chunks++;
+                st[device].units += len;
+                st[device].seconds += seconds(start);
+        }
+        return CL_SUCCESS;
+}
+
+cl_int deviceScheduler::matrixMultWorker(size_t device, const void *args)
+{
+        const matrixArgs &a = *(const matrixArgs *)args;
+        clSession &session = *sessions[device];
+        bufferPool &pool = session.buffers();
+        cl_command_queue queue = session.queue();
+        size_t bytesB = (size_t)a.K * a.N * sizeof(float);
+
+        // B is needed whole by every chunk: uploaded once, on the first chunk this device gets
+        cl_int ret = CL_SUCCESS;
+        cl_mem b = NULL, aRows = NULL, cRows = NULL;
+        size_t chunk;
+        while (ret == CL_SUCCESS && take(device, chunk))
+        {
+                auto start = std::chrono::high_resolution_clock::now();
+                if (!b)
+                {
+                        b = pool.acquire(bytesB, CL_MEM_READ_ONLY, &ret);
+                        if (ret == CL_SUCCESS)
+                                ret = clEnqueueWriteBuffer(queue, b, CL_FALSE, 0, bytesB, a.B, 0, NULL, NULL);
+                        if (ret == CL_SUCCESS)
+                                aRows = pool.acquire(a.chunk * a.K * sizeof(float), CL_MEM_READ_ONLY, &ret);
+                        if (ret == CL_SUCCESS)
+                                cRows = pool.acquire(a.chunk * a.N * sizeof(float), CL_MEM_WRITE_ONLY, &ret);
+                        if (ret != CL_SUCCESS)
+                                break;
+                }
+
+                size_t row = chunk * a.chunk, rows = std::min(a.chunk, (size_t)a.M - row);
+                ret = clEnqueueWriteBuffer(queue, aRows, CL_FALSE, 0, rows * a.K * sizeof(float), a.A + row * a.K, 0, NULL, NULL);
+                if (ret == CL_SUCCESS)
+                        ret = session.matrixMult(aRows, b, cRows, rows, a.K, a.N);
+                if (ret == CL_SUCCESS)
+                        ret = clEnqueueReadBuffer(queue, cRows, CL_TRUE, 0, rows * a.N * sizeof(float), a.C + row * a.N, 0, NULL, NULL);
+                if (ret != CL_SUCCESS)
+                        break;
+
+                st[device].chunks++;
+                st[device].units += rows;
+                st[device].seconds += seconds(start);
+        }
+
+        clFinish(queue);
+        for (cl_mem buffer : {b, aRows, cRows})
+                if (buffer)
+                        pool.release(buffer);
+        return ret;
+}
+
+cl_int deviceScheduler::vectorAdd(const float *A, const float *B, float *C, size_t n, size_t chunk)
+{
+        if (n == 0)
+                return CL_SUCCESS;
+        if (chunk == 0)
+                chunk = std::max<size_t>(MIN_VECTOR_CHUNK, (n + CHUNKS_PER_DEVICE * size() - 1) / std::max<size_t>(1, CHUNKS_PER_DEVICE * size()));
+        vectorArgs args = {A, B, C, n, chunk};
+        return run(VECTOR_ADD, (n + chunk - 1) / chunk, &deviceScheduler::vectorAddWorker, &args);
+}
+
+cl_int deviceScheduler::matrixMult(const float *A, const float *B, float *C, int M, int K, int N, size_t chunk)
+{
+        if (M <= 0 || N <= 0)
+                return CL_SUCCESS;
+        if (chunk == 0)
+        {
+                chunk = (M + CHUNKS_PER_DEVICE * size() - 1) / std::max<size_t>(1, CHUNKS_PER_DEVICE * size());
+                chunk = (chunk + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+        }
+        matrixArgs args = {A, B, C, M, K, N, chunk};
+        return run(MATRIX_MULT, (M + chunk - 1) / chunk, &deviceScheduler::matrixMultWorker, &args);
+}
+
+void deviceScheduler::report(std::ostream &os) const
+{
+        os << "Device Scheduler (" << (last == VECTOR_ADD ? "vector_add" : "matrixMult") << ", "
+           << (calibrated ? "calibrated" : "equal") << " shares):" << std::endl;
+        char line[256];
+        snprintf(line, sizeof(line), "  %-32s %7s %7s %7s %12s %10s", "Device", "Share", "Chunks", "Stolen", "Units", "Busy (ms)");
+        os << line << std::endl;
+        for (size_t i = 0; i < sessions.size() && i < st.size(); ++i)
+        {
+                snprintf(line, sizeof(line), "  %-32.32s %6.1f%% %7zu %7zu %12zu %10.2f", sessions[i]->deviceName().c_str(),
+                         100.0 * share[last][i], st[i].chunks, st[i].stolen, st[i].units, st[i].seconds * 1e3);
+                os << line << std::endl;
+        }
+}
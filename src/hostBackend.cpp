@@ -0,0 +1,326 @@
+#include "hostBackend.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define HOST_X86
+#include <immintrin.h>
+#endif
+
+#define EW_GRAIN (1 << 14)   // elementwise: fewest elements per task
+#define EW_TASKS_PER_THREAD 4
+#define GEMM_MC 64           // GEMM: rows of a C tile (one task)
+#define GEMM_NC 256          // columns of a C tile, a multiple of every vector width x 2
+#define GEMM_KC 256          // depth of the A and B panels a tile is accumulated over
+
+// Scalar elementwise loop over [begin, end), also the tail of the vector loops
+static void elementwiseScalar(clSession::elementwiseOp op, float *out, const float *X, const float *Y, const float *Z, float a,
+                              size_t begin, size_t end)
+{
+        switch (op)
+        {
+        case clSession::EW_ADD: for (size_t i = begin; i < end; ++i) out[i] = X[i] + Y[i]; break;
+        case clSession::EW_SUB: for (size_t i = begin; i < end; ++i) out[i] = X[i] - Y[i]; break;
+        case clSession::EW_MUL: for (size_t i = begin; i < end; ++i) out[i] = X[i] * Y[i]; break;
+        case clSession::EW_AXPY: for (size_t i = begin; i < end; ++i) out[i] = a * X[i] + Y[i]; break;
+        case clSession::EW_SCALE: for (size_t i = begin; i < end; ++i) out[i] = a * X[i]; break;
+        case clSession::EW_FMA: for (size_t i = begin; i < end; ++i) out[i] = X[i] * Y[i] + Z[i]; break;
+        }
+}
+
+// C[i0, i1) x [j0, j1) += A[i0, i1) x [k0, k1) * B[k0, k1) x [j0, j1), row major
+static void gemmTileScalar(const float *A, const float *B, float *C, int K, int N, int i0, int i1, int j0, int j1, int k0, int k1)
+{
+        for (int i = i0; i < i1; ++i)
+                for (int k = k0; k < k1; ++k)
+                {
+                        float a = A[(size_t)i * K + k];
+                        for (int j = j0; j < j1; ++j)
+                                C[(size_t)i * N + j] += a * B[(size_t)k * N + j];
+                }
+}
+
+#ifdef HOST_X86
+
+// The same two loops for a W-float vector type. The GEMM micro-kernel keeps a 4 x 2W
+// block of C in eight registers over the whole k panel: per k it loads two vectors of
+// B and broadcasts four elements of A. Edges not covering a full block are scalar.
+#define HOST_KERNELS(SUFFIX, TARGET, W, VEC, LOAD, STORE, SET1, ADD, SUB, MUL, FMADD, ZERO)                           \
+        __attribute__((target(TARGET))) static void elementwise##SUFFIX(clSession::elementwiseOp op, float *out,         \
+                                                                         const float *X, const float *Y,                 \
+                                                                         const float *Z, float a, size_t begin,          \
+                                                                         size_t end)                                     \
+        {                                                                                                               \
+                size_t i = begin;                                                                                       \
+                VEC va = SET1(a);                                                                                       \
+                switch (op)                                                                                             \
+                {                                                                                                       \
+                case clSession::EW_ADD:                                                                                 \
+                        for (; i + W <= end; i += W)                                                                    \
+                                STORE(out + i, ADD(LOAD(X + i), LOAD(Y + i)));                                          \
+                        break;                                                                                          \
+                case clSession::EW_SUB:                                                                                 \
+                        for (; i + W <= end; i += W)                                                                    \
+                                STORE(out + i, SUB(LOAD(X + i), LOAD(Y + i)));                                          \
+                        break;                                                                                          \
+                case clSession::EW_MUL:                                                                                 \
+                        for (; i + W <= end; i += W)                                                                    \
+                                STORE(out + i, MUL(LOAD(X + i), LOAD(Y + i)));                                          \
+                        break;                                                                                          \
+                case clSession::EW_AXPY:                                                                                \
+                        for (; i + W <= end; i += W)                                                                    \
+                                STORE(out + i, FMADD(va, LOAD(X + i), LOAD(Y + i)));                                    \
+                        break;                                                                                          \
+                case clSession::EW_SCALE:                                                                               \
+                        for (; i + W <= end; i += W)                                                                    \
+                                STORE(out + i, MUL(va, LOAD(X + i)));                                                   \
+                        break;                                                                                          \
+                case clSession::EW_FMA:                                                                                 \
+                        for (; i + W <= end; i += W)                                                                    \
+                                STORE(out + i, FMADD(LOAD(X + i), LOAD(Y + i), LOAD(Z + i)));                           \
+                        break;                                                                                          \
+                }                                                                                                       \
+                elementwiseScalar(op, out, X, Y, Z, a, i, end);                                                         \
+        }                                                                                                               \
+                                                                                                                        \
+        __attribute__((target(TARGET))) static void gemmTile##SUFFIX(const float *A, const float *B, float *C, int K,    \
+                                                                      int N, int i0, int i1, int j0, int j1, int k0,     \
+                                                                      int k1)                                            \
+        {                                                                                                               \
+                int i = i0;                                                                                             \
+                for (; i + 4 <= i1; i += 4)                                                                             \
+                {                                                                                                       \
+                        int j = j0;                                                                                     \
+                        for (; j + 2 * W <= j1; j += 2 * W)                                                             \
+                        {                                                                                               \
+                                VEC c00 = ZERO(), c01 = ZERO(), c10 = ZERO(), c11 = ZERO();                             \
+                                VEC c20 = ZERO(), c21 = ZERO(), c30 = ZERO(), c31 = ZERO();                             \
+                                const float *a = A + (size_t)i * K;                                                     \
+                                for (int k = k0; k < k1; ++k)                                                           \
+                                {                                                                                       \
+                                        const float *b = B + (size_t)k * N + j;                                         \
+                                        VEC b0 = LOAD(b), b1 = LOAD(b + W);                                             \
+                                        VEC a0 = SET1(a[k]), a1 = SET1(a[K + k]);                                       \
+                                        VEC a2 = SET1(a[2 * (size_t)K + k]), a3 = SET1(a[3 * (size_t)K + k]);           \
+                                        c00 = FMADD(a0, b0, c00);                                                       \
+                                        c01 = FMADD(a0, b1, c01);                                                       \
+                                        c10 = FMADD(a1, b0, c10);                                                       \
+                                        c11 = FMADD(a1, b1, c11);                                                       \
+                                        c20 = FMADD(a2, b0, c20);                                                       \
+                                        c21 = FMADD(a2, b1, c21);                                                       \
+                                        c30 = FMADD(a3, b0, c30);                                                       \
+                                        c31 = FMADD(a3, b1, c31);                                                       \
+                                }                                                                                       \
+                                float *c = C + (size_t)i * N + j;                                                       \
+                                STORE(c, ADD(LOAD(c), c00));                                                            \
+                                STORE(c + W, ADD(LOAD(c + W), c01));                                                    \
+                                STORE(c + N, ADD(LOAD(c + N), c10));                                                    \
+                                STORE(c + N + W, ADD(LOAD(c + N + W), c11));                                            \
+                                STORE(c + 2 * (size_t)N, ADD(LOAD(c + 2 * (size_t)N), c20));                            \
+                                STORE(c + 2 * (size_t)N + W, ADD(LOAD(c + 2 * (size_t)N + W), c21));                    \
+                                STORE(c + 3 * (size_t)N, ADD(LOAD(c + 3 * (size_t)N), c30));                            \
+                                STORE(c + 3 * (size_t)N + W, ADD(LOAD(c + 3 * (size_t)N + W), c31));                    \
+                        }                                                                                               \
+                        gemmTileScalar(A, B, C, K, N, i, i + 4, j, j1, k0, k1);                                         \
+                }                                                                                                       \
+                gemmTileScalar(A, B, C, K, N, i, i1, j0, j1, k0, k1);                                                   \
+        }
+
+HOST_KERNELS(Avx2, "avx2,fma", 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_add_ps, _mm256_sub_ps,
+             _mm256_mul_ps, _mm256_fmadd_ps, _mm256_setzero_ps)
+HOST_KERNELS(Avx512, "avx512f", 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_add_ps, _mm512_sub_ps,
+             _mm512_mul_ps, _mm512_fmadd_ps, _mm512_setzero_ps)
+
+#endif
+
+hostBackend::hostBackend(unsigned threads)
+{
+        level = detect();
+        if (threads == 0)
+                threads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 1; i < threads; ++i)
+                workers.emplace_back(&hostBackend::work, this);
+}
+
+hostBackend::~hostBackend()
+{
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &t : workers)
+                t.join();
+}
+
+hostBackend::isa hostBackend::detect()
+{
+        isa best = SCALAR;
+#ifdef HOST_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+                best = AVX512;
+        else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+                best = AVX2;
+#endif
+        const char *cap = getenv("CL_HOST_ISA");
+        if (cap && strcmp(cap, "scalar") == 0)
+                best = SCALAR;
+        else if (cap && strcmp(cap, "avx2") == 0)
+                best = std::min(best, AVX2);
+        return best;
+}
+
+const char *hostBackend::isaName(isa i)
+{
+        static const char *names[] = {"scalar", "avx2", "avx512"};
+        return names[i];
+}
+
+void hostBackend::setInstructions(isa i)
+{
+        level = std::min(i, detect());
+}
+
+std::string hostBackend::description() const
+{
+        return std::string(isaName(level)) + " x " + std::to_string(threads()) + (threads() == 1 ? " thread" : " threads");
+}
+
+bool hostBackend::take(size_t jobGeneration, const std::function<void(size_t)> *&task, size_t &index)
+{
+        // A worker that woke up late must not claim tasks of a job started after the one it saw
+        std::lock_guard<std::mutex> lock(mutex);
+        if (jobGeneration != generation || !job || next >= jobTasks)
+                return false;
+        task = job;
+        index = next++;
+        return true;
+}
+
+void hostBackend::work()
+{
+        size_t seen = 0;
+        for (;;)
+        {
+                {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        wake.wait(lock, [&]() { return stopping || generation != seen; });
+                        if (stopping)
+                                return;
+                        seen = generation;
+                        if (!job)
+                                continue;
+                        ++busy;
+                }
+                const std::function<void(size_t)> *task;
+                size_t i;
+                while (take(seen, task, i))
+                        (*task)(i);
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        --busy;
+                }
+                done.notify_one();
+        }
+}
+
+void hostBackend::parallel(size_t tasks, const std::function<void(size_t)> &task)
+{
+        if (workers.empty() || tasks <= 1)
+        {
+                for (size_t i = 0; i < tasks; ++i)
+                        task(i);
+                return;
+        }
+
+        std::lock_guard<std::mutex> running(runMutex);
+        size_t jobGeneration;
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                job = &task;
+                jobTasks = tasks;
+                next = 0;
+                jobGeneration = ++generation;
+        }
+        wake.notify_all();
+
+        const std::function<void(size_t)> *mine;
+        size_t i;
+        while (take(jobGeneration, mine, i))
+                (*mine)(i);
+
+        // Workers that joined may still be running their last task. Once they are done no
+        // one holds the job: late workers see it cleared or its generation moved on.
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&]() { return busy == 0; });
+        job = NULL;
+        jobTasks = 0;
+}
+
+cl_int hostBackend::vectorAdd(const float *A, const float *B, float *C, size_t n)
+{
+        return elementwise(clSession::EW_ADD, C, A, B, NULL, 0.0f, n);
+}
+
+cl_int hostBackend::elementwise(clSession::elementwiseOp op, float *out, const float *X, const float *Y, const float *Z, float a,
+                                size_t n)
+{
+        int inputs = clSession::elementwiseInputs(op);
+        if (!out || !X || (inputs > 1 && !Y) || (inputs > 2 && !Z))
+                return CL_INVALID_VALUE;
+
+        // A few tasks per thread so a thread slowed down by the OS does not hold up the rest
+        size_t tasks = std::max<size_t>(1, std::min<size_t>(threads() * EW_TASKS_PER_THREAD, n / EW_GRAIN));
+        size_t chunk = ((n + tasks - 1) / tasks + 15) / 16 * 16;
+        isa use = level;
+        parallel(tasks, [&](size_t t) {
+                size_t begin = std::min(n, t * chunk), end = std::min(n, begin + chunk);
+#ifdef HOST_X86
+                if (use == AVX512)
+                        return elementwiseAvx512(op, out, X, Y, Z, a, begin, end);
+                if (use == AVX2)
+                        return elementwiseAvx2(op, out, X, Y, Z, a, begin, end);
+#endif
+                elementwiseScalar(op, out, X, Y, Z, a, begin, end);
+        });
+        return CL_SUCCESS;
+}
+
+cl_int hostBackend::matrixMult(const float *A, const float *B, float *C, int M, int K, int N, clSession::gemmKernel variant)
+{
+        if (!A || !B || !C || M < 0 || K < 0 || N < 0)
+                return CL_INVALID_VALUE;
+
+        // One task per GEMM_MC x GEMM_NC tile of C, accumulated over GEMM_KC deep panels so
+        // the part of B a tile reads stays in cache
+        size_t tilesM = (M + GEMM_MC - 1) / GEMM_MC, tilesN = (N + GEMM_NC - 1) / GEMM_NC;
+        isa use = level;
+        parallel(tilesM * tilesN, [&](size_t t) {
+                int i0 = (t / tilesN) * GEMM_MC, i1 = std::min(M, i0 + GEMM_MC);
+                int j0 = (t % tilesN) * GEMM_NC, j1 = std::min(N, j0 + GEMM_NC);
+                if (variant != clSession::GEMM_TILED_ACC)
+                        for (int i = i0; i < i1; ++i)
+                                std::fill(C + (size_t)i * N + j0, C + (size_t)i * N + j1, 0.0f);
+                for (int k0 = 0; k0 < K; k0 += GEMM_KC)
+                {
+                        int k1 = std::min(K, k0 + GEMM_KC);
+#ifdef HOST_X86
+                        if (use == AVX512)
+                        {
+                                gemmTileAvx512(A, B, C, K, N, i0, i1, j0, j1, k0, k1);
+                                continue;
+                        }
+                        if (use == AVX2)
+                        {
+                                gemmTileAvx2(A, B, C, K, N, i0, i1, j0, j1, k0, k1);
+                                continue;
+                        }
+#endif
+                        gemmTileScalar(A, B, C, K, N, i0, i1, j0, j1, k0, k1);
+                }
+        });
+        return CL_SUCCESS;
+}
@@ -0,0 +1,343 @@
+#include "hybridDispatcher.h"
+#include "clErrors.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <sstream>
+
+#define CALIBRATION_REPS 3 // timed runs per point, the median counts
+#define MAX_LOGGED 32      // decisions kept for decisions() and report()
+// Without a cost model: smaller operations stay on the host, larger ones go to the device
+#define FALLBACK_GEMM_FLOPS (2.0 * 256 * 256 * 256)
+#define FALLBACK_ELEMENTWISE_BYTES (3.0 * (1 << 20) * sizeof(float))
+
+// Median wall time in seconds of 'op' after one untimed run, < 0 if it failed
+static double timeSeconds(const std::function<cl_int()> &op)
+{
+        if (op() != CL_SUCCESS)
+                return -1;
+        std::vector<double> t;
+        for (int i = 0; i < CALIBRATION_REPS; ++i)
+        {
+                auto start = std::chrono::high_resolution_clock::now();
+                if (op() != CL_SUCCESS)
+                        return -1;
+                t.push_back(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+        }
+        std::sort(t.begin(), t.end());
+        return t[t.size() / 2];
+}
+
+hybridDispatcher::hybridDispatcher(clSession &session) : session(session)
+{
+        // A model only holds for the device, driver and host backend it was measured on
+        char name[256] = {0}, driver[256] = {0};
+        clGetDeviceInfo(session.device(), CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+        clGetDeviceInfo(session.device(), CL_DRIVER_VERSION, sizeof(driver) - 1, driver, NULL);
+        deviceKey = std::string(name) + " / " + driver + " / " + cpu.description();
+}
+
+const char *hybridDispatcher::costName(cost c)
+{
+        static const char *names[] = {"hostGemm", "deviceGemm", "hostElementwise", "deviceElementwise", "upload", "download"};
+        return names[c];
+}
+
+hybridDispatcher::linearCost hybridDispatcher::fit(double units1, double seconds1, double units2, double seconds2)
+{
+        // Through both points; timing noise must not make either part negative
+        linearCost c;
+        c.perUnit = std::max((seconds2 - seconds1) / (units2 - units1), seconds2 / units2 * 1e-3);
+        c.seconds = std::max(0.0, seconds1 - units1 * c.perUnit);
+        return c;
+}
+
+cl_int hybridDispatcher::calibrate(int gemmSize, size_t vecElements)
+{
+        // The calibration runs are not part of the application's profile
+        clProfiler *previous = session.profiler();
+        session.setProfiler(NULL);
+        cl_int ret = measure(gemmSize, vecElements);
+        session.setProfiler(previous);
+        return ret;
+}
+
+cl_int hybridDispatcher::measure(int gemmSize, size_t vecElements)
+{
+        cl_command_queue queue = session.queue();
+        int sizes[2] = {std::max(gemmSize / 4, 1), gemmSize};
+        size_t lengths[2] = {std::max<size_t>(vecElements / 256, 1), vecElements};
+        double t[NUM_COSTS][2];
+
+        for (int i = 0; i < 2; ++i)
+        {
+                int s = sizes[i];
+                deviceMatrix::hostMatrix a = deviceMatrix::hostMatrix::Ones(s, s), b = a, c(s, s);
+                t[HOST_GEMM][i] = timeSeconds([&]() { return cpu.matrixMult(a.data(), b.data(), c.data(), s, s, s); });
+
+                // Device resident operands, so only the kernel and its launch are timed
+                deviceMatrix dA(session, a.data(), s, s), dB(session, b.data(), s, s), dC(session, s, s);
+                dA.syncDevice();
+                dB.syncDevice();
+                t[DEVICE_GEMM][i] = timeSeconds([&]() {
+                        cl_int ret = dC.product(dA, dB);
+                        return ret == CL_SUCCESS ? clFinish(queue) : ret;
+                });
+
+                size_t n = lengths[i];
+                std::vector<float> x(n, 1.0f), y(n, 2.0f), z(n);
+                t[HOST_ELEMENTWISE][i] = timeSeconds([&]() { return cpu.vectorAdd(x.data(), y.data(), z.data(), n); });
+
+                deviceArray dx(session, x.data(), n), dy(session, y.data(), n), dz(session, n);
+                t[DEVICE_ELEMENTWISE][i] = timeSeconds([&]() {
+                        cl_int ret = session.elementwise(clSession::EW_ADD, dz.buffer(), dx.buffer(), dy.buffer(), NULL, 0.0f, n);
+                        return ret == CL_SUCCESS ? clFinish(queue) : ret;
+                });
+                t[UPLOAD][i] = timeSeconds([&]() { return dz.write(z.data()); });
+                t[DOWNLOAD][i] = timeSeconds([&]() { return dz.read(z.data()); });
+
+                for (int c = 0; c < NUM_COSTS; ++c)
+                        if (t[c][i] < 0)
+                        {
+                                std::cerr << "Calibrating " << costName((cost)c) << " failed" << std::endl;
+                                return CL_INVALID_OPERATION;
+                        }
+        }
+
+        for (int c = 0; c < NUM_COSTS; ++c)
+        {
+                double units[2];
+                for (int i = 0; i < 2; ++i)
+                        units[i] = c == HOST_GEMM || c == DEVICE_GEMM ? 2.0 * sizes[i] * sizes[i] * sizes[i]
+                                   : c == HOST_ELEMENTWISE || c == DEVICE_ELEMENTWISE ? 3.0 * lengths[i] * sizeof(float)
+                                                                                       : (double)lengths[i] * sizeof(float);
+                model[c] = fit(units[0], t[c][0], units[1], t[c][1]);
+        }
+        ready = true;
+        return CL_SUCCESS;
+}
+
+bool hybridDispatcher::load(const std::string &path)
+{
+        // "device \t <name / driver>" then one "cost seconds perUnit" line per cost
+        std::ifstream in(path);
+        std::string line;
+        bool deviceMatches = false;
+        int found = 0;
+        linearCost loaded[NUM_COSTS];
+        while (std::getline(in, line))
+        {
+                if (line.empty() || line[0] == '#')
+                        continue;
+                if (line.compare(0, 7, "device\t") == 0)
+                {
+                        deviceMatches = line.substr(7) == deviceKey;
+                        continue;
+                }
+                std::istringstream fields(line);
+                std::string name;
+                linearCost c;
+                if (!(fields >> name >> c.seconds >> c.perUnit) || c.seconds < 0 || c.perUnit <= 0)
+                        return false;
+                for (int i = 0; i < NUM_COSTS; ++i)
+                        if (name == costName((cost)i))
+                        {
+                                loaded[i] = c;
+                                found |= 1 << i;
+                        }
+        }
+        if (!deviceMatches || found != (1 << NUM_COSTS) - 1)
+                return false;
+
+        std::copy(loaded, loaded + NUM_COSTS, model);
+        ready = true;
+        return true;
+}
+
+bool hybridDispatcher::save(const std::string &path) const
+{
+        std::ofstream out(path);
+        if (!out)
+                return false;
+        out << "# hybridDispatcher cost model: cost seconds perUnit (per flop or byte)" << std::endl;
+        out << "device\t" << deviceKey << std::endl;
+        for (int c = 0; c < NUM_COSTS; ++c)
+                out << costName((cost)c) << ' ' << model[c].seconds << ' ' << model[c].perUnit << std::endl;
+        return (bool)out;
+}
+
+cl_int hybridDispatcher::prepare(const std::string &path)
+{
+        const char *env = getenv("CL_DISPATCH_MODEL");
+        std::string file = !path.empty() ? path : env ? env : "";
+        if (!file.empty() && load(file))
+                return CL_SUCCESS;
+
+        cl_int ret = calibrate();
+        if (ret == CL_SUCCESS && !file.empty())
+                save(file);
+        return ret;
+}
+
+size_t hybridDispatcher::staleBytes(backend b, std::initializer_list<const deviceMatrix *> operands)
+{
+        size_t bytes = 0;
+        for (const deviceMatrix *m : operands)
+                if (m && !(b == HOST ? m->hostCurrent() : m->deviceCurrent()))
+                        bytes += m->size() * sizeof(float);
+        return bytes;
+}
+
+hybridDispatcher::backend hybridDispatcher::choose(const std::string &op, const std::string &shape, cost hostCost,
+                                                   cost deviceCost, double units, std::initializer_list<const deviceMatrix *> operands)
+{
+        if (!ready && !fallback)
+        {
+                cl_int ret = calibrate();
+                if (ret != CL_SUCCESS)
+                {
+                        std::cerr << "hybridDispatcher: calibration failed (" << getClErrorString(ret)
+                                  << "), choosing by size thresholds" << std::endl;
+                        fallback = true;
+                }
+        }
+
+        decision d;
+        d.op = op;
+        d.shape = shape;
+        size_t down = staleBytes(HOST, operands), up = staleBytes(DEVICE, operands);
+        backend preferred;
+        if (ready)
+        {
+                d.hostUs = (model[hostCost].estimate(units) + (down ? model[DOWNLOAD].estimate(down) : 0)) * 1e6;
+                d.deviceUs = (model[deviceCost].estimate(units) + (up ? model[UPLOAD].estimate(up) : 0)) * 1e6;
+                preferred = d.hostUs <= d.deviceUs ? HOST : DEVICE;
+        }
+        else
+        {
+                // No estimates to report
+                d.hostUs = d.deviceUs = 0;
+                preferred = units >= (hostCost == HOST_GEMM ? FALLBACK_GEMM_FLOPS : FALLBACK_ELEMENTWISE_BYTES) ? DEVICE : HOST;
+        }
+        d.chosen = forced != AUTO ? forced : preferred;
+        d.moveBytes = d.chosen == HOST ? down : up;
+        backendCount &count = counts[op];
+        ++(d.chosen == HOST ? count.host : count.device);
+        log.push_back(d);
+        if (log.size() > MAX_LOGGED)
+                log.pop_front();
+        return d.chosen;
+}
+
+cl_int hybridDispatcher::gemm(deviceMatrix &C, const deviceMatrix &A, const deviceMatrix &B)
+{
+        // The product is never computed in place
+        if (A.cols() != B.rows() || C.rows() != A.rows() || C.cols() != B.cols() || &C == &A || &C == &B)
+                return CL_INVALID_VALUE;
+
+        char shape[64];
+        snprintf(shape, sizeof(shape), "%dx%dx%d", A.rows(), A.cols(), B.cols());
+        double flops = 2.0 * A.rows() * A.cols() * B.cols();
+        if (choose("gemm", shape, HOST_GEMM, DEVICE_GEMM, flops, {&A, &B}) == DEVICE)
+                return C.product(A, B);
+
+        cl_int ret;
+        if ((ret = A.syncHost()) != CL_SUCCESS || (ret = B.syncHost()) != CL_SUCCESS)
+                return ret;
+        return cpu.matrixMult(A.host().data(), B.host().data(), C.hostOverwrite().data(), A.rows(), A.cols(), B.cols());
+}
+
+cl_int hybridDispatcher::elementwise(clSession::elementwiseOp op, deviceMatrix &out, const deviceMatrix *X,
+                                     const deviceMatrix *Y, const deviceMatrix *Z, float a)
+{
+        static const char *names[] = {"ew_add", "ew_sub", "ew_mul", "ew_axpy", "ew_scale", "ew_fma"};
+        int inputs = clSession::elementwiseInputs(op);
+        const deviceMatrix *operands[3] = {X, inputs > 1 ? Y : NULL, inputs > 2 ? Z : NULL};
+        for (int i = 0; i < inputs; ++i)
+        {
+                if (!operands[i])
+                        return CL_INVALID_VALUE;
+                if (operands[i]->rows() != out.rows() || operands[i]->cols() != out.cols())
+                        return CL_INVALID_BUFFER_SIZE;
+        }
+
+        char shape[64];
+        snprintf(shape, sizeof(shape), "%dx%d", out.rows(), out.cols());
+        double bytes = (inputs + 1.0) * out.size() * sizeof(float);
+        if (choose(names[op], shape, HOST_ELEMENTWISE, DEVICE_ELEMENTWISE, bytes, {operands[0], operands[1], operands[2]}) == DEVICE)
+                return deviceElementwise(op, out, operands[0], operands[1], operands[2], a);
+        return hostElementwise(op, out, operands[0], operands[1], operands[2], a);
+}
+
+cl_int hybridDispatcher::hostElementwise(clSession::elementwiseOp op, deviceMatrix &out, const deviceMatrix *X,
+                                         const deviceMatrix *Y, const deviceMatrix *Z, float a)
+{
+        // Inputs first: 'out' may be one of them and must not be marked current before it is read
+        cl_int ret;
+        for (const deviceMatrix *m : {X, Y, Z})
+                if (m && (ret = m->syncHost()) != CL_SUCCESS)
+                        return ret;
+
+        const float *x = X->host().data(), *y = Y ? Y->host().data() : NULL, *z = Z ? Z->host().data() : NULL;
+        return cpu.elementwise(op, out.hostOverwrite().data(), x, y, z, a, out.size());
+}
+
+cl_int hybridDispatcher::deviceElementwise(clSession::elementwiseOp op, deviceMatrix &out, const deviceMatrix *X,
+                                           const deviceMatrix *Y, const deviceMatrix *Z, float a)
+{
+        cl_mem buffers[3] = {NULL, NULL, NULL};
+        const deviceMatrix *operands[3] = {X, Y, Z};
+        for (int i = 0; i < 3; ++i)
+                if (operands[i])
+                {
+                        cl_int ret = operands[i]->syncDevice();
+                        if (ret != CL_SUCCESS)
+                                return ret;
+                        buffers[i] = operands[i]->device().buffer();
+                }
+        return session.elementwise(op, out.deviceWrite().buffer(), buffers[0], buffers[1], buffers[2], a, out.size());
+}
+
+void hybridDispatcher::report(std::ostream &os) const
+{
+        size_t onHost = 0, onDevice = 0;
+        for (const auto &c : counts)
+        {
+                onHost += c.second.host;
+                onDevice += c.second.device;
+        }
+        os << "Hybrid Dispatcher: " << onHost + onDevice << " decisions, " << onHost << " host, " << onDevice
+           << " device" << (forced != AUTO ? " (forced)" : "") << std::endl;
+
+        char line[256];
+        for (const auto &c : counts)
+        {
+                snprintf(line, sizeof(line), "  %-10s %10zu host %10zu device", c.first.c_str(), c.second.host, c.second.device);
+                os << line << std::endl;
+        }
+        if (!ready && fallback)
+                os << "  no cost model (calibration failed), size thresholds" << std::endl;
+        for (int c = 0; c < NUM_COSTS && ready; ++c)
+        {
+                bool flops = c == HOST_GEMM || c == DEVICE_GEMM;
+                snprintf(line, sizeof(line), "  %-18s %10.2f us + %10.3f %s", costName((cost)c), model[c].seconds * 1e6,
+                         model[c].perUnit > 0 ? 1e-9 / model[c].perUnit : 0.0, flops ? "GFLOP/s" : "GB/s");
+                os << line << std::endl;
+        }
+
+        snprintf(line, sizeof(line), "  %-10s %-16s %-8s %12s %12s %12s", "Op", "Shape", "Backend", "Host (us)", "Device (us)", "Moved (B)");
+        os << line << std::endl;
+        size_t earlier = onHost + onDevice - log.size();
+        if (earlier)
+                os << "  ... " << earlier << " earlier decisions" << std::endl;
+        for (const decision &d : log)
+        {
+                snprintf(line, sizeof(line), "  %-10s %-16s %-8s %12.1f %12.1f %12zu", d.op.c_str(), d.shape.c_str(),
+                         d.chosen == HOST ? "host" : "device", d.hostUs, d.deviceUs, d.moveBytes);
+                os << line << std::endl;
+        }
+}
@@ -6,181 +6,385 @@
 #endif
 
 #include <chrono>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 
 #include "clErrors.h"
-
-#define MAX_SOURCE_SIZE (0x100000)
+#include "clSession.h"
+#include "programCache.h"
+#include "mappedBuffer.h"
+#include "deviceScheduler.h"
+#include "autoTuner.h"
+#include "deviceArray.h"
+#include "asyncQueue.h"
+#include "matrixFile.h"
+#include "hostBackend.h"
 
 #define STRING_BUFFER_LEN 128
 
 using namespace std;
 
 void DevQuery();
+cl_int pipelinedRuns(clSession &session, float *A, float *B, float *C, size_t n, int runs, bool synthetic);
+cl_int hostRuns(const float *A, const float *B, float *C, size_t n, int runs);
+void releaseInputs(float *A, float *B, float *C, matrixFile *fileA, matrixFile *fileB, matrixFile *fileC);
 
 int main(int argc, char **argv)
 {
-
-        DevQuery();
-
         // Create the two input vectors
-        int NElements;
+        size_t NElements;
         if (argc < 2)
         {
                 NElements = 1000000;
         }
         else
         {
-                NElements = atoi(argv[1]);
+                NElements = strtoull(argv[1], NULL, 10);
+        }
+
+        // Repeated calls reuse the session's context, queue and kernel
+        int NRuns = argc < 3 ? 1 : atoi(argv[2]);
+
+        // CL_VECTOR_A / CL_VECTOR_B name float matrix files (see matrixFile.h) whose elements
+        // are added instead of the generated vectors, CL_VECTOR_C a file to write C to. The
+        // files are memory mapped and used in place, so with CL_STREAM_CHUNK large inputs
+        // stream through the device chunk by chunk.
+        matrixFile *fileA = NULL, *fileB = NULL, *fileC = NULL;
+        if (getenv("CL_VECTOR_A") && getenv("CL_VECTOR_B"))
+        {
+                fileA = new matrixFile(getenv("CL_VECTOR_A"));
+                fileB = new matrixFile(getenv("CL_VECTOR_B"));
+                if (fileA->error() != CL_SUCCESS || fileB->error() != CL_SUCCESS || !fileA->floats() || !fileB->floats() ||
+                    fileA->bytes() != fileB->bytes())
+                {
+                        std::cerr << "CL_VECTOR_A / CL_VECTOR_B: float files of the same size expected" << std::endl;
+                        exit(-1);
+                }
+                NElements = fileA->rows() * fileA->cols();
+                fileA->adviseSequential();
+                fileB->adviseSequential();
+        }
+        if (getenv("CL_VECTOR_C"))
+        {
+                fileC = new matrixFile(getenv("CL_VECTOR_C"), NElements, 1);
+                if (fileC->error() != CL_SUCCESS)
+                        exit(-1);
         }
 
         std::cout << "# Elements: " << NElements << std::endl;
 
         std::chrono::high_resolution_clock::time_point start, end;
 
-        // Load the kernel source code into the array source_str
-        FILE *fp;
-        char *source_str;
-        size_t source_size;
+        // Mapped file data is page aligned like alignedHostAlloc's, zero-copy works on both
+        float *A = fileA ? fileA->floats() : (float *)alignedHostAlloc(sizeof(float) * NElements);
+        float *B = fileB ? fileB->floats() : (float *)alignedHostAlloc(sizeof(float) * NElements);
 
-        fp = fopen("kernels/vector_add_kernel.cl", "r");
-        if (!fp)
+        for (size_t i = 0; i < NElements && !fileA; i++)
         {
-                fprintf(stderr, "Failed to load kernel.\n");
-                exit(1);
+                A[i] = i;
+                B[i] = NElements - i;
         }
-        source_str = (char *)malloc(MAX_SOURCE_SIZE);
-        source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
-        fclose(fp);
 
-        cl_platform_id *platforms; // multiple
-        cl_device_id *devices;
-        cl_uint n_platforms;
-        cl_int ret = clGetPlatformIDs(0, NULL, &n_platforms);
-        platforms = new cl_platform_id[n_platforms];
+        float *C = fileC ? fileC->floats() : (float *)alignedHostAlloc(sizeof(float) * NElements);
 
-        clGetPlatformIDs(n_platforms, platforms, NULL);
+        // Device is chosen with CL_DEVICE_TYPE / CL_DEVICE_NAME. The extra queues are
+        // used by the streaming mode.
+        clSession *session = clSession::fromEnv(3);
+        if (session->error() != CL_SUCCESS)
+        {
+                // Without a usable device the runs go to the multithreaded SIMD host backend
+                std::cerr << "Session: " << getClErrorString(session->error()) << std::endl;
+                cl_int ret = hostRuns(A, B, C, NElements, NRuns);
+                delete session;
+                releaseInputs(A, B, C, fileA, fileB, fileC);
+                return ret == CL_SUCCESS ? 0 : -1;
+        }
+        DevQuery();
+        cout << "Device: " << session->deviceName() << endl;
 
-        //choose platform
-        int deviceId = 1; // NVIDIA
+        clProfiler profiler;
+        session->setProfiler(&profiler);
 
-        // cout << "Choose a platform/device[0-" << ret_num_platforms - 1 << "]:";
-        // cin >> deviceId;
-        char platName[100];
-        clGetPlatformInfo(platforms[deviceId], CL_PLATFORM_NAME, sizeof(platName), platName, NULL);
-        cout << "Platform: " << platName << endl;
+        // CL_TUNE=1 picks the vector width and work-group size from the tuning database,
+        // searching them once for sizes not in it yet
+        autoTuner *tuner = NULL;
+        if (getenv("CL_TUNE") && atoi(getenv("CL_TUNE")))
+        {
+                tuner = new autoTuner(*session);
+                session->setTuner(tuner);
+        }
 
-        devices = new cl_device_id;
-        ret = clGetDeviceIDs(platforms[deviceId], CL_DEVICE_TYPE_ALL, 1, devices, NULL);
+        // CL_ZERO_COPY=1 runs on page aligned host memory wrapped by the device instead of copying
+        bool zeroCopy = getenv("CL_ZERO_COPY") && atoi(getenv("CL_ZERO_COPY"));
+        session->setZeroCopy(zeroCopy);
+        cout << "Zero Copy: " << (zeroCopy ? "on" : "off") << endl;
 
-        // Create an OpenCL context
-        cl_context context = clCreateContext(NULL, 1, devices, NULL, NULL, &ret);
+        // CL_STREAM_CHUNK=<elements> streams the vectors through the device in chunks
+        size_t streamChunk = getenv("CL_STREAM_CHUNK") ? atol(getenv("CL_STREAM_CHUNK")) : 0;
+        if (streamChunk)
+                cout << "Streaming Chunk: " << streamChunk << " elements" << endl;
 
-        // Create a command queue
-        cl_command_queue command_queue = clCreateCommandQueue(context, devices[0], 0, &ret);
+        // CL_MULTI_DEVICE=1 splits the vectors over every device matching CL_DEVICE_TYPE / CL_DEVICE_NAME
+        deviceScheduler *scheduler = NULL;
+        if (getenv("CL_MULTI_DEVICE") && atoi(getenv("CL_MULTI_DEVICE")))
+        {
+                scheduler = deviceScheduler::fromEnv();
+                cl_int calibration = scheduler->calibrate();
+                if (calibration != CL_SUCCESS)
+                {
+                        std::cerr << "Calibration: " << getClErrorString(calibration) << std::endl;
+                        exit(-1);
+                }
+                cout << "Devices: " << scheduler->size() << endl;
+        }
 
-        // Create memory buffers on the device for each vector
-        cl_mem a_mem_obj = clCreateBuffer(context, CL_MEM_READ_ONLY,
-                                          NElements * sizeof(float), NULL, &ret);
-        cl_mem b_mem_obj = clCreateBuffer(context, CL_MEM_READ_ONLY,
-                                          NElements * sizeof(float), NULL, &ret);
-        cl_mem c_mem_obj = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-                                          NElements * sizeof(float), NULL, &ret);
+        // CL_ASYNC=1 pipelines the runs: the host prepares the next batch while the device adds this one
+        bool async = getenv("CL_ASYNC") && atoi(getenv("CL_ASYNC"));
 
         cout << "Total Device Memory Allocated(MB): " << (NElements * sizeof(float) * 3) / 1000000 << endl;
 
-        float *A = (float *)malloc(sizeof(float) * NElements);
-        float *B = (float *)malloc(sizeof(float) * NElements);
-
-        for (int i = 0; i < NElements; i++)
+        // Plain runs keep their buffers, so the check below compares the last result on the
+        // device where it already is. The other modes split it over devices, chunks or
+        // slots, or (zero-copy) have it in host memory already.
+        bool resident = !async && !scheduler && !streamChunk && !zeroCopy;
+        deviceArray *devA = NULL, *devB = NULL, *devC = NULL;
+        if (resident)
         {
-                A[i] = i;
-                B[i] = NElements - i;
+                devA = new deviceArray(*session, NElements);
+                devB = new deviceArray(*session, NElements);
+                devC = new deviceArray(*session, NElements);
+                cl_int allocated = devA->error() != CL_SUCCESS ? devA->error() : devB->error() != CL_SUCCESS ? devB->error() : devC->error();
+                if (allocated != CL_SUCCESS)
+                {
+                        std::cerr << getClErrorString(allocated) << std::endl;
+                        exit(-1);
+                }
         }
 
-        // Copy the lists A and B to their respective memory buffers
-        ret = clEnqueueWriteBuffer(command_queue, a_mem_obj, CL_TRUE, 0,
-                                   NElements * sizeof(float), A, 0, NULL, NULL);
-        ret = clEnqueueWriteBuffer(command_queue, b_mem_obj, CL_TRUE, 0,
-                                   NElements * sizeof(float), B, 0, NULL, NULL);
-
-        // Create a program from the kernel source
-        cl_program program = clCreateProgramWithSource(context, 1,
-                                                       (const char **)&source_str, (const size_t *)&source_size, &ret);
+        cl_int ret;
+        if (async)
+        {
+                start = std::chrono::high_resolution_clock::now();
+                ret = pipelinedRuns(*session, A, B, C, NElements, NRuns, !fileA);
+                end = std::chrono::high_resolution_clock::now();
+                if (ret != CL_SUCCESS)
+                {
+                        std::cerr << getClErrorString(ret) << std::endl;
+                        exit(-1);
+                }
+                std::cout << "GPU Wall Time, " << NRuns << " pipelined runs: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us" << std::endl;
+        }
+        for (int run = 0; run < NRuns && !async; ++run)
+        {
+                start = std::chrono::high_resolution_clock::now();
+                if (scheduler)
+                        ret = scheduler->vectorAdd(A, B, C, NElements, streamChunk);
+                else if (streamChunk)
+                        ret = session->vectorAddStreamed(A, B, C, NElements, streamChunk);
+                else if (zeroCopy)
+                        ret = session->vectorAdd(A, B, C, NElements);
+                else
+                {
+                        ret = devA->write(A);
+                        if (ret == CL_SUCCESS)
+                                ret = devB->write(B);
+                        if (ret == CL_SUCCESS)
+                                ret = session->vectorAdd(devA->buffer(), devB->buffer(), devC->buffer(), NElements);
+                        if (ret == CL_SUCCESS)
+                                ret = devC->read(C);
+                }
+                end = std::chrono::high_resolution_clock::now();
 
-        // Build the program
-        ret = clBuildProgram(program, 1, devices, NULL, NULL, NULL);
+                if (ret != CL_SUCCESS)
+                {
+                        std::cerr << getClErrorString(ret) << std::endl;
+                        exit(-1);
+                }
 
-        // Create the OpenCL kernel
-        cl_kernel kernel = clCreateKernel(program, "vector_add", &ret);
+                std::cout << "GPU Wall Time (transfers + kernel): " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us" << std::endl;
+        }
 
-        // Set the arguments of the kernel
-        ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&a_mem_obj);
-        ret = clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&b_mem_obj);
-        ret = clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&c_mem_obj);
+        // Device-side breakdown of every write, kernel and read; CL_TRACE=<file> also dumps a Chrome trace
+        profiler.report();
+        if (getenv("CL_TRACE"))
+                profiler.writeChromeTrace(getenv("CL_TRACE"));
 
-        // Execute the OpenCL kernel on the list
-        size_t global_item_size = NElements; // Process the entire lists
-        size_t local_item_size = 2;          // Process in groups of 64
+        // CPU, on every core with the widest SIMD the processor has
+        float *C_cpu = new float[NElements];
+        hostBackend cpu;
         start = std::chrono::high_resolution_clock::now();
-        ret = clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL,
-                                     &global_item_size, &local_item_size, 0, NULL, NULL);
+        cpu.vectorAdd(A, B, C_cpu, NElements);
         end = std::chrono::high_resolution_clock::now();
+        std::cout << "CPU Elapsed Time (" << cpu.description() << "): " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us" << std::endl;
 
-        if (ret != CL_SUCCESS)
+        cout << "Checking Results..." << endl;
+        float maxDifference = 0;
+        ret = CL_SUCCESS;
+        if (resident)
         {
-                std::cerr << getClErrorString(ret) << std::endl;
-                exit(-1);
+                // Only the reference goes to the device, only the largest difference comes back
+                deviceArray reference(*session, C_cpu, NElements);
+                ret = reference.error();
+                if (ret == CL_SUCCESS)
+                        ret = session->reduce(clSession::REDUCE_MAX_ABS_DIFF, devC->buffer(), reference.buffer(), NElements, &maxDifference);
+        }
+        else
+        {
+                for (size_t i = 0; i < NElements; ++i)
+                        maxDifference = std::max(maxDifference, std::abs(C[i] - C_cpu[i]));
         }
+        if (ret != CL_SUCCESS)
+                std::cerr << "Check: " << getClErrorString(ret) << std::endl;
+        else if (maxDifference != 0)
+                std::cout << "Wrong Results, max abs difference " << maxDifference << std::endl;
+        else
+                cout << "All Good!" << endl;
 
-        std::cout << "GPU Elapsed Time: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us" << std::endl;
+        programCache::instance().report();
+        session->buffers().report();
+        if (scheduler)
+                scheduler->report();
+        if (tuner)
+                tuner->report();
 
-        // Read the memory buffer C on the device to the local variable C
-        float *C = new float[NElements];
-        ret = clEnqueueReadBuffer(command_queue, c_mem_obj, CL_TRUE, 0,
-                                  NElements * sizeof(float), C, 0, NULL, NULL);
+        cin.get();
+        // Clean up
+        delete devA;
+        delete devB;
+        delete devC;
+        delete scheduler;
+        delete tuner;
+        delete session;
+        releaseInputs(A, B, C, fileA, fileB, fileC);
+        delete[] C_cpu;
+        return 0;
+}
 
-        // CPU
-        float *C_cpu = new float[NElements];
-        start = std::chrono::high_resolution_clock::now();
-        for (int i = 0; i < NElements; ++i)
+void releaseInputs(float *A, float *B, float *C, matrixFile *fileA, matrixFile *fileB, matrixFile *fileC)
+{
+        if (!fileA)
         {
-                C_cpu[i] = A[i] + B[i];
+                alignedHostFree(A);
+                alignedHostFree(B);
         }
-        end = std::chrono::high_resolution_clock::now();
-        std::cout << "CPU Elapsed Time: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us" << std::endl;
+        if (!fileC)
+                alignedHostFree(C);
+        // Unmapping writes the rest of C back to its file
+        delete fileA;
+        delete fileB;
+        delete fileC;
+}
 
-        // Checking Results
-        cout << "Cheking Results..." << endl;
-        bool allGood = true;
-        for (int i = 0; i < NElements; ++i)
+// The runs of main() on the host backend, checked against a plain loop
+cl_int hostRuns(const float *A, const float *B, float *C, size_t n, int runs)
+{
+        hostBackend cpu;
+        cout << "Host Backend: " << cpu.description() << endl;
+        cl_int ret = CL_SUCCESS;
+        for (int run = 0; run < runs && ret == CL_SUCCESS; ++run)
         {
-                if (C_cpu[i] != C[i])
-                {
-                        std::cout << "Wrong Results @ i=" << i
-                                  << " (" << C_cpu[i] << " != " << C[i] << ")\n";
-                        allGood = false;
-                        break;
-                }
+                auto start = std::chrono::high_resolution_clock::now();
+                ret = cpu.vectorAdd(A, B, C, n);
+                auto end = std::chrono::high_resolution_clock::now();
+                std::cout << "CPU Wall Time: " << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << " us" << std::endl;
+        }
+        if (ret != CL_SUCCESS)
+        {
+                std::cerr << getClErrorString(ret) << std::endl;
+                return ret;
         }
 
-        if (allGood)
+        cout << "Checking Results..." << endl;
+        float maxDifference = 0;
+        for (size_t i = 0; i < n; ++i)
+                maxDifference = std::max(maxDifference, std::abs(C[i] - (A[i] + B[i])));
+        if (maxDifference != 0)
+                std::cout << "Wrong Results, max abs difference " << maxDifference << std::endl;
+        else
                 cout << "All Good!" << endl;
+        return CL_SUCCESS;
+}
 
-        cin.get();
-        // Clean up
-        ret = clFlush(command_queue);
-        ret = clFinish(command_queue);
-        ret = clReleaseKernel(kernel);
-        ret = clReleaseProgram(program);
-        ret = clReleaseMemObject(a_mem_obj);
-        ret = clReleaseMemObject(b_mem_obj);
-        ret = clReleaseMemObject(c_mem_obj);
-        ret = clReleaseCommandQueue(command_queue);
-        ret = clReleaseContext(context);
-        free(A);
-        free(B);
-        free(C);
-        return 0;
+// Runs C = A + B 'runs' times through an asyncQueue, with two slots of inputs so that the
+// host fills the arrays of batch r + 1 while the device works on batch r. Each command
+// waits only for what it depends on:
+//   upload r      after the kernel of r - 2 (same slot) has read the previous inputs
+//   kernel r      after upload r and the readback of r - 2 (same output buffer)
+//   readback r    after kernel r and readback r - 1 (all go to C)
+// A completion callback counts the batches as they come back. Only 'synthetic' inputs
+// are regenerated; inputs read from files are copied to the second slot once and kept.
+cl_int pipelinedRuns(clSession &session, float *A, float *B, float *C, size_t n, int runs, bool synthetic)
+{
+        size_t bytes = n * sizeof(float);
+        float *hostA[2] = {A, (float *)alignedHostAlloc(bytes)};
+        float *hostB[2] = {B, (float *)alignedHostAlloc(bytes)};
+        if (!synthetic)
+        {
+                memcpy(hostA[1], A, bytes);
+                memcpy(hostB[1], B, bytes);
+        }
+        // Batches whose callback has run, and those of them that succeeded
+        struct callbackCount
+        {
+                std::atomic<int> reported{0}, succeeded{0};
+        };
+        std::shared_ptr<callbackCount> finished = std::make_shared<callbackCount>();
+        int registered = 0;
+        cl_int ret = CL_SUCCESS;
+        {
+                deviceArray a0(session, n), a1(session, n), b0(session, n), b1(session, n), c0(session, n), c1(session, n);
+                deviceArray *devA[2] = {&a0, &a1}, *devB[2] = {&b0, &b1}, *devC[2] = {&c0, &c1};
+                // Destroyed first, so it waits for every command before the buffers go
+                asyncQueue async(session);
+                ret = async.error();
+                if (ret == CL_SUCCESS)
+                        cout << "Async Queue: " << (async.outOfOrder() ? "out-of-order" : "in-order") << endl;
+
+                deviceFuture uploaded[2], added[2], readBack[2], lastRead;
+                for (int run = 0; run < runs && ret == CL_SUCCESS; ++run)
+                {
+                        int s = run % 2;
+                        if (run > 0 && synthetic)
+                        {
+                                // Host work overlapping the device: refill the slot once its last upload is done
+                                ret = uploaded[s].wait();
+                                for (size_t i = 0; i < n; ++i)
+                                {
+                                        hostA[s][i] = i;
+                                        hostB[s][i] = n - i;
+                                }
+                        }
+                        deviceFuture writeA = async.write(devA[s]->buffer(), hostA[s], bytes, {added[s]});
+                        deviceFuture writeB = async.write(devB[s]->buffer(), hostB[s], bytes, {added[s]});
+                        uploaded[s] = async.join({writeA, writeB});
+                        added[s] = async.vectorAdd(devA[s]->buffer(), devB[s]->buffer(), devC[s]->buffer(), n, {writeA, writeB, readBack[s]});
+                        readBack[s] = lastRead = async.read(devC[s]->buffer(), C, bytes, {added[s], lastRead});
+                        if (lastRead.then([finished](cl_int status) {
+                                    if (status == CL_SUCCESS)
+                                            ++finished->succeeded;
+                                    ++finished->reported;
+                            }) == CL_SUCCESS)
+                                ++registered;
+                        async.flush();
+                        if (ret == CL_SUCCESS)
+                                ret = lastRead.error();
+                }
+                if (ret == CL_SUCCESS)
+                        ret = lastRead.wait();
+        }
+        // Callbacks run on a thread of the OpenCL runtime and may still be pending right
+        // after the last wait
+        while (finished->reported < registered)
+                std::this_thread::yield();
+        cout << "Batches Reported By Callback: " << finished->succeeded << "/" << runs << endl;
+        alignedHostFree(hostA[1]);
+        alignedHostFree(hostB[1]);
+        return ret;
 }
 
 void DevQuery()
@@ -188,11 +392,22 @@ void DevQuery()
         // Get platform and device information
         cl_platform_id *platforms; // multiple
         cl_device_id *devices;
-        cl_uint ret_num_platforms;
+        cl_uint ret_num_platforms = 0;
 
         cl_int ret = clGetPlatformIDs(0, NULL, &ret_num_platforms);
+        if (ret != CL_SUCCESS || ret_num_platforms == 0)
+        {
+                std::cerr << "Platforms: " << getClErrorString(ret) << std::endl;
+                return;
+        }
         platforms = new cl_platform_id[ret_num_platforms];
         ret = clGetPlatformIDs(ret_num_platforms, platforms, NULL);
+        if (ret != CL_SUCCESS)
+        {
+                std::cerr << "Platforms: " << getClErrorString(ret) << std::endl;
+                delete[] platforms;
+                return;
+        }
 
         // User-visible output - Platform information
         // for(int i = 0)
@@ -211,11 +426,15 @@ void DevQuery()
                 printf("%-40s = %s\n\n", "CL_PLATFORM_VERSION ", char_buffer);
 
                 // Device Info
-                cl_uint deviceCount;
+                cl_uint deviceCount = 0;
                 ret = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &deviceCount);
+                if (ret != CL_SUCCESS || deviceCount == 0)
+                        continue;
                 devices = new cl_device_id[deviceCount];
 
                 ret = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, deviceCount, devices, NULL);
+                if (ret != CL_SUCCESS)
+                        deviceCount = 0;
 
                 for (int j = 0; j < deviceCount; ++j)
                 {
@@ -289,5 +508,6 @@ void DevQuery()
                 delete[] devices;
         }
 
+        delete[] platforms;
         printf("==========================\n");
 }
@@ -7,15 +7,23 @@
 
 #include <chrono>
 #include <cstring>
+#include <cfloat>
 #include <Eigen/Dense>
 
 #include "clErrors.h"
-#include "kernelLoader.h"
-
-#define MAX_SOURCE_SIZE (0x100000)
+#include "clSession.h"
+#include "programCache.h"
+#include "outOfCoreGemm.h"
+#include "deviceScheduler.h"
+#include "autoTuner.h"
+#include "deviceMatrix.h"
+#include "hybridDispatcher.h"
+#include "matrixFile.h"
+#include "hostBackend.h"
+#include "strassenGemm.h"
 
 #define STRING_BUFFER_LEN 128
-#define BLOCK_SIZE 2
+#define MAX_PRINT_ELEMENTS 100 // larger matrices are not printed
 typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Matrix;
 
 using namespace std;
@@ -30,130 +38,242 @@ void Check(const char* log, const int ret)
 }
 
 void DevQuery();
+void hostProduct(const Eigen::Map<Matrix> &A, const Eigen::Map<Matrix> &B, Eigen::Map<Matrix> &C);
 
 int main(int argc, char **argv)
 {
 
         // DevQuery();
 
-        cl_platform_id *platform = new cl_platform_id[2];
-        cl_device_id device;
-        cl_int ret;
-
-        ret = clGetPlatformIDs(2, platform, NULL);
-
-        ret = clGetDeviceIDs(platform[1], CL_DEVICE_TYPE_ALL, 1, &device, NULL);
+        // CL_HALF=1 stores A, B and C as fp16 on the device (float arithmetic), reporting
+        // the error against the fp32 reference below
+        bool half = getenv("CL_HALF") && atoi(getenv("CL_HALF"));
 
-        char devName[100];
-        ret = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(devName), devName, NULL);
+        // CL_STRASSEN=1 multiplies square matrices with Strassen-Winograd down to the
+        // crossover size (CL_STRASSEN_CROSSOVER, measured when unset) and reports its error
+        bool useStrassen = getenv("CL_STRASSEN") && atoi(getenv("CL_STRASSEN"));
 
-        int squareMatrixSize;
+        // Usage: matrix M [K N]. A single argument gives square M x M matrices.
+        int M, K, N;
 
         if (argc < 2)
         {
-                squareMatrixSize = 1; // 5 x 5
+                M = K = N = 1;
+        }
+        else if (argc < 4)
+        {
+                M = K = N = atoi(argv[1]);
         }
         else
         {
-                squareMatrixSize = atoi(argv[1]);
+                M = atoi(argv[1]);
+                K = atoi(argv[2]);
+                N = atoi(argv[3]);
         }
 
-        cout << "Square Matrix Size: " << squareMatrixSize << endl;
-
-        Matrix A(squareMatrixSize, squareMatrixSize);
-        Matrix B(squareMatrixSize, squareMatrixSize);
-        Matrix C(squareMatrixSize, squareMatrixSize);
-
-        for (int i = 0; i < A.size(); ++i)
+        // CL_MATRIX_A / CL_MATRIX_B name matrix files (row major float, see matrixFile.h) to
+        // multiply instead of random matrices, and CL_MATRIX_C a file to write C to. The files
+        // are memory mapped: the operations read A and B and write C in place, so with
+        // CL_GEMM_BUDGET_MB large files stream through the device tile by tile.
+        matrixFile *fileA = NULL, *fileB = NULL, *fileC = NULL;
+        if (getenv("CL_MATRIX_A") && getenv("CL_MATRIX_B"))
         {
-                A(i) = (float)rand() / (float)RAND_MAX;
-                B(i) = (float)rand() / (float)RAND_MAX;
+                fileA = new matrixFile(getenv("CL_MATRIX_A"));
+                fileB = new matrixFile(getenv("CL_MATRIX_B"));
+                Check("CL_MATRIX_A", fileA->error());
+                Check("CL_MATRIX_B", fileB->error());
+                if (!fileA->floats() || !fileB->floats() || fileA->order() != matrixFile::ROW_MAJOR ||
+                    fileB->order() != matrixFile::ROW_MAJOR || fileA->cols() != fileB->rows())
+                        Check("matrix files (row major float, A cols = B rows)", CL_INVALID_VALUE);
+                M = fileA->rows();
+                K = fileA->cols();
+                N = fileB->cols();
+                fileA->adviseSequential();
+                fileB->adviseSequential();
+        }
+        if (getenv("CL_MATRIX_C"))
+        {
+                fileC = new matrixFile(getenv("CL_MATRIX_C"), M, N);
+                Check("CL_MATRIX_C", fileC->error());
         }
 
-        // cout << A << endl
-        //      << endl;
-        // cout << B << endl
-        //      << endl;
-        C = A * B;
-        cout << C << endl
-             << endl;
-
-             C = Matrix::Identity(squareMatrixSize,squareMatrixSize);
-
-        // return 0;
-
-        // Create an OpenCL context
-        cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, &ret);
-        // Create a command queue
-        cl_command_queue command_queue = clCreateCommandQueue(context, device, 0, &ret);
-
-        // Create memory buffers on the device for each vector
-        cl_mem a_mem_obj = clCreateBuffer(context, CL_MEM_READ_ONLY,
-                                          squareMatrixSize * squareMatrixSize * sizeof(float), NULL, &ret);
-        cl_mem b_mem_obj = clCreateBuffer(context, CL_MEM_READ_ONLY,
-                                          squareMatrixSize * squareMatrixSize * sizeof(float), NULL, &ret);
-        cl_mem c_mem_obj = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-                                          squareMatrixSize * squareMatrixSize * sizeof(float), NULL, &ret);
-
-        // Copy the lists A and B to their respective memory buffers
-        ret = clEnqueueWriteBuffer(command_queue, a_mem_obj, CL_TRUE, 0,
-                                   squareMatrixSize * squareMatrixSize * sizeof(float), A.data(), 0, NULL, NULL);
-
-        ret = clEnqueueWriteBuffer(command_queue, b_mem_obj, CL_TRUE, 0,
-                                   squareMatrixSize * squareMatrixSize * sizeof(float), B.data(), 0, NULL, NULL);
-
-        cl_program clProgram;
-
-        kernelLoader("kernels/matrix_mult_kernel.cl", clProgram, context);
-
-        ret = clBuildProgram(clProgram, 1, &device, NULL, NULL, NULL);
+        cout << "Matrix Sizes: A(" << M << "x" << K << ") * B(" << K << "x" << N << ")" << endl;
 
-        
-        if (ret != 0)
+        // Storage of our own for whatever does not come from a file
+        Matrix ownA, ownB, ownC;
+        if (!fileA)
         {
-                char log[1000];
-                clGetProgramBuildInfo(clProgram, device, CL_PROGRAM_BUILD_LOG, sizeof(log)*sizeof(char), log,NULL);
-                cout << "Build Log: " << log << endl;
-                cout << getClErrorString(ret) << endl;
-                exit(-1);
+                ownA.resize(M, K);
+                ownB.resize(K, N);
+                for (int i = 0; i < ownA.size(); ++i)
+                        ownA(i) = (float)rand() / (float)RAND_MAX;
+                for (int i = 0; i < ownB.size(); ++i)
+                        ownB(i) = (float)rand() / (float)RAND_MAX;
         }
+        if (!fileC)
+                ownC.resize(M, N);
+        Eigen::Map<Matrix> A(fileA ? fileA->floats() : ownA.data(), M, K);
+        Eigen::Map<Matrix> B(fileB ? fileB->floats() : ownB.data(), K, N);
+        Eigen::Map<Matrix> C(fileC ? fileC->floats() : ownC.data(), M, N);
 
-        // Create the OpenCL kernel
-        cl_kernel kernel = clCreateKernel(clProgram, "matrixMult", &ret);
+        C.setZero();
 
-        Check("kernel",ret);
-
-        // Set the arguments of the kernel
-        ret = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&a_mem_obj);
-        ret = clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&b_mem_obj);
-        ret = clSetKernelArg(kernel, 2, sizeof(cl_mem), (void *)&c_mem_obj);
-        Check("kernel arg 2",ret);
-        ret = clSetKernelArg(kernel, 3, sizeof(squareMatrixSize), (void *)&squareMatrixSize);
-        Check("kernel arg 3",ret);
-        ret = clSetKernelArg(kernel, 4, sizeof(squareMatrixSize), (void *)&squareMatrixSize);
-        Check("kernel arg 4",ret);
+        // Device is chosen with CL_DEVICE_TYPE / CL_DEVICE_NAME
+        clSession *session = clSession::fromEnv();
+        if (session->error() != CL_SUCCESS)
+        {
+                // Without a usable device the product runs on the multithreaded SIMD host backend
+                cout << "session: " << getClErrorString(session->error()) << endl;
+                hostProduct(A, B, C);
+                delete fileA;
+                delete fileB;
+                delete fileC;
+                delete session;
+                return 0;
+        }
+        cout << "Device: " << session->deviceName() << endl;
 
-        // ret = clSetKernelArg(kernel, 3, sizeof(cl_mem), &squareMatrixSize);
-        // ret = clSetKernelArg(kernel, 4, sizeof(cl_mem), &squareMatrixSize);
+        clProfiler profiler;
+        session->setProfiler(&profiler);
 
-        // Execute the OpenCL kernel on the list
-        size_t global_item_size[2] = {squareMatrixSize,squareMatrixSize}; // Process the entire lists
-        size_t local_item_size[2] = {BLOCK_SIZE,BLOCK_SIZE};                 // Divide work items into groups of 64
+        // CL_TUNE=1 picks the GEMM tile and work-group shape from the tuning database,
+        // searching them once for sizes not in it yet
+        autoTuner *tuner = NULL;
+        if (getenv("CL_TUNE") && atoi(getenv("CL_TUNE")))
+        {
+                tuner = new autoTuner(*session);
+                session->setTuner(tuner);
+        }
 
-        ret = clEnqueueNDRangeKernel(command_queue, kernel, 2, NULL,
-                                     global_item_size, local_item_size, NULL, NULL, NULL);
+        // CL_HYBRID=1 lets the cost model pick the host backend or OpenCL for the product, using the
+        // model in CL_DISPATCH_MODEL or calibrating one (and saving it there)
+        hybridDispatcher *dispatcher = NULL;
+        if (getenv("CL_HYBRID") && atoi(getenv("CL_HYBRID")))
+        {
+                dispatcher = new hybridDispatcher(*session);
+                Check("hybridDispatcher", dispatcher->prepare());
+        }
 
-        Check("kernel enque",ret);
+        // CL_ZERO_COPY=1 lets the device use the Eigen storage in place instead of copying
+        session->setZeroCopy(getenv("CL_ZERO_COPY") && atoi(getenv("CL_ZERO_COPY")));
+
+        // Host memory wrapped for the device, nothing is transferred until first device use
+        deviceMatrix dA(*session, A.data(), M, K), dB(*session, B.data(), K, N), dC(*session, C.data(), M, N);
+
+        // CL_GEMM_BUDGET_MB=<n> streams the product through n MB of device memory
+        // CL_MULTI_DEVICE=1 splits the rows of C over every matching device
+        outOfCoreGemm *ooc = NULL;
+        deviceScheduler *scheduler = NULL;
+        strassenGemm *strassen = NULL;
+        strassenGemm::errorReport strassenError;
+        if (useStrassen && (M != K || K != N))
+                cout << "CL_STRASSEN: square matrices only, using the tiled kernel" << endl;
+        if (getenv("CL_GEMM_BUDGET_MB"))
+        {
+                ooc = new outOfCoreGemm(*session, (size_t)(atof(getenv("CL_GEMM_BUDGET_MB")) * 1048576));
+                Check("outOfCoreGemm", ooc->run(A.data(), B.data(), C.data(), M, K, N));
+        }
+        else if (getenv("CL_MULTI_DEVICE") && atoi(getenv("CL_MULTI_DEVICE")))
+        {
+                scheduler = deviceScheduler::fromEnv();
+                Check("deviceScheduler", scheduler->matrixMult(A.data(), B.data(), C.data(), M, K, N));
+        }
+        else if (useStrassen && M == K && K == N)
+        {
+                strassen = new strassenGemm(*session);
+                Check("strassenGemm", strassen->run(dA.device().buffer(), dB.device().buffer(), dC.deviceWrite().buffer(), N));
+                Check("strassenGemm error", strassen->checkError(dA.device().buffer(), dB.device().buffer(), dC.device().buffer(), N, strassenError));
+                Check("read C", dC.syncHost());
+        }
+        else if (half)
+                Check("matrixMultHalf", session->matrixMultHalf(A.data(), B.data(), C.data(), M, K, N));
+        else if (session->zeroCopyEnabled())
+                Check("matrixMult", session->matrixMult(A.data(), B.data(), C.data(), M, K, N));
+        else
+        {
+                // A and B are uploaded on first device use, C comes back once when synced
+                if (dispatcher)
+                        Check("hybridDispatcher", dispatcher->gemm(dC, dA, dB));
+                else
+                        Check("matrixMult", dC.product(dA, dB));
+                Check("read C", dC.syncHost());
+        }
 
-        // Read the memory buffer C on the device to the local variable C
-        // float *C = new float[]
-        ret = clEnqueueReadBuffer(command_queue, c_mem_obj, CL_TRUE, 0,
-                                  squareMatrixSize * squareMatrixSize * sizeof(float), C.data(), 0, NULL, NULL);
+        // Checked on the device against the naive kernel; only the error comes back. C is
+        // uploaded again if it was computed elsewhere (host paths write C directly).
+        deviceMatrix reference(*session, M, N);
+        Check("reference", reference.product(dA, dB, clSession::GEMM_NAIVE));
+        if (ooc || scheduler || half || session->zeroCopyEnabled())
+                dC.hostOverwrite();
+        float relativeError;
+        Check("write C", dC.syncDevice());
+        Check("check", session->relativeError(dC.device().buffer(), reference.device().buffer(), dC.size(), &relativeError));
+
+        if (C.size() <= MAX_PRINT_ELEMENTS)
+        {
+                cout << reference.host() << endl
+                     << endl;
+                cout << C << endl
+                     << endl;
+        }
 
+        // Rounding of a K term dot product, relative to the largest element of C. fp16
+        // storage adds the rounding of A, B and C to 11 bits (bound for the non-negative
+        // inputs used here).
+        float tolerance = K * FLT_EPSILON + (half ? 3.0f / 2048 : 0.0f);
+        if (half)
+                cout << "fp16 storage vs fp32:" << endl;
+        // Strassen-Winograd's bound is this many times the classic one
+        if (strassen)
+                tolerance *= std::max(1.0, strassenError.bound / strassenError.classicBound);
+        cout << "Relative Error: " << relativeError << " (tolerance " << tolerance << ")" << endl;
+        cout << (relativeError <= tolerance ? "All Good!" : "Wrong Results") << endl;
+
+        // CL_TRACE=<file> also dumps a Chrome trace
+        profiler.report();
+        if (getenv("CL_TRACE"))
+                profiler.writeChromeTrace(getenv("CL_TRACE"));
+
+        programCache::instance().report();
+        session->buffers().report();
+        if (ooc)
+                ooc->report();
+        if (scheduler)
+                scheduler->report();
+        if (tuner)
+                tuner->report();
+        if (dispatcher)
+                dispatcher->report();
+        if (strassen)
+                strassen->report();
+
+        // Unmapping writes the rest of C back to its file
+        delete fileA;
+        delete fileB;
+        delete fileC;
+        delete dispatcher;
+        delete strassen;
+        delete scheduler;
+        delete tuner;
+        delete ooc;
+        delete session;
+}
 
-        Check("readResults",ret);
-        cout << C << endl
-             << endl;
+// C = A * B on the host backend, checked against Eigen's product
+void hostProduct(const Eigen::Map<Matrix> &A, const Eigen::Map<Matrix> &B, Eigen::Map<Matrix> &C)
+{
+        hostBackend cpu;
+        cout << "Host Backend: " << cpu.description() << endl;
+        auto start = chrono::high_resolution_clock::now();
+        Check("hostBackend", cpu.matrixMult(A.data(), B.data(), C.data(), A.rows(), A.cols(), B.cols()));
+        auto end = chrono::high_resolution_clock::now();
+        cout << "CPU Wall Time: " << chrono::duration_cast<chrono::microseconds>(end - start).count() << " us" << endl;
+
+        Matrix reference = A * B;
+        float relativeError = (C - reference).cwiseAbs().maxCoeff() / std::max(reference.cwiseAbs().maxCoeff(), FLT_MIN);
+        float tolerance = A.cols() * FLT_EPSILON;
+        cout << "Relative Error: " << relativeError << " (tolerance " << tolerance << ")" << endl;
+        cout << (relativeError <= tolerance ? "All Good!" : "Wrong Results") << endl;
 }
 
 void DevQuery()
@@ -0,0 +1,196 @@
+#include "matrixFile.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MATRIX_FILE_MAGIC "CLMATRIX"
+#define MATRIX_FILE_VERSION 1
+#define MATRIX_FILE_DATA_OFFSET 4096 // header page, keeps the elements page aligned
+
+// True if a rows x cols matrix of 'elementSize' byte elements, starting 'offset' bytes
+// into the file, ends within 'fileBytes' (SIZE_MAX: any size that does not overflow)
+static bool fits(uint64_t rows, uint64_t cols, size_t elementSize, uint64_t offset, uint64_t fileBytes)
+{
+        if (cols != 0 && rows > SIZE_MAX / cols / elementSize)
+                return false;
+        uint64_t data = rows * cols * elementSize;
+        return offset <= fileBytes && data <= fileBytes - offset;
+}
+
+matrixFile::matrixFile(const std::string &path) : name(path)
+{
+        memset(&hdr, 0, sizeof(hdr));
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+                fail("cannot open");
+                return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(hdr) || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+        {
+                close(fd);
+                fail("cannot read the header");
+                return;
+        }
+        // A corrupted header must not produce sizes that wrap around and pass the size check
+        if (memcmp(hdr.magic, MATRIX_FILE_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != MATRIX_FILE_VERSION ||
+            hdr.dtype > INT32 || hdr.layout > COL_MAJOR || hdr.offset % MATRIX_FILE_DATA_OFFSET != 0 ||
+            !fits(hdr.rows, hdr.cols, elementSize(type()), hdr.offset, (uint64_t)st.st_size))
+        {
+                close(fd);
+                fail("not a matrix file, or truncated", false);
+                return;
+        }
+        nRows = hdr.rows;
+        nCols = hdr.cols;
+
+        // Private and writable: callers may use the elements as scratch (some APIs take
+        // non-const pointers) without touching the file
+        mappedBytes = hdr.offset + bytes();
+        mapping = mmap(NULL, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+                mapping = NULL;
+                fail("cannot map");
+                return;
+        }
+        elements = (char *)mapping + hdr.offset;
+}
+
+matrixFile::matrixFile(const std::string &path, size_t rows, size_t cols, dtype type, layout order)
+    : name(path), nRows(rows), nCols(cols), shared(true)
+{
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, MATRIX_FILE_MAGIC, sizeof(hdr.magic));
+        hdr.version = MATRIX_FILE_VERSION;
+        hdr.dtype = type;
+        hdr.layout = order;
+        hdr.rows = rows;
+        hdr.cols = cols;
+        hdr.offset = MATRIX_FILE_DATA_OFFSET;
+        if (!fits(rows, cols, elementSize(type), hdr.offset, SIZE_MAX))
+        {
+                nRows = nCols = 0;
+                fail("matrix too large", false);
+                return;
+        }
+
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+                fail("cannot create");
+                return;
+        }
+        // The file is sized up front, so the elements read as zeros until written
+        mappedBytes = hdr.offset + bytes();
+        if (ftruncate(fd, mappedBytes) != 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+        {
+                close(fd);
+                fail("cannot write");
+                return;
+        }
+        mapping = mmap(NULL, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+                mapping = NULL;
+                fail("cannot map");
+                return;
+        }
+        elements = (char *)mapping + hdr.offset;
+}
+
+matrixFile::~matrixFile()
+{
+        if (!mapping)
+                return;
+        sync();
+        munmap(mapping, mappedBytes);
+}
+
+void matrixFile::fail(const char *what, bool system)
+{
+        std::cerr << name << ": " << what;
+        if (system && errno)
+                std::cerr << " (" << strerror(errno) << ")";
+        std::cerr << std::endl;
+        err = CL_INVALID_VALUE;
+}
+
+cl_int matrixFile::write(const std::string &path, const float *data, size_t rows, size_t cols)
+{
+        matrixFile file(path, rows, cols);
+        if (file.error() != CL_SUCCESS)
+                return file.error();
+        memcpy(file.data(), data, file.bytes());
+        return file.sync();
+}
+
+size_t matrixFile::elementSize(dtype type)
+{
+        return type == FLOAT16 ? 2 : 4;
+}
+
+size_t matrixFile::lineBytes() const
+{
+        return (order() == ROW_MAJOR ? nCols : nRows) * elementSize(type());
+}
+
+bool matrixFile::validLines(size_t first, size_t count) const
+{
+        size_t lines = order() == ROW_MAJOR ? nRows : nCols;
+        return first <= lines && count <= lines - first;
+}
+
+cl_int matrixFile::sync()
+{
+        if (!mapping || !shared)
+                return err;
+        if (msync(mapping, mappedBytes, MS_SYNC) != 0)
+                fail("cannot write back");
+        return err;
+}
+
+void matrixFile::adviseSequential()
+{
+        if (mapping)
+                madvise(mapping, mappedBytes, MADV_SEQUENTIAL);
+}
+
+cl_mem matrixFile::wrap(cl_context context, cl_mem_flags flags, cl_int *ret) const
+{
+        if (err != CL_SUCCESS)
+        {
+                *ret = err;
+                return NULL;
+        }
+        return clCreateBuffer(context, flags | CL_MEM_USE_HOST_PTR, bytes(), elements, ret);
+}
+
+cl_int matrixFile::upload(cl_command_queue queue, cl_mem buffer, size_t first, size_t count, size_t offset) const
+{
+        if (err != CL_SUCCESS)
+                return err;
+        if (!validLines(first, count))
+                return CL_INVALID_VALUE;
+        size_t line = lineBytes();
+        return clEnqueueWriteBuffer(queue, buffer, CL_TRUE, offset, count * line, (char *)elements + first * line, 0, NULL, NULL);
+}
+
+cl_int matrixFile::download(cl_command_queue queue, cl_mem buffer, size_t first, size_t count, size_t offset)
+{
+        if (err != CL_SUCCESS)
+                return err;
+        if (!validLines(first, count))
+                return CL_INVALID_VALUE;
+        size_t line = lineBytes();
+        return clEnqueueReadBuffer(queue, buffer, CL_TRUE, offset, count * line, (char *)elements + first * line, 0, NULL, NULL);
+}
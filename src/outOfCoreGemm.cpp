@@ -0,0 +1,193 @@
+#include "outOfCoreGemm.h"
+
+#include <algorithm>
+
+#define BLOCK_ALIGN 16 // keep blocks whole multiples of the GEMM tile where possible
+
+static int halve(int x)
+{
+        int h = (x + 1) / 2;
+        if (h > BLOCK_ALIGN)
+                h = (h + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+        return std::max(1, std::min(h, x - 1));
+}
+
+outOfCoreGemm::outOfCoreGemm(clSession &session, size_t budgetBytes)
+    : session(session), budget(budgetBytes)
+{
+}
+
+bool outOfCoreGemm::chooseBlocks(int M, int K, int N, size_t maxAlloc)
+{
+        // Start from the whole problem and halve the largest block dimension until one
+        // C tile plus one A and one B block fit in the budget and in one allocation each
+        size_t bm = M, bn = N, bk = K;
+        auto fits = [&]() {
+                size_t a = bm * bk * sizeof(float), b = bk * bn * sizeof(float), c = bm * bn * sizeof(float);
+                return c + 2 * std::max(a, b) <= budget && std::max(std::max(a, b), c) <= maxAlloc;
+        };
+
+        while (!fits())
+        {
+                if (bm == 1 && bn == 1 && bk == 1)
+                        return false;
+                if (bk >= bm && bk >= bn && bk > 1)
+                        bk = halve(bk);
+                else if (bm >= bn && bm > 1)
+                        bm = halve(bm);
+                else
+                        bn = halve(bn);
+        }
+
+        st.blockM = bm;
+        st.blockN = bn;
+        st.blockK = bk;
+        return true;
+}
+
+cl_mem outOfCoreGemm::block(uint64_t key, const float *host, size_t hostCols, size_t row, size_t col,
+                            size_t rows, size_t cols, cl_int *ret)
+{
+        ++clock;
+        auto it = resident.find(key);
+        if (it != resident.end())
+        {
+                st.blockReuses++;
+                lastUse[it->second] = clock;
+                return slots[it->second];
+        }
+
+        // Evict the least recently used slot
+        size_t victim = std::min_element(lastUse.begin(), lastUse.end()) - lastUse.begin();
+        if (slotKey[victim] != UINT64_MAX)
+                resident.erase(slotKey[victim]);
+        slotKey[victim] = key;
+        lastUse[victim] = clock;
+        resident[key] = victim;
+
+        // Dense rows x cols block out of the row major host matrix
+        size_t buffer_origin[3] = {0, 0, 0};
+        size_t host_origin[3] = {col * sizeof(float), row, 0};
+        size_t region[3] = {cols * sizeof(float), rows, 1};
+        cl_event ev = NULL;
+        clProfiler *prof = session.profiler();
+        *ret = clEnqueueWriteBufferRect(session.queue(), slots[victim], CL_FALSE, buffer_origin, host_origin, region,
+                                        cols * sizeof(float), 0, hostCols * sizeof(float), 0, host, 0, NULL, prof ? &ev : NULL);
+        if (prof)
+                prof->record(ev, clProfiler::HOST_TO_DEVICE, "ooc block", rows * cols * sizeof(float));
+
+        st.blockLoads++;
+        st.bytesUploaded += rows * cols * sizeof(float);
+        return slots[victim];
+}
+
+cl_int outOfCoreGemm::run(const float *A, const float *B, float *C, int M, int K, int N)
+{
+        st = stats();
+        if (M < 0 || K < 0 || N < 0)
+                return CL_INVALID_VALUE;
+        // Empty products: nothing to compute, and no block size to halve from
+        if (M == 0 || N == 0)
+                return CL_SUCCESS;
+        if (K == 0)
+        {
+                std::fill(C, C + (size_t)M * N, 0.0f);
+                return CL_SUCCESS;
+        }
+        cl_ulong maxAlloc = 0;
+        clGetDeviceInfo(session.device(), CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAlloc), &maxAlloc, NULL);
+        if (!chooseBlocks(M, K, N, maxAlloc ? maxAlloc : budget))
+                return CL_INVALID_BUFFER_SIZE;
+
+        const size_t bm = st.blockM, bn = st.blockN, bk = st.blockK;
+        const size_t nI = (M + bm - 1) / bm, nJ = (N + bn - 1) / bn, nK = (K + bk - 1) / bk;
+
+        // The rest of the budget after the C tile becomes A/B block slots. These are
+        // exact size allocations: the pool's power of two classes could overshoot the budget.
+        size_t cBytes = bm * bn * sizeof(float);
+        size_t slotBytes = std::max(bm * bk, bk * bn) * sizeof(float);
+        size_t nSlots = std::max<size_t>(2, (budget - cBytes) / slotBytes);
+
+        cl_int ret, slotRet = CL_SUCCESS;
+        cl_mem c = clCreateBuffer(session.context(), CL_MEM_READ_WRITE, cBytes, NULL, &ret);
+        for (size_t s = 0; s < nSlots && ret == CL_SUCCESS && slotRet == CL_SUCCESS; ++s)
+        {
+                // Fewer slots than the budget allows only costs reuse, two are required
+                cl_mem slot = clCreateBuffer(session.context(), CL_MEM_READ_ONLY, slotBytes, NULL, &slotRet);
+                if (slotRet == CL_SUCCESS)
+                        slots.push_back(slot);
+        }
+        slotKey.assign(slots.size(), UINT64_MAX);
+        lastUse.assign(slots.size(), 0);
+        st.slots = slots.size();
+        if (ret == CL_SUCCESS && slots.size() < 2)
+                ret = slotRet;
+        st.deviceBytes = cBytes + slots.size() * slotBytes;
+
+        // Keep the operand whose re-uploads would cost more in the outer loop
+        double bytesA = (double)M * K, bytesB = (double)K * N;
+        bool aOuter = bytesA + bytesB * nI <= bytesB + bytesA * nJ;
+        size_t nOuter = aOuter ? nI : nJ, nInner = aOuter ? nJ : nI;
+
+        size_t step = 0;
+        for (size_t o = 0; o < nOuter && ret == CL_SUCCESS; ++o)
+        {
+                for (size_t t = 0; t < nInner && ret == CL_SUCCESS; ++t, ++step)
+                {
+                        // Serpentine: the last blocks touched by one tile are the first the next needs
+                        size_t in = o % 2 == 0 ? t : nInner - 1 - t;
+                        size_t bi = aOuter ? o : in, bj = aOuter ? in : o;
+                        size_t mb = std::min(bm, M - bi * bm), nb = std::min(bn, N - bj * bn);
+
+                        for (size_t kk = 0; kk < nK && ret == CL_SUCCESS; ++kk)
+                        {
+                                size_t bkIdx = step % 2 == 0 ? kk : nK - 1 - kk;
+                                size_t kb = std::min(bk, K - bkIdx * bk);
+
+                                uint64_t keyA = (1ULL << 62) | ((uint64_t)bi << 31) | bkIdx;
+                                uint64_t keyB = (2ULL << 62) | ((uint64_t)bkIdx << 31) | bj;
+                                cl_mem a = block(keyA, A, K, bi * bm, bkIdx * bk, mb, kb, &ret);
+                                if (ret != CL_SUCCESS)
+                                        break;
+                                cl_mem b = block(keyB, B, N, bkIdx * bk, bj * bn, kb, nb, &ret);
+                                if (ret != CL_SUCCESS)
+                                        break;
+
+                                ret = session.matrixMult(a, b, c, mb, kb, nb, kk == 0 ? clSession::GEMM_TILED : clSession::GEMM_TILED_ACC);
+                                st.launches++;
+                        }
+
+                        if (ret != CL_SUCCESS)
+                                break;
+
+                        size_t buffer_origin[3] = {0, 0, 0};
+                        size_t host_origin[3] = {bj * bn * sizeof(float), bi * bm, 0};
+                        size_t region[3] = {nb * sizeof(float), mb, 1};
+                        cl_event ev = NULL;
+                        clProfiler *prof = session.profiler();
+                        ret = clEnqueueReadBufferRect(session.queue(), c, CL_FALSE, buffer_origin, host_origin, region,
+                                                      nb * sizeof(float), 0, N * sizeof(float), 0, C, 0, NULL, prof ? &ev : NULL);
+                        if (prof)
+                                prof->record(ev, clProfiler::DEVICE_TO_HOST, "ooc tile", mb * nb * sizeof(float));
+                        st.bytesDownloaded += mb * nb * sizeof(float);
+                }
+        }
+
+        clFinish(session.queue());
+        if (c)
+                clReleaseMemObject(c);
+        for (cl_mem slot : slots)
+                clReleaseMemObject(slot);
+        slots.clear();
+        resident.clear();
+        return ret;
+}
+
+void outOfCoreGemm::report(std::ostream &os) const
+{
+        os << "Out-of-core GEMM: budget " << budget / 1048576.0 << " MB, used " << st.deviceBytes / 1048576.0
+           << " MB, blocks " << st.blockM << "x" << st.blockN << "x" << st.blockK << ", " << st.slots << " slots" << std::endl
+           << "  uploaded " << st.bytesUploaded / 1048576.0 << " MB in " << st.blockLoads << " blocks ("
+           << st.blockReuses << " resident reuses), downloaded " << st.bytesDownloaded / 1048576.0 << " MB, "
+           << st.launches << " launches" << std::endl;
+}
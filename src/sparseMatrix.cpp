@@ -0,0 +1,169 @@
+#include "sparseMatrix.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+sparseMatrix::sparseMatrix(clSession &session, const hostSparse &A, format f) : session(session), fmt(f)
+{
+        upload(A);
+}
+
+sparseMatrix::sparseMatrix(clSession &session, const hostMatrix &dense, format f, float threshold) : session(session), fmt(f)
+{
+        upload(fromDense(dense, threshold));
+}
+
+sparseMatrix::~sparseMatrix()
+{
+        if (rowPtr)
+                clReleaseMemObject(rowPtr);
+        if (colIdx)
+                clReleaseMemObject(colIdx);
+        if (values)
+                clReleaseMemObject(values);
+}
+
+sparseMatrix::hostSparse sparseMatrix::fromDense(const hostMatrix &dense, float threshold)
+{
+        std::vector<Eigen::Triplet<float, int>> entries;
+        for (int r = 0; r < dense.rows(); ++r)
+                for (int c = 0; c < dense.cols(); ++c)
+                        if (std::abs(dense(r, c)) > threshold)
+                                entries.emplace_back(r, c, dense(r, c));
+        hostSparse A(dense.rows(), dense.cols());
+        A.setFromTriplets(entries.begin(), entries.end());
+        return A;
+}
+
+cl_int sparseMatrix::loadMatrixMarket(const std::string &path, hostSparse &A)
+{
+        std::ifstream in(path);
+        std::string line;
+        if (!in || !std::getline(in, line))
+        {
+                std::cerr << path << ": cannot read" << std::endl;
+                return CL_INVALID_VALUE;
+        }
+
+        // %%MatrixMarket matrix coordinate <field> <symmetry>
+        std::string banner, object, layout, field, symmetry;
+        std::istringstream header(line);
+        header >> banner >> object >> layout >> field >> symmetry;
+        for (std::string *s : {&object, &layout, &field, &symmetry})
+                std::transform(s->begin(), s->end(), s->begin(), [](unsigned char c) { return std::tolower(c); });
+        if (banner != "%%MatrixMarket" || object != "matrix" || layout != "coordinate" ||
+            (field != "real" && field != "integer" && field != "pattern") ||
+            (symmetry != "general" && symmetry != "symmetric" && symmetry != "skew-symmetric"))
+        {
+                std::cerr << path << ": not a real, integer or pattern coordinate Matrix Market file" << std::endl;
+                return CL_INVALID_VALUE;
+        }
+
+        while (std::getline(in, line) && (line.empty() || line[0] == '%'))
+                ;
+        long rows = 0, cols = 0, entries = 0;
+        if (!(std::istringstream(line) >> rows >> cols >> entries) || rows <= 0 || cols <= 0 || entries < 0)
+        {
+                std::cerr << path << ": bad size line" << std::endl;
+                return CL_INVALID_VALUE;
+        }
+
+        std::vector<Eigen::Triplet<float, int>> triplets;
+        triplets.reserve(symmetry == "general" ? entries : 2 * entries);
+        for (long i = 0; i < entries; ++i)
+        {
+                long r, c;
+                double value = 1.0;
+                if (!(in >> r >> c) || (field != "pattern" && !(in >> value)) || r < 1 || r > rows || c < 1 || c > cols)
+                {
+                        std::cerr << path << ": bad entry " << i + 1 << std::endl;
+                        return CL_INVALID_VALUE;
+                }
+                // 1-based; symmetric files store the lower triangle only
+                triplets.emplace_back(r - 1, c - 1, (float)value);
+                if (symmetry != "general" && r != c)
+                        triplets.emplace_back(c - 1, r - 1, (float)(symmetry == "symmetric" ? value : -value));
+        }
+
+        A.resize(rows, cols);
+        A.setFromTriplets(triplets.begin(), triplets.end());
+        return CL_SUCCESS;
+}
+
+double sparseMatrix::paddingRatio() const
+{
+        if (fmt == CSR || nnz == 0)
+                return 1.0;
+        return (double)nRows * ellWidth / nnz;
+}
+
+cl_mem sparseMatrix::buffer(const void *host, size_t size)
+{
+        if (err != CL_SUCCESS)
+                return NULL;
+        // Empty arrays still get a buffer so the kernel arguments are valid
+        static const int none = 0;
+        size_t allocate = std::max(size, sizeof(none));
+        cl_mem mem = clCreateBuffer(session.context(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, allocate,
+                                    (void *)(size ? host : &none), &err);
+        if (err == CL_SUCCESS)
+                bytes += allocate;
+        return mem;
+}
+
+void sparseMatrix::upload(const hostSparse &source)
+{
+        hostSparse A = source;
+        A.makeCompressed();
+        nRows = A.rows();
+        nCols = A.cols();
+        nnz = A.nonZeros();
+
+        if (fmt == CSR)
+        {
+                rowPtr = buffer(A.outerIndexPtr(), (nRows + 1) * sizeof(int));
+                colIdx = buffer(A.innerIndexPtr(), nnz * sizeof(int));
+                values = buffer(A.valuePtr(), nnz * sizeof(float));
+                return;
+        }
+
+        for (int r = 0; r < nRows; ++r)
+                ellWidth = std::max(ellWidth, A.outerIndexPtr()[r + 1] - A.outerIndexPtr()[r]);
+        // Entry j of row r at j * rows + r, padding (column 0, value 0) after each row's entries
+        std::vector<int> columns((size_t)nRows * ellWidth, 0);
+        std::vector<float> entries((size_t)nRows * ellWidth, 0.0f);
+        for (int r = 0; r < nRows; ++r)
+                for (int k = A.outerIndexPtr()[r], j = 0; k < A.outerIndexPtr()[r + 1]; ++k, ++j)
+                {
+                        columns[(size_t)j * nRows + r] = A.innerIndexPtr()[k];
+                        entries[(size_t)j * nRows + r] = A.valuePtr()[k];
+                }
+        colIdx = buffer(columns.data(), columns.size() * sizeof(int));
+        values = buffer(entries.data(), entries.size() * sizeof(float));
+}
+
+cl_int sparseMatrix::multiply(cl_mem B, cl_mem C, int N, unsigned queue) const
+{
+        if (err != CL_SUCCESS)
+                return err;
+        // Every element of C reads a whole column of B, C cannot overwrite it
+        if (B == C)
+                return CL_INVALID_VALUE;
+        if (fmt == CSR)
+                return session.csrMultiply(rowPtr, colIdx, values, nRows, nnz, B, C, N, queue);
+        return session.ellMultiply(colIdx, values, nRows, ellWidth, B, C, N, queue);
+}
+
+cl_int sparseMatrix::multiply(const deviceMatrix &B, deviceMatrix &C) const
+{
+        if (B.rows() != nCols || C.rows() != nRows || C.cols() != B.cols() || &B == &C)
+                return CL_INVALID_VALUE;
+        cl_mem b = B.device().buffer();
+        if (B.error() != CL_SUCCESS)
+                return B.error();
+        return multiply(b, C.deviceWrite().buffer(), B.cols());
+}
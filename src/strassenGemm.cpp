@@ -0,0 +1,406 @@
+#include "strassenGemm.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+
+#define CALIBRATION_MIN 128 // smallest size calibrate() times
+#define CALIBRATION_REPS 3  // timed runs per point, the median counts
+
+static double timeSeconds(const std::function<cl_int()> &op)
+{
+        if (op() != CL_SUCCESS)
+                return -1;
+        std::vector<double> t;
+        for (int i = 0; i < CALIBRATION_REPS; ++i)
+        {
+                auto start = std::chrono::high_resolution_clock::now();
+                if (op() != CL_SUCCESS)
+                        return -1;
+                t.push_back(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+        }
+        std::sort(t.begin(), t.end());
+        return t[t.size() / 2];
+}
+
+strassenGemm::strassenGemm(clSession &session, int crossover) : session(session), cross(crossover)
+{
+        // Anything but a positive number counts as unset, the crossover is measured then
+        const char *env = getenv("CL_STRASSEN_CROSSOVER");
+        if (!cross && env)
+        {
+                char *end;
+                long value = strtol(env, &end, 10);
+                if (end != env && *end == '\0' && value > 0)
+                        cross = (int)std::min<long>(value, INT_MAX);
+        }
+}
+
+strassenGemm::~strassenGemm()
+{
+        clFinish(session.queue());
+        for (cl_mem buffer : workspace)
+                if (buffer)
+                        clReleaseMemObject(buffer);
+}
+
+int strassenGemm::levels(int n) const
+{
+        int depth = 0;
+        for (int s = n; s > cross && s > 1; s = (s + 1) / 2)
+                ++depth;
+        return depth;
+}
+
+cl_mem strassenGemm::slot(size_t index, size_t floats, cl_int *ret)
+{
+        if (index >= workspace.size())
+        {
+                workspace.resize(index + 1, NULL);
+                capacity.resize(index + 1, 0);
+        }
+        if (capacity[index] < floats)
+        {
+                // Queued work on the old buffer keeps it alive until it completes
+                if (workspace[index])
+                        clReleaseMemObject(workspace[index]);
+                workspace[index] = clCreateBuffer(session.context(), CL_MEM_READ_WRITE, floats * sizeof(float), NULL, ret);
+                capacity[index] = *ret == CL_SUCCESS ? floats : 0;
+                return workspace[index];
+        }
+        *ret = CL_SUCCESS;
+        return workspace[index];
+}
+
+cl_int strassenGemm::prepare(int paddedN, int depth, bool padded)
+{
+        cl_int ret = CL_SUCCESS;
+        size_t whole = (size_t)paddedN * paddedN;
+        for (int s = PAD_A; s <= PAD_C && padded && ret == CL_SUCCESS; ++s)
+                slot(s, whole, &ret);
+        for (int level = 0; level < depth && ret == CL_SUCCESS; ++level)
+        {
+                size_t h = paddedN >> (level + 1);
+                slot(TEMPORARIES + 2 * level, h * h, &ret);
+                if (ret == CL_SUCCESS)
+                        slot(TEMPORARIES + 2 * level + 1, h * h, &ret);
+        }
+        return ret;
+}
+
+cl_int strassenGemm::reserve(int n)
+{
+        int depth = levels(n);
+        int padded = ((n + (1 << depth) - 1) >> depth) << depth;
+        return prepare(padded, depth, padded != n);
+}
+
+size_t strassenGemm::workspaceBytes() const
+{
+        size_t floats = 0;
+        for (size_t c : capacity)
+                floats += c;
+        return floats * sizeof(float);
+}
+
+cl_int strassenGemm::combine(const view &out, const view &X, const view &Y, float beta, int n)
+{
+        cl_kernel clKernel = session.kernel("strassen_kernel.cl", "strassen_combine");
+        if (!clKernel)
+                return CL_INVALID_KERNEL;
+        int arg = 0;
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &out.buffer);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &out.off);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &out.ld);
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &X.buffer);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &X.off);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &X.ld);
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &Y.buffer);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &Y.off);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &Y.ld);
+        clSetKernelArg(clKernel, arg++, sizeof(float), &beta);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &n);
+
+        size_t global_item_size[2] = {(size_t)n, (size_t)n};
+        cl_event ev = NULL;
+        clProfiler *prof = session.profiler();
+        cl_int ret = clEnqueueNDRangeKernel(session.queue(), clKernel, 2, NULL, global_item_size, NULL, 0, NULL, prof ? &ev : NULL);
+        if (prof)
+                prof->record(ev, clProfiler::KERNEL, "strassen_combine", 3.0 * n * n * sizeof(float), (double)n * n);
+        st.additions++;
+        st.flops += (double)n * n;
+        return ret;
+}
+
+cl_int strassenGemm::copy(cl_mem out, int outRows, int outCols, cl_mem X, int ldX, int rows, int cols)
+{
+        cl_kernel clKernel = session.kernel("strassen_kernel.cl", "strassen_copy");
+        if (!clKernel)
+                return CL_INVALID_KERNEL;
+        int arg = 0;
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &out);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &outRows);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &outCols);
+        clSetKernelArg(clKernel, arg++, sizeof(cl_mem), &X);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &ldX);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &rows);
+        clSetKernelArg(clKernel, arg++, sizeof(int), &cols);
+
+        size_t global_item_size[2] = {(size_t)outCols, (size_t)outRows};
+        cl_event ev = NULL;
+        clProfiler *prof = session.profiler();
+        cl_int ret = clEnqueueNDRangeKernel(session.queue(), clKernel, 2, NULL, global_item_size, NULL, 0, NULL, prof ? &ev : NULL);
+        if (prof)
+                prof->record(ev, clProfiler::KERNEL, "strassen_copy", ((double)outRows * outCols + (double)rows * cols) * sizeof(float), 0);
+        return ret;
+}
+
+cl_int strassenGemm::multiply(const view &C, const view &A, const view &B, int n, int level, int depth)
+{
+        if (level == depth)
+        {
+                st.products++;
+                st.flops += 2.0 * n * n * n;
+                return session.matrixMultStrided(A.buffer, A.off, A.ld, B.buffer, B.off, B.ld, C.buffer, C.off, C.ld, n, n, n);
+        }
+
+        // Winograd's variant with the schedule of Douglas et al. (DGEFMM): two temporaries
+        // per level, X shaped like a quadrant of A and Y like one of B, and the quadrants of
+        // C holding products until they are overwritten by the result
+        int h = n / 2;
+        view X = {workspace[TEMPORARIES + 2 * level], 0, h};
+        view Y = {workspace[TEMPORARIES + 2 * level + 1], 0, h};
+        view A11 = A.quadrant(0, 0, h), A12 = A.quadrant(0, 1, h), A21 = A.quadrant(1, 0, h), A22 = A.quadrant(1, 1, h);
+        view B11 = B.quadrant(0, 0, h), B12 = B.quadrant(0, 1, h), B21 = B.quadrant(1, 0, h), B22 = B.quadrant(1, 1, h);
+        view C11 = C.quadrant(0, 0, h), C12 = C.quadrant(0, 1, h), C21 = C.quadrant(1, 0, h), C22 = C.quadrant(1, 1, h);
+        auto product = [&](const view &out, const view &left, const view &right) { return multiply(out, left, right, h, level + 1, depth); };
+
+        const std::function<cl_int()> steps[] = {
+            [&]() { return combine(X, A11, A21, -1, h); },   // S3 = A11 - A21
+            [&]() { return combine(Y, B22, B12, -1, h); },   // T3 = B22 - B12
+            [&]() { return product(C21, X, Y); },            // P7 = S3 T3
+            [&]() { return combine(X, A21, A22, 1, h); },    // S1 = A21 + A22
+            [&]() { return combine(Y, B12, B11, -1, h); },   // T1 = B12 - B11
+            [&]() { return product(C22, X, Y); },            // P5 = S1 T1
+            [&]() { return combine(X, X, A11, -1, h); },     // S2 = S1 - A11
+            [&]() { return combine(Y, B22, Y, -1, h); },     // T2 = B22 - T1
+            [&]() { return product(C12, X, Y); },            // P6 = S2 T2
+            [&]() { return combine(X, A12, X, -1, h); },     // S4 = A12 - S2
+            [&]() { return product(C11, X, B22); },          // P3 = S4 B22
+            [&]() { return product(X, A11, B11); },          // P1 = A11 B11
+            [&]() { return combine(C12, X, C12, 1, h); },    // U2 = P1 + P6
+            [&]() { return combine(C21, C12, C21, 1, h); },  // U3 = U2 + P7
+            [&]() { return combine(C12, C12, C22, 1, h); },  // U4 = U2 + P5
+            [&]() { return combine(C22, C21, C22, 1, h); },  // U7 = U3 + P5, C22 done
+            [&]() { return combine(C12, C12, C11, 1, h); },  // U5 = U4 + P3, C12 done
+            [&]() { return combine(Y, Y, B21, -1, h); },     // T4 = T2 - B21
+            [&]() { return product(C11, A22, Y); },          // P4 = A22 T4
+            [&]() { return combine(C21, C21, C11, -1, h); }, // U6 = U3 - P4, C21 done
+            [&]() { return product(C11, A12, B21); },        // P2 = A12 B21
+            [&]() { return combine(C11, X, C11, 1, h); },    // U1 = P1 + P2, C11 done
+        };
+        for (const std::function<cl_int()> &step : steps)
+        {
+                cl_int ret = step();
+                if (ret != CL_SUCCESS)
+                        return ret;
+        }
+        return CL_SUCCESS;
+}
+
+cl_int strassenGemm::run(cl_mem A, cl_mem B, cl_mem C, int n)
+{
+        // C holds intermediate products while A and B are still read
+        if (n <= 0 || C == A || C == B)
+                return CL_INVALID_VALUE;
+        cl_int ret = CL_SUCCESS;
+        if (!cross)
+                ret = calibrate(std::max(n, CALIBRATION_MIN));
+        if (ret != CL_SUCCESS)
+                return ret;
+
+        int depth = levels(n);
+        int base = (n + (1 << depth) - 1) >> depth;
+        int padded = base << depth;
+        // Views address the buffers with int offsets
+        if ((double)padded * padded > INT_MAX)
+                return CL_INVALID_BUFFER_SIZE;
+        ret = prepare(padded, depth, padded != n);
+        if (ret != CL_SUCCESS)
+                return ret;
+
+        st = stats();
+        st.n = n;
+        st.paddedN = padded;
+        st.levels = depth;
+        st.base = base;
+        st.classicFlops = 2.0 * n * n * n;
+
+        view a = {A, 0, n}, b = {B, 0, n}, c = {C, 0, n};
+        if (padded != n)
+        {
+                a = {workspace[PAD_A], 0, padded};
+                b = {workspace[PAD_B], 0, padded};
+                c = {workspace[PAD_C], 0, padded};
+                ret = copy(a.buffer, padded, padded, A, n, n, n);
+                if (ret == CL_SUCCESS)
+                        ret = copy(b.buffer, padded, padded, B, n, n, n);
+        }
+        if (ret == CL_SUCCESS)
+                ret = multiply(c, a, b, padded, 0, depth);
+        if (ret == CL_SUCCESS && padded != n)
+                ret = copy(C, n, n, c.buffer, padded, n, n);
+        return ret;
+}
+
+cl_int strassenGemm::run(const float *A, const float *B, float *C, int n)
+{
+        cl_int ret;
+        size_t bytes = (size_t)n * n * sizeof(float);
+        bufferPool &pool = session.buffers();
+        cl_mem a = pool.acquire(bytes, CL_MEM_READ_ONLY, &ret);
+        cl_mem b = ret == CL_SUCCESS ? pool.acquire(bytes, CL_MEM_READ_ONLY, &ret) : NULL;
+        cl_mem c = ret == CL_SUCCESS ? pool.acquire(bytes, CL_MEM_READ_WRITE, &ret) : NULL;
+
+        clProfiler *prof = session.profiler();
+        cl_event ev = NULL;
+        if (ret == CL_SUCCESS)
+        {
+                ret = clEnqueueWriteBuffer(session.queue(), a, CL_FALSE, 0, bytes, A, 0, NULL, prof ? &ev : NULL);
+                if (prof)
+                        prof->record(ev, clProfiler::HOST_TO_DEVICE, "write A", bytes);
+        }
+        if (ret == CL_SUCCESS)
+        {
+                ret = clEnqueueWriteBuffer(session.queue(), b, CL_FALSE, 0, bytes, B, 0, NULL, prof ? &ev : NULL);
+                if (prof)
+                        prof->record(ev, clProfiler::HOST_TO_DEVICE, "write B", bytes);
+        }
+        if (ret == CL_SUCCESS)
+                ret = run(a, b, c, n);
+        if (ret == CL_SUCCESS)
+        {
+                ret = clEnqueueReadBuffer(session.queue(), c, CL_TRUE, 0, bytes, C, 0, NULL, prof ? &ev : NULL);
+                if (prof)
+                        prof->record(ev, clProfiler::DEVICE_TO_HOST, "read C", bytes);
+        }
+
+        clFinish(session.queue());
+        for (cl_mem buffer : {a, b, c})
+                if (buffer)
+                        pool.release(buffer);
+        return ret;
+}
+
+cl_int strassenGemm::calibrate(int maxN)
+{
+        cl_int ret = CL_SUCCESS;
+        cross = INT_MAX;
+        bufferPool &pool = session.buffers();
+        for (int n = CALIBRATION_MIN; n <= std::max(maxN, CALIBRATION_MIN) && ret == CL_SUCCESS; n *= 2)
+        {
+                size_t bytes = (size_t)n * n * sizeof(float);
+                cl_mem a = pool.acquire(bytes, CL_MEM_READ_WRITE, &ret);
+                cl_mem b = ret == CL_SUCCESS ? pool.acquire(bytes, CL_MEM_READ_WRITE, &ret) : NULL;
+                cl_mem c = ret == CL_SUCCESS ? pool.acquire(bytes, CL_MEM_READ_WRITE, &ret) : NULL;
+                // Zeros, so stale pool contents cannot slow either side down (denormals, NaN)
+                if (ret == CL_SUCCESS)
+                        ret = zero(a, n);
+                if (ret == CL_SUCCESS)
+                        ret = zero(b, n);
+                if (ret == CL_SUCCESS)
+                        ret = prepare(n, 1, false);
+
+                // The classic side is the same kernel the recursion bottoms out in
+                double classic = -1, level = -1;
+                if (ret == CL_SUCCESS)
+                {
+                        classic = timeSeconds([&]() {
+                                cl_int r = session.matrixMultStrided(a, 0, n, b, 0, n, c, 0, n, n, n, n);
+                                return r == CL_SUCCESS ? clFinish(session.queue()) : r;
+                        });
+                        level = timeSeconds([&]() {
+                                cl_int r = multiply({c, 0, n}, {a, 0, n}, {b, 0, n}, n, 0, 1);
+                                return r == CL_SUCCESS ? clFinish(session.queue()) : r;
+                        });
+                        if (classic < 0 || level < 0)
+                                ret = CL_INVALID_OPERATION;
+                }
+
+                clFinish(session.queue());
+                for (cl_mem buffer : {a, b, c})
+                        if (buffer)
+                                pool.release(buffer);
+                // Products of n recurse from here on, those of n / 2 and below do not
+                if (ret == CL_SUCCESS && level < classic)
+                {
+                        cross = n / 2;
+                        break;
+                }
+        }
+        st = stats();
+        return ret;
+}
+
+void strassenGemm::errorBounds(int n, int levels, errorReport &r)
+{
+        // Higham, Theorem 23.4 (Winograd's variant) in the max norm, to first order in u:
+        //   |C - C^| <= [(n / n0)^log2(18) (n0^2 + 6 n0) - 6 n] u max|A| max|B|
+        // for n = n0 2^levels, and n^2 u for the classic product.
+        int n0 = (n + (1 << levels) - 1) >> levels;
+        double padded = (double)n0 * (1 << levels);
+        double u = FLT_EPSILON / 2;
+        r.n = n;
+        r.levels = levels;
+        r.base = n0;
+        r.bound = (std::pow(padded / n0, std::log2(18.0)) * ((double)n0 * n0 + 6.0 * n0) - 6.0 * padded) * u;
+        r.classicBound = padded * padded * u;
+}
+
+cl_int strassenGemm::checkError(cl_mem A, cl_mem B, cl_mem C, int n, errorReport &r)
+{
+        cl_int ret;
+        bufferPool &pool = session.buffers();
+        size_t elements = (size_t)n * n;
+        cl_mem reference = pool.acquire(elements * sizeof(float), CL_MEM_READ_WRITE, &ret);
+        float difference = 0, maxA = 0, maxB = 0;
+        if (ret == CL_SUCCESS)
+                ret = session.matrixMultStrided(A, 0, n, B, 0, n, reference, 0, n, n, n, n);
+        if (ret == CL_SUCCESS)
+                ret = session.reduce(clSession::REDUCE_MAX_ABS_DIFF, C, reference, elements, &difference);
+        if (ret == CL_SUCCESS)
+                ret = session.reduce(clSession::REDUCE_MAX_ABS, A, NULL, elements, &maxA);
+        if (ret == CL_SUCCESS)
+                ret = session.reduce(clSession::REDUCE_MAX_ABS, B, NULL, elements, &maxB);
+        clFinish(session.queue());
+        if (reference)
+                pool.release(reference);
+        if (ret != CL_SUCCESS)
+                return ret;
+
+        errorBounds(n, levels(n), r);
+        r.measured = maxA > 0 && maxB > 0 ? difference / ((double)maxA * maxB) : difference;
+        lastError = r;
+        return CL_SUCCESS;
+}
+
+void strassenGemm::report(std::ostream &os) const
+{
+        os << "Strassen-Winograd GEMM: crossover ";
+        if (cross == INT_MAX)
+                os << "none (the recursion never paid off)";
+        else
+                os << cross;
+        os << ", workspace " << workspaceBytes() / 1048576.0 << " MB" << std::endl;
+        if (st.n)
+                os << "  n " << st.n << " (padded " << st.paddedN << "), " << st.levels << " levels down to " << st.base << ", "
+                   << st.products << " products and " << st.additions << " additions, "
+                   << st.flops / st.classicFlops * 100 << "% of the classic flops" << std::endl;
+        if (lastError.n)
+                os << "  max |C - C_classic| / (max |A| max |B|) = " << lastError.measured << ", bounds: Strassen-Winograd "
+                   << lastError.bound << ", classic " << lastError.classicBound << std::endl;
+}